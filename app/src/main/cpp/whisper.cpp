@@ -17,16 +17,21 @@
 #include <atomic>
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cfloat>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <climits>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <regex>
 #include <set>
@@ -38,6 +43,27 @@
 #include <codecvt>
 #endif
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+#if defined(__has_include)
+#if __has_include(<unistd.h>)
+#include <unistd.h>
+#if defined(_POSIX_MAPPED_FILES)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+#endif
+#endif
+
+#if defined(_POSIX_MAPPED_FILES) && !defined(WHISPER_BIG_ENDIAN)
+#define WHISPER_USE_MMAP
+#endif
+
 #if defined(WHISPER_BIG_ENDIAN)
 template<typename T>
 static T byteswap(T value) {
@@ -146,6 +172,23 @@ static constexpr float WHISPER_HISTORY_CONDITIONING_TEMP_CUTOFF = 0.5f;
 
 #define WHISPER_MAX_NODES 4096
 
+// with audio_ctx = -1 the encoder context of each window is the remaining audio plus WHISPER_AUDIO_CTX_PAD frames
+// of the trailing silence, rounded up to a multiple of WHISPER_AUDIO_CTX_STEP
+#define WHISPER_AUDIO_CTX_PAD  32
+#define WHISPER_AUDIO_CTX_STEP 128
+
+// whisper_full_parallel splits the audio into about WHISPER_PARALLEL_JOBS_PER_STATE jobs per state, of at least
+// WHISPER_PARALLEL_JOB_MIN_S seconds, and moves each cut by up to WHISPER_PARALLEL_CUT_SEARCH_MS to the quietest point
+#define WHISPER_PARALLEL_JOBS_PER_STATE 4
+#define WHISPER_PARALLEL_JOB_MIN_S      30
+#define WHISPER_PARALLEL_CUT_SEARCH_MS  3000
+
+// number of VAD windows evaluated by one graph of the convolutional front-end
+#define WHISPER_VAD_N_BATCH 256
+
+// max number of rejection masks memoized per grammar, ~6.5 KB each for the multilingual vocab
+#define WHISPER_GRAMMAR_CACHE_MAX 512
+
 static std::string format(const char * fmt, ...) {
     va_list ap;
     va_list ap2;
@@ -424,6 +467,81 @@ struct whisper_filters {
     int32_t n_fft;
 
     std::vector<float> data;
+
+    // sparse form of data, built at load time by whisper_filters_init_sparse()
+    // each triangular filter only has a few non-zero weights: the weights of filter j are
+    // sparse_data[sparse_offs[j] .. sparse_offs[j] + sparse_len[j]), applied to fft bins starting at sparse_start[j]
+    std::vector<int32_t> sparse_start;
+    std::vector<int32_t> sparse_len;
+    std::vector<int32_t> sparse_offs;
+    std::vector<float>   sparse_data;
+};
+
+// byte-level trie over the token strings, used by tokenize() for the longest match
+// the edges of a node are contiguous and sorted by byte value
+struct whisper_vocab_trie {
+    struct node {
+        int32_t id      = -1; // token that ends at this node
+        int32_t edge0   = 0;
+        int32_t n_edges = 0;
+    };
+
+    std::vector<node>    nodes;
+    std::vector<uint8_t> edge_byte;
+    std::vector<int32_t> edge_node;
+
+    // length of the longest token that is a prefix of [str, str + n) and its id, 0 if there is none
+    int longest_prefix(const char * str, int n, int32_t & id) const {
+        int len = 0;
+        int32_t cur = 0;
+
+        for (int i = 0; i < n; ++i) {
+            const node & nd = nodes[cur];
+
+            const uint8_t * b0 = edge_byte.data() + nd.edge0;
+            const uint8_t * b1 = b0 + nd.n_edges;
+            const uint8_t   c  = (uint8_t) str[i];
+
+            const uint8_t * it = std::lower_bound(b0, b1, c);
+            if (it == b1 || *it != c) {
+                break;
+            }
+
+            cur = edge_node[nd.edge0 + (it - b0)];
+
+            if (nodes[cur].id >= 0) {
+                id  = nodes[cur].id;
+                len = i + 1;
+            }
+        }
+
+        return len;
+    }
+};
+
+struct whisper_partial_utf8 {
+    uint32_t value;    // bit value so far (unshifted)
+    int      n_remain; // num bytes remaining; -1 indicates invalid sequence
+};
+
+// the text tokens as sequences of code points (decoded from a clean UTF-8 state), used by the grammar
+// the tokens are stored in trie order, so the tokens below a node are the range ids[tok0, tok1)
+struct whisper_vocab_cp_trie {
+    struct node {
+        int32_t tok0    = 0;
+        int32_t tok1    = 0;
+        int32_t n_end   = 0; // ids[tok0, tok0 + n_end) end at this node
+        int32_t edge0   = 0;
+        int32_t n_edges = 0;
+    };
+
+    std::vector<node>     nodes;
+    std::vector<uint32_t> edge_cp;
+    std::vector<int32_t>  edge_node;
+
+    std::vector<int32_t>              ids;
+    std::vector<whisper_partial_utf8> partial; // incomplete UTF-8 sequence at the end of ids[i]
+    std::vector<int32_t>              invalid; // tokens with an invalid UTF-8 sequence
 };
 
 struct whisper_vocab {
@@ -435,6 +553,9 @@ struct whisper_vocab {
     std::map<token, id> token_to_id;
     std::map<id, token> id_to_token;
 
+    whisper_vocab_trie    trie;    // built from token_to_id once the vocab is loaded
+    whisper_vocab_cp_trie cp_trie; // built from id_to_token once the vocab is loaded
+
     // reference: https://github.com/openai/whisper/blob/248b6cb124225dd263bb9bd32d060b6517e067f8/whisper/tokenizer.py#L334-L349
     id token_eot        = 50256;
     id token_sot        = 50257;
@@ -551,13 +672,13 @@ static size_t whisper_sched_size(struct whisper_sched & allocr) {
 }
 
 // measure the memory usage of a graph and prepare the allocr's internal data buffer
-static bool whisper_sched_graph_init(struct whisper_sched & allocr, std::vector<ggml_backend_t> backends, std::function<struct ggml_cgraph *()> && get_graph) {
+static bool whisper_sched_graph_init(struct whisper_sched & allocr, std::vector<ggml_backend_t> backends, std::function<struct ggml_cgraph *()> && get_graph, int n_nodes = WHISPER_MAX_NODES) {
     auto & sched = allocr.sched;
     auto & meta  = allocr.meta;
 
-    sched = ggml_backend_sched_new(backends.data(), nullptr, backends.size(), WHISPER_MAX_NODES, false, true);
+    sched = ggml_backend_sched_new(backends.data(), nullptr, backends.size(), n_nodes, false, true);
 
-    meta.resize(ggml_tensor_overhead()*WHISPER_MAX_NODES + ggml_graph_overhead());
+    meta.resize(ggml_tensor_overhead()*n_nodes + ggml_graph_overhead_custom(n_nodes, false));
 
     // since there are dependencies between the different graphs,
     // we need to allocate them instead of only reserving to get the correct compute buffer size
@@ -689,13 +810,25 @@ struct whisper_layer_decoder {
     struct ggml_tensor * mlp_1_b;
 };
 
+// bitmask of the sequences a kv cell belongs to
+// the decoders use the sequence ids [0, WHISPER_MAX_DECODERS) and beam search moves them through
+// [WHISPER_MAX_DECODERS, 2*WHISPER_MAX_DECODERS) when reordering the beams
+typedef uint32_t whisper_seq_mask;
+
+static_assert(2*WHISPER_MAX_DECODERS <= 8*sizeof(whisper_seq_mask), "whisper_seq_mask is too narrow for WHISPER_MAX_DECODERS");
+
+static whisper_seq_mask whisper_seq_bit(whisper_seq_id id) {
+    WHISPER_ASSERT(id >= 0 && id < (whisper_seq_id) (8*sizeof(whisper_seq_mask)));
+    return whisper_seq_mask(1) << id;
+}
+
 struct whisper_kv_cell {
     whisper_pos pos = -1;
 
-    std::set<whisper_seq_id> seq_id;
+    whisper_seq_mask seq_mask = 0;
 
     bool has_seq_id(const whisper_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return seq_mask & whisper_seq_bit(id);
     }
 };
 
@@ -708,6 +841,17 @@ struct whisper_kv_cache {
 
     std::vector<whisper_kv_cell> cells;
 
+    // one bit per cell, set while the cell is in use (pos >= 0)
+    // lets the slot search and the sequence ops skip whole words of free/used cells
+    std::vector<uint64_t> used;
+
+    // KQ_mask row of each sequence: 0 for the cells of the sequence, -INF for the rest
+    // the rows are built on first use and then only the cells listed in mask_dirty are refreshed
+    std::vector<float>       mask_rows;     // [2*WHISPER_MAX_DECODERS][size]
+    std::vector<whisper_pos> mask_pos_max;  // upper bound of the positions in each sequence
+    std::vector<uint32_t>    mask_dirty;    // cells whose seq_mask changed since the last sync
+    bool                     mask_rebuild = true;
+
     struct ggml_tensor * k;
     struct ggml_tensor * v;
 
@@ -716,6 +860,135 @@ struct whisper_kv_cache {
     std::vector<uint8_t> ctx_buf;
 };
 
+//
+// mmap
+//
+
+// read-only mapping of the model file
+// host weights point directly into the mapping, so it must outlive the model buffers
+struct whisper_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+
+    // read cursor of the mmap loader
+    size_t offs = 0;
+
+    whisper_mmap() = default;
+    whisper_mmap(const whisper_mmap &) = delete;
+    whisper_mmap & operator=(const whisper_mmap &) = delete;
+
+    ~whisper_mmap() {
+#ifdef WHISPER_USE_MMAP
+        if (addr) {
+            munmap(addr, size);
+        }
+#endif
+    }
+};
+
+static std::unique_ptr<whisper_mmap> whisper_mmap_open(const char * path, bool prefetch) {
+#ifdef WHISPER_USE_MMAP
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    void * addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps its own reference to the file
+
+    if (addr == MAP_FAILED) {
+        WHISPER_LOG_WARN("%s: mmap failed: %s\n", __func__, strerror(errno));
+        return nullptr;
+    }
+
+    if (prefetch) {
+        // start reading the whole file in the background
+        if (posix_madvise(addr, st.st_size, POSIX_MADV_WILLNEED) != 0) {
+            WHISPER_LOG_WARN("%s: posix_madvise(.., POSIX_MADV_WILLNEED) failed\n", __func__);
+        }
+    }
+
+    auto mapping = std::unique_ptr<whisper_mmap>(new whisper_mmap);
+    mapping->addr = addr;
+    mapping->size = st.st_size;
+
+    return mapping;
+#else
+    GGML_UNUSED(path);
+    GGML_UNUSED(prefetch);
+
+    return nullptr;
+#endif
+}
+
+struct whisper_mmap_tensor {
+    size_t    offs;   // offset of the tensor data in the file
+    size_t    nbytes; // size of the tensor data in the file
+    ggml_type type;   // type of the tensor data in the file
+};
+
+// walk the tensor records starting at the current read cursor without consuming them
+static bool whisper_mmap_scan_tensors(const whisper_mmap & mapping, std::map<std::string, whisper_mmap_tensor> & result) {
+    const uint8_t * base = (const uint8_t *) mapping.addr;
+
+    size_t offs = mapping.offs;
+
+    while (offs + 3*sizeof(int32_t) <= mapping.size) {
+        int32_t n_dims;
+        int32_t length;
+        int32_t ttype;
+
+        memcpy(&n_dims, base + offs, sizeof(n_dims)); offs += sizeof(n_dims);
+        memcpy(&length, base + offs, sizeof(length)); offs += sizeof(length);
+        memcpy(&ttype,  base + offs, sizeof(ttype));  offs += sizeof(ttype);
+
+        // removed types (e.g. Q4_2, Q4_3) have no block size
+        if (n_dims < 0 || n_dims > 4 || length < 0 || ttype < 0 || ttype >= GGML_TYPE_COUNT || ggml_blck_size(ggml_type(ttype)) == 0) {
+            return false;
+        }
+
+        if (offs + n_dims*sizeof(int32_t) + length > mapping.size) {
+            return false;
+        }
+
+        int64_t nelements = 1;
+        for (int i = 0; i < n_dims; ++i) {
+            int32_t ne;
+            memcpy(&ne, base + offs, sizeof(ne)); offs += sizeof(ne);
+            if (ne < 0) {
+                return false;
+            }
+            nelements *= ne;
+        }
+
+        std::string name((const char *) base + offs, length);
+        offs += length;
+
+        const size_t nbytes = (nelements*ggml_type_size(ggml_type(ttype)))/ggml_blck_size(ggml_type(ttype));
+        if (offs + nbytes > mapping.size) {
+            return false;
+        }
+
+        result[name] = { offs, nbytes, ggml_type(ttype) };
+
+        offs += nbytes;
+    }
+
+    return true;
+}
+
+// the ggml file format does not pad tensor data, so a tensor can only be used
+// in-place if its data happens to be aligned for the element type
+static size_t whisper_mmap_alignment(ggml_type type) {
+    return (type == GGML_TYPE_F16 || type == GGML_TYPE_BF16) ? sizeof(ggml_fp16_t) : sizeof(float);
+}
+
 struct whisper_model {
     e_model type = MODEL_UNKNOWN;
 
@@ -756,22 +1029,34 @@ struct whisper_model {
     // the model backend data is read-only and can be shared between processors
     std::vector<ggml_backend_buffer_t> buffers;
 
+    // model file mapping, host tensors may point directly into it
+    std::unique_ptr<whisper_mmap> mapping;
+
     // tensors
     int n_loaded;
     std::map<std::string, struct ggml_tensor *> tensors;
 };
 
-struct whisper_partial_utf8 {
-    uint32_t value;    // bit value so far (unshifted)
-    int      n_remain; // num bytes remaining; -1 indicates invalid sequence
+// rejection masks of the text tokens, memoized by the parse stacks they were computed for
+struct whisper_grammar_cache {
+    std::mutex mutex;
+
+    // key: the element pointers of all stacks, each stack terminated by nullptr
+    // value: one bit per token, set if the token is rejected
+    std::map<std::vector<const whisper_grammar_element *>, std::shared_ptr<const std::vector<uint64_t>>> masks;
 };
 
 struct whisper_grammar {
-    /*const*/ std::vector<std::vector<whisper_grammar_element>> rules;
-    std::vector<std::vector<const whisper_grammar_element *>>   stacks;
+    // the rule definitions are never modified after init and are shared by all copies of the grammar,
+    // so copying a grammar (e.g. between beams) only copies the parse stacks
+    std::shared_ptr<const std::vector<std::vector<whisper_grammar_element>>> rules;
+    std::vector<std::vector<const whisper_grammar_element *>>                 stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     whisper_partial_utf8 partial_utf8;
+
+    // shared by all copies of the grammar, like the rules the cached stacks point into
+    std::shared_ptr<whisper_grammar_cache> cache;
 };
 
 struct whisper_grammar_candidate {
@@ -793,6 +1078,16 @@ struct whisper_sequence {
     double score;            // likelihood rank score
 };
 
+// beam search hypotheses form a prefix trie over the sampled tokens
+// a beam candidate references the node of its parent sequence instead of copying it, and equal sequences
+// share the same node, so two hypotheses are equal iff their nodes are
+struct whisper_beam_node {
+    int32_t parent; // -1 for the first token of the sequence
+    int32_t depth;  // position of the token in the sequence
+
+    whisper_token_data token;
+};
+
 // TAGS: WHISPER_DECODER_INIT
 struct whisper_decoder {
     // the currently generated sequence of tokens
@@ -804,6 +1099,8 @@ struct whisper_decoder {
     int i_batch;    // the index of the token in the current batch
     int seek_delta; // the window shift found so far based on the decoded timestamp tokens
 
+    int32_t beam_node; // node of the last token of the sequence in the beam trie, -1 if empty (beam search only)
+
     bool failed;    // has the current segment failed to decode?
     bool completed; // has the decoder completed the current segment?
     bool has_ts;    // have we already sampled a non-beg timestamp token for the current segment?
@@ -813,8 +1110,16 @@ struct whisper_decoder {
     std::vector<float> logits;
     std::vector<float> logprobs;
 
-    // work container used to avoid memory allocations
-    std::vector<whisper_pair<double, whisper_vocab::id>> logits_id;
+    // computed together with probs by whisper_process_logits
+    whisper_token best_id; // first token with the highest prob, -1 if all probs are 0
+    float         best_p;
+    whisper_token ts_id;   // first timestamp token with the highest prob, -1 if all are 0
+    double        ts_sum;  // sum of the timestamp probs
+    double        ts_max;
+
+    // work containers used to avoid memory allocations
+    std::vector<whisper_pair<double, whisper_vocab::id>> logits_id; // also the sampling candidates
+    std::vector<double> sample_cdf;
 
     mutable std::mt19937 rng; // used for sampling at t > 0.0
 };
@@ -831,12 +1136,30 @@ struct vad_time_mapping {
     int64_t original_time;   // Corresponding time in original audio
 };
 
+// logit suppressions that only depend on the whisper_full_params, compiled by whisper_suppress_prepare()
+// and reused for every decoded token while the params do not change
+struct whisper_suppress {
+    // key
+    bool        valid         = false;
+    bool        no_timestamps = false;
+    bool        tdrz_enable   = false;
+    bool        suppress_nst  = false;
+    std::string suppress_regex;
+
+    std::vector<whisper_token> pre;  // applied before logits_filter_callback
+    std::vector<whisper_token> post; // suppress_regex and suppress_nst matches, applied after the callback
+
+    // dense form of post (0 or -INF per token), only built when post is large
+    std::vector<float> post_mask;
+};
+
 struct whisper_state {
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
     int64_t t_decode_us = 0;
     int64_t t_batchd_us = 0;
     int64_t t_prompt_us = 0;
+    int64_t t_draft_us = 0;
     int64_t t_mel_us = 0;
 
     int32_t n_sample = 0; // number of tokens sampled
@@ -846,6 +1169,8 @@ struct whisper_state {
     int32_t n_prompt = 0; // number of decoder calls with n_tokens >  1  (prompt encoding)
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
+    int32_t n_draft  = 0; // number of tokens proposed by the speculative draft model
+    int32_t n_accept = 0; // number of proposed tokens accepted by the decoder
 
     // number of decoders for which we have constructed the KV cache
     int32_t kv_self_n_dec = 0;
@@ -857,6 +1182,11 @@ struct whisper_state {
     // shared between all decoders
     whisper_kv_cache kv_cross;
 
+    // the mel window encoded into kv_cross (-1 - none), so encoding the same window again is skipped
+    // reset whenever the spectrogram changes
+    int32_t kv_cross_mel_offset = -1;
+    int32_t kv_cross_n_ctx      = 0;
+
     // padded buffer for flash-attention
     whisper_kv_cache kv_pad;
 
@@ -866,6 +1196,9 @@ struct whisper_state {
 
     whisper_decoder decoders[WHISPER_MAX_DECODERS];
 
+    // beam search prefix trie, reset for each decoding attempt
+    std::vector<whisper_beam_node> beam_nodes;
+
     std::vector<ggml_backend_t> backends;
 
     // - stores meta info about the intermediate tensors into the `meta` buffers
@@ -882,9 +1215,17 @@ struct whisper_state {
     std::vector<float> inp_mel;
     std::vector<float> inp_mask;
 
-    // decode output (2-dimensional array: [n_tokens][n_vocab])
+    // batch positions whose logits are computed by the last decoder graph
+    std::vector<int32_t> inp_out_ids;
+
+    // decode output, only for the tokens flagged in batch.logits (2-dimensional array: [n_outputs][n_vocab])
     std::vector<float> logits;
 
+    // row of each batch position in logits, -1 if its logits were not computed (size: n_tokens)
+    std::vector<int32_t> output_ids;
+
+    whisper_suppress suppress;
+
     std::vector<whisper_segment> result_all;
 
     // prompt history split into static prefix (prompt_past0) and dynamic rolling context (prompt_past1)
@@ -893,6 +1234,10 @@ struct whisper_state {
 
     int lang_id = 0; // english by default
 
+    // speculative decoding: state of the draft model draft_ctx, kept between the whisper_full calls
+    whisper_state         * draft_state = nullptr;
+    const whisper_context * draft_ctx   = nullptr;
+
     std::string path_model; // populated by whisper_init_from_file_with_params()
 
 #ifdef WHISPER_USE_COREML
@@ -934,6 +1279,125 @@ struct whisper_state {
     std::vector<vad_time_mapping> vad_mapping_table;
 };
 
+//
+// thread pool
+//
+
+struct whisper_threadpool_job {
+    whisper_threadpool_job(int n_tasks, const std::function<void(int)> & fn) : fn(fn), n_tasks(n_tasks) {}
+
+    const std::function<void(int)> & fn;
+
+    const int n_tasks;
+
+    std::atomic<int> next { 0 };
+
+    int n_done = 0;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    // take tasks until none are left
+    // fn is only touched while tasks remain, i.e. while the caller of parallel_for() is still waiting
+    void run() {
+        int n = 0;
+        for (int i = next.fetch_add(1); i < n_tasks; i = next.fetch_add(1)) {
+            fn(i);
+            n++;
+        }
+
+        if (n > 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            n_done += n;
+            if (n_done == n_tasks) {
+                cv.notify_all();
+            }
+        }
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return n_done == n_tasks; });
+    }
+};
+
+// persistent workers for the CPU-side stages, started on first use
+// parallel_for() can be called concurrently and from inside a task: the calling thread always works on
+// its own job, so every job completes even when all the workers are busy
+struct whisper_threadpool {
+    explicit whisper_threadpool(int n_max) : n_max(std::max(0, n_max)) {}
+
+    ~whisper_threadpool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+
+    // run fn(i) for i in [0, n_tasks) on up to n_threads threads, including the calling thread
+    void parallel_for(int n_tasks, int n_threads, const std::function<void(int)> & fn) {
+        n_threads = std::min(n_threads, n_tasks);
+
+        if (n_threads <= 1 || n_max == 0) {
+            for (int i = 0; i < n_tasks; ++i) {
+                fn(i);
+            }
+            return;
+        }
+
+        auto job = std::make_shared<whisper_threadpool_job>(n_tasks, fn);
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            while ((int) workers.size() < std::min(n_threads - 1, n_max)) {
+                workers.emplace_back(&whisper_threadpool::worker_main, this);
+            }
+
+            for (int i = 0; i < n_threads - 1; ++i) {
+                queue.emplace_back([job] { job->run(); });
+            }
+        }
+        cv.notify_all();
+
+        job->run();
+        job->wait();
+    }
+
+private:
+    void worker_main() {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return stop || !queue.empty(); });
+                if (stop && queue.empty()) {
+                    return;
+                }
+                task = std::move(queue.front());
+                queue.pop_front();
+            }
+            task();
+        }
+    }
+
+    const int n_max;
+
+    std::vector<std::thread> workers;
+
+    std::deque<std::function<void()>> queue;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    bool stop = false;
+};
+
 struct whisper_context {
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
@@ -948,6 +1412,10 @@ struct whisper_context {
 
     whisper_state * state = nullptr;
 
+    // params.threadpool, or a pool owned by the context
+    whisper_threadpool * threadpool = nullptr;
+    std::unique_ptr<whisper_threadpool> threadpool_own;
+
     std::string path_model; // populated by whisper_init_from_file_with_params()
 };
 
@@ -989,6 +1457,11 @@ static bool whisper_kv_cache_init(
     cache.cells.clear();
     cache.cells.resize(n_ctx);
 
+    cache.used.assign((n_ctx + 63)/64, 0);
+
+    cache.mask_rebuild = true;
+    cache.mask_dirty.clear();
+
     struct ggml_context * ctx = ggml_init(params);
 
     if (!ctx) {
@@ -1012,6 +1485,86 @@ static bool whisper_kv_cache_init(
     return true;
 }
 
+static int whisper_bit_lowest(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(x);
+#else
+    int r = 0;
+    while (!(x & 1)) { x >>= 1; r++; }
+    return r;
+#endif
+}
+
+static int whisper_bit_highest(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(x);
+#else
+    int r = 0;
+    while (x >>= 1) { r++; }
+    return r;
+#endif
+}
+
+// record that the seq_mask of cell i changed, so that its column of the KQ_mask rows gets refreshed
+static void whisper_kv_cache_mark(struct whisper_kv_cache & cache, uint32_t i) {
+    if (cache.mask_rebuild) {
+        return;
+    }
+
+    // past this point a full rebuild is cheaper than the individual updates
+    if (cache.mask_dirty.size() >= cache.size/4) {
+        cache.mask_rebuild = true;
+        cache.mask_dirty.clear();
+        return;
+    }
+
+    cache.mask_dirty.push_back(i);
+}
+
+static void whisper_kv_cache_cell_use(struct whisper_kv_cache & cache, uint32_t i, whisper_pos pos, whisper_seq_mask seq_mask) {
+    cache.cells[i].pos      = pos;
+    cache.cells[i].seq_mask = seq_mask;
+
+    cache.used[i/64] |= uint64_t(1) << (i%64);
+
+    whisper_kv_cache_mark(cache, i);
+}
+
+static void whisper_kv_cache_cell_free(struct whisper_kv_cache & cache, uint32_t i) {
+    cache.cells[i].pos      = -1;
+    cache.cells[i].seq_mask = 0;
+
+    cache.used[i/64] &= ~(uint64_t(1) << (i%64));
+
+    whisper_kv_cache_mark(cache, i);
+}
+
+// index of the last used cell in [i0, i1), or -1 if they are all free
+static int32_t whisper_kv_cache_last_used(const struct whisper_kv_cache & cache, uint32_t i0, uint32_t i1) {
+    if (i0 >= i1) {
+        return -1;
+    }
+
+    const uint32_t w0 = i0/64;
+
+    for (uint32_t w = (i1 - 1)/64 + 1; w-- > w0;) {
+        uint64_t bits = cache.used[w];
+
+        if (w == w0 && i0%64 != 0) {
+            bits &= ~uint64_t(0) << (i0%64);
+        }
+        if (w == (i1 - 1)/64 && i1%64 != 0) {
+            bits &= ~uint64_t(0) >> (64 - i1%64);
+        }
+
+        if (bits) {
+            return w*64 + whisper_bit_highest(bits);
+        }
+    }
+
+    return -1;
+}
+
 static void whisper_kv_cache_free(struct whisper_kv_cache & cache) {
     ggml_backend_buffer_free(cache.buffer);
 }
@@ -1036,20 +1589,15 @@ static bool whisper_kv_cache_find_slot(
             continue;
         }
 
-        bool found = true;
-        for (uint32_t i = 0; i < n_tokens; i++) {
-            if (cache.cells[cache.head + i].pos >= 0) {
-                found = false;
-                cache.head += i + 1;
-                n_tested   += i + 1;
-                break;
-            }
-        }
-
-        if (found) {
+        // no slot can start at or before the last used cell of the candidate range
+        const int32_t i_used = whisper_kv_cache_last_used(cache, cache.head, cache.head + n_tokens);
+        if (i_used < 0) {
             break;
         }
 
+        n_tested  += i_used + 1 - cache.head;
+        cache.head = i_used + 1;
+
         if (n_tested >= n_ctx) {
             //WHISPER_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
             return false;
@@ -1057,11 +1605,12 @@ static bool whisper_kv_cache_find_slot(
     }
 
     for (uint32_t i = 0; i < n_tokens; i++) {
-        cache.cells[cache.head + i].pos = batch.pos[i];
-
+        whisper_seq_mask seq_mask = 0;
         for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
+            seq_mask |= whisper_seq_bit(batch.seq_id[i][j]);
         }
+
+        whisper_kv_cache_cell_use(cache, cache.head + i, batch.pos[i], seq_mask);
     }
 
     return true;
@@ -1069,22 +1618,22 @@ static bool whisper_kv_cache_find_slot(
 
 // find how many cells are currently in use
 static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache) {
-    for (uint32_t i = cache.size - 1; i > 0; --i) {
-        if (cache.cells[i].pos >= 0 && !cache.cells[i].seq_id.empty()) {
-            return i + 1;
-        }
-    }
+    const int32_t i_used = whisper_kv_cache_last_used(cache, 1, cache.size);
 
-    return 1;
+    return i_used < 0 ? 1 : i_used + 1;
 }
 
 static void whisper_kv_cache_clear(struct whisper_kv_cache & cache) {
     for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
-        cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
+        cache.cells[i].pos      = -1;
+        cache.cells[i].seq_mask = 0;
     }
+    std::fill(cache.used.begin(), cache.used.end(), 0);
     cache.head = 0;
 
+    cache.mask_rebuild = true;
+    cache.mask_dirty.clear();
+
     ggml_backend_buffer_clear(cache.buffer, 0);
 }
 
@@ -1098,18 +1647,26 @@ static void whisper_kv_cache_seq_rm(
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<whisper_pos>::max();
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
-            } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
-            } else {
+    const whisper_seq_mask seq_mask = seq_id < 0 ? ~whisper_seq_mask(0) : whisper_seq_bit(seq_id);
+
+    // only the used cells can hold the sequence
+    for (uint32_t w = 0; w < cache.used.size(); ++w) {
+        for (uint64_t bits = cache.used[w]; bits; bits &= bits - 1) {
+            const uint32_t i = w*64 + whisper_bit_lowest(bits);
+
+            whisper_kv_cell & cell = cache.cells[i];
+
+            if (cell.pos < p0 || cell.pos >= p1 || !(cell.seq_mask & seq_mask)) {
                 continue;
             }
-            if (cache.cells[i].seq_id.empty()) {
-                cache.cells[i].pos = -1;
+
+            cell.seq_mask &= ~seq_mask;
+
+            if (cell.seq_mask == 0) {
+                whisper_kv_cache_cell_free(cache, i);
                 if (new_head == cache.size) new_head = i;
+            } else {
+                whisper_kv_cache_mark(cache, i);
             }
         }
     }
@@ -1129,29 +1686,87 @@ static void whisper_kv_cache_seq_cp(
 
     cache.head = 0;
 
-    for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+    const whisper_seq_mask mask_src = whisper_seq_bit(seq_id_src);
+    const whisper_seq_mask mask_dst = whisper_seq_bit(seq_id_dst);
+
+    for (uint32_t w = 0; w < cache.used.size(); ++w) {
+        for (uint64_t bits = cache.used[w]; bits; bits &= bits - 1) {
+            const uint32_t i = w*64 + whisper_bit_lowest(bits);
+
+            whisper_kv_cell & cell = cache.cells[i];
+
+            if ((cell.seq_mask & mask_src) && !(cell.seq_mask & mask_dst) && cell.pos >= p0 && cell.pos < p1) {
+                cell.seq_mask |= mask_dst;
+
+                whisper_kv_cache_mark(cache, i);
+            }
         }
     }
 }
 
-static uint32_t whisper_kv_cache_get_padding(const struct whisper_context & wctx) {
-    if (!wctx.params.flash_attn || !wctx.params.use_gpu) {
-        return 1u;
-    }
+// bring the per-sequence KQ_mask rows up to date with the cells
+static void whisper_kv_cache_mask_sync(struct whisper_kv_cache & cache) {
+    const int n_seq = 2*WHISPER_MAX_DECODERS;
+    const int n     = cache.size;
 
-#ifdef GGML_USE_METAL
-    if (wctx.params.use_gpu) {
-        return 32u;
-    }
-#endif
+    if (cache.mask_rebuild) {
+        cache.mask_rows.resize((size_t) n_seq*n);
+        cache.mask_pos_max.assign(n_seq, -1);
 
-#ifdef GGML_USE_CUDA
-    if (wctx.params.use_gpu) {
-        return 256u;
-    }
-#endif
+        for (int s = 0; s < n_seq; ++s) {
+            float * row = cache.mask_rows.data() + (size_t) s*n;
+
+            // branch-free so that the compiler can vectorize it
+            for (int i = 0; i < n; ++i) {
+                row[i] = (cache.cells[i].seq_mask >> s) & 1 ? 0.0f : -INFINITY;
+            }
+        }
+
+        for (int i = 0; i < n; ++i) {
+            for (whisper_seq_mask m = cache.cells[i].seq_mask; m; m &= m - 1) {
+                const int s = whisper_bit_lowest(m);
+                cache.mask_pos_max[s] = std::max(cache.mask_pos_max[s], cache.cells[i].pos);
+            }
+        }
+
+        cache.mask_rebuild = false;
+        cache.mask_dirty.clear();
+
+        return;
+    }
+
+    for (const uint32_t i : cache.mask_dirty) {
+        const whisper_kv_cell & cell = cache.cells[i];
+
+        for (int s = 0; s < n_seq; ++s) {
+            cache.mask_rows[(size_t) s*n + i] = (cell.seq_mask >> s) & 1 ? 0.0f : -INFINITY;
+        }
+
+        for (whisper_seq_mask m = cell.seq_mask; m; m &= m - 1) {
+            const int s = whisper_bit_lowest(m);
+            cache.mask_pos_max[s] = std::max(cache.mask_pos_max[s], cell.pos);
+        }
+    }
+
+    cache.mask_dirty.clear();
+}
+
+static uint32_t whisper_kv_cache_get_padding(const struct whisper_context & wctx) {
+    if (!wctx.params.flash_attn || !wctx.params.use_gpu) {
+        return 1u;
+    }
+
+#ifdef GGML_USE_METAL
+    if (wctx.params.use_gpu) {
+        return 32u;
+    }
+#endif
+
+#ifdef GGML_USE_CUDA
+    if (wctx.params.use_gpu) {
+        return 256u;
+    }
+#endif
 
     return 1u;
 }
@@ -1467,6 +2082,104 @@ static ggml_backend_buffer_type_t select_weight_buft(const whisper_hparams & hpa
     return nullptr;
 }
 
+// keep only the non-zero band of each mel filter
+static void whisper_filters_init_sparse(whisper_filters & filters) {
+    const int n_mel = filters.n_mel;
+    const int n_fft = filters.n_fft;
+
+    filters.sparse_start.resize(n_mel);
+    filters.sparse_len  .resize(n_mel);
+    filters.sparse_offs .resize(n_mel);
+    filters.sparse_data .clear();
+
+    for (int j = 0; j < n_mel; ++j) {
+        const float * w = filters.data.data() + j*n_fft;
+
+        int k0 = 0;
+        int k1 = n_fft;
+        while (k0 < k1 && w[k0]     == 0.0f) k0++;
+        while (k1 > k0 && w[k1 - 1] == 0.0f) k1--;
+
+        filters.sparse_start[j] = k0;
+        filters.sparse_len[j]   = k1 - k0;
+        filters.sparse_offs[j]  = filters.sparse_data.size();
+
+        filters.sparse_data.insert(filters.sparse_data.end(), w + k0, w + k1);
+    }
+}
+
+static void whisper_vocab_cp_trie_build(whisper_vocab & vocab);
+
+// entries [i0, i1) of the sorted tokens share their first depth bytes and end up below node
+static void whisper_vocab_trie_build_node(
+               whisper_vocab_trie & trie,
+        const std::vector<std::pair<const std::string *, int32_t>> & entries,
+                          int32_t   node,
+                              int   i0,
+                              int   i1,
+                           size_t   depth) {
+    // the shortest string of the range sorts first
+    if (i0 < i1 && entries[i0].first->size() == depth) {
+        trie.nodes[node].id = entries[i0].second;
+        ++i0;
+    }
+
+    // one edge per distinct next byte
+    int n_edges = 0;
+    for (int i = i0; i < i1; ++i) {
+        if (i == i0 || (*entries[i].first)[depth] != (*entries[i - 1].first)[depth]) {
+            ++n_edges;
+        }
+    }
+
+    const int32_t edge0 = trie.edge_byte.size();
+
+    trie.nodes[node].edge0   = edge0;
+    trie.nodes[node].n_edges = n_edges;
+
+    trie.edge_byte.resize(edge0 + n_edges);
+    trie.edge_node.resize(edge0 + n_edges);
+
+    for (int i = i0, e = edge0; i < i1; ++e) {
+        const char c = (*entries[i].first)[depth];
+
+        int j = i + 1;
+        while (j < i1 && (*entries[j].first)[depth] == c) {
+            ++j;
+        }
+
+        const int32_t child = trie.nodes.size();
+        trie.nodes.emplace_back();
+
+        trie.edge_byte[e] = (uint8_t) c;
+        trie.edge_node[e] = child;
+
+        whisper_vocab_trie_build_node(trie, entries, child, i, j, depth + 1);
+
+        i = j;
+    }
+}
+
+static void whisper_vocab_trie_build(whisper_vocab_trie & trie, const std::map<whisper_vocab::token, whisper_vocab::id> & token_to_id) {
+    // std::map is ordered by the unsigned byte values, so the edges come out sorted
+    std::vector<std::pair<const std::string *, int32_t>> entries;
+    entries.reserve(token_to_id.size());
+
+    for (const auto & kv : token_to_id) {
+        if (!kv.first.empty()) {
+            entries.emplace_back(&kv.first, kv.second);
+        }
+    }
+
+    trie.nodes.clear();
+    trie.edge_byte.clear();
+    trie.edge_node.clear();
+
+    trie.nodes.emplace_back();
+
+    whisper_vocab_trie_build_node(trie, entries, 0, 0, (int) entries.size(), 0);
+}
+
 // load the model from a ggml file
 //
 // file format:
@@ -1579,6 +2292,8 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         filters.data.resize(filters.n_mel * filters.n_fft);
         loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
         BYTESWAP_FILTERS(filters);
+
+        whisper_filters_init_sparse(filters);
     }
 
     // load vocab
@@ -1667,6 +2382,9 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             }
         }
 
+        whisper_vocab_trie_build(vocab.trie, vocab.token_to_id);
+        whisper_vocab_cp_trie_build(vocab);
+
         WHISPER_LOG_INFO("%s: n_langs       = %d\n", __func__, vocab.num_languages());
     }
 
@@ -1841,6 +2559,52 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         ggml_free(ctx);
     }
 
+    // with a mapped model file, point the host tensors directly at the file data instead of copying them
+    ggml_backend_buffer_t buf_mmap = nullptr;
+    if (model.mapping) {
+        std::map<std::string, whisper_mmap_tensor> file_tensors;
+
+        auto it = ctx_map.find(ggml_backend_cpu_buffer_type());
+        if (it != ctx_map.end() && whisper_mmap_scan_tensors(*model.mapping, file_tensors)) {
+            std::set<const ggml_tensor *> host_tensors;
+            for (ggml_tensor * t = ggml_get_first_tensor(it->second); t != nullptr; t = ggml_get_next_tensor(it->second, t)) {
+                host_tensors.insert(t);
+            }
+
+            buf_mmap = ggml_backend_cpu_buffer_from_ptr(model.mapping->addr, model.mapping->size);
+
+            int    n_mapped    = 0;
+            size_t size_mapped = 0;
+
+            for (auto & p : model.tensors) {
+                ggml_tensor * tensor = p.second;
+
+                const auto ft = file_tensors.find(p.first);
+                if (ft == file_tensors.end() || host_tensors.count(tensor) == 0) {
+                    continue;
+                }
+
+                if (ft->second.type != tensor->type || ft->second.nbytes != ggml_nbytes(tensor) || ft->second.offs % whisper_mmap_alignment(tensor->type) != 0) {
+                    continue;
+                }
+
+                ggml_backend_tensor_alloc(buf_mmap, tensor, (uint8_t *) model.mapping->addr + ft->second.offs);
+
+                n_mapped++;
+                size_mapped += ggml_nbytes(tensor);
+            }
+
+            if (n_mapped > 0) {
+                model.buffers.emplace_back(buf_mmap);
+
+                WHISPER_LOG_INFO("%s: %12s total size = %8.2f MB (%d tensors mapped in-place)\n", __func__, ggml_backend_buffer_name(buf_mmap), size_mapped / 1e6, n_mapped);
+            } else {
+                ggml_backend_buffer_free(buf_mmap);
+                buf_mmap = nullptr;
+            }
+        }
+    }
+
     // allocate tensors in the backend buffers
     for (auto & p : ctx_map) {
         ggml_backend_buffer_type_t buft = p.first;
@@ -1915,7 +2679,10 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 return false;
             }
 
-            if (ggml_backend_buffer_is_host(tensor->buffer)) {
+            if (buf_mmap && tensor->buffer == buf_mmap) {
+                // the tensor data already points into the mapped file, just skip over it
+                model.mapping->offs += ggml_nbytes(tensor);
+            } else if (ggml_backend_buffer_is_host(tensor->buffer)) {
                 // for the CPU and Metal backend, we can read directly into the tensor
                 loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
                 BYTESWAP_TENSOR(tensor);
@@ -1946,6 +2713,11 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         ggml_backend_buffer_set_usage(buf, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
     }
 
+    // nothing references the mapping - release it
+    if (!buf_mmap) {
+        model.mapping.reset();
+    }
+
     wctx.t_load_us = ggml_time_us() - t_start_us;
 
     return true;
@@ -2064,6 +2836,16 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
     const float KQscale = 1.0f/sqrtf(float(n_state_head));
 
+    // the K/V rows [n_ctx, n_ctx_pad) of kv_pad are left over from longer windows - the mask hides them
+    struct ggml_tensor * KQ_mask_f16 = nullptr;
+    if (wctx.params.flash_attn) {
+        struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_ctx_pad, GGML_PAD(n_ctx, GGML_KQ_MASK_PAD), 1);
+        ggml_set_name(KQ_mask, "KQ_mask_enc");
+        ggml_set_input(KQ_mask);
+
+        KQ_mask_f16 = ggml_cast(ctx0, KQ_mask, GGML_TYPE_F16);
+    }
+
     // ===================================================================
     // NOTE: experimenting with partial evaluation of the encoder (ignore)
     //static int iter = -1;
@@ -2152,7 +2934,7 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                             ggml_element_size(kv_pad.v)*n_state_head,
                             0);
 
-                cur = ggml_flash_attn_ext(ctx0, Q, K, V, nullptr, KQscale, 0.0f, 0.0f);
+                cur = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask_f16, KQscale, 0.0f, 0.0f);
 
                 cur = ggml_reshape_2d(ctx0, cur, n_state, n_ctx);
             } else {
@@ -2341,185 +3123,96 @@ static struct ggml_cgraph * whisper_build_graph_cross(
     return gf;
 }
 
-// evaluate the encoder with the given state
-//
-// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
-// part of the transformer model and returns the encoded features
-//
-//   - wctx:      the model
-//   - wstate:     the state of the encoder
-//   - n_threads:  number of threads to use
-//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
-//
-static bool whisper_encode_internal(
-        whisper_context & wctx,
-          whisper_state & wstate,
-              const int   mel_offset,
-              const int   n_threads,
-    ggml_abort_callback   abort_callback,
-                   void * abort_callback_data) {
-    const int64_t t_start_us = ggml_time_us();
-
-    // conv
-    {
-        auto & sched = wstate.sched_conv.sched;
+// the batched encoder graph evaluates the conv, the encoder and the cross-attention memory of several audio
+// windows at once - one window per state, all with the same audio context
+// the windows are stacked along the batch dimension, so each weight multiplication runs over the frames of all
+// the windows, while the self-attention and the cross kv of each window stay separate
+struct whisper_encode_part {
+          whisper_state * state;
+                    int   mel_offset;
 
-        ggml_cgraph * gf = whisper_build_graph_conv(wctx, wstate);
+    ggml_abort_callback   abort_callback;
+                   void * abort_callback_data;
+};
 
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
-        }
+static struct ggml_cgraph * whisper_build_graph_encoder_batch(
+           whisper_context & wctx,
+             whisper_sched & sched,
+ const whisper_encode_part * parts,
+                       int   n_parts) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
 
-        struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
+    WHISPER_ASSERT(n_parts > 0);
 
-        // set the input
-        {
-            const auto & mel_inp = wstate.mel;
-            const int n_ctx      = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+    const int n_ctx   = parts[0].state->exp_n_audio_ctx > 0 ? parts[0].state->exp_n_audio_ctx : hparams.n_audio_ctx;
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+    const int n_layer = hparams.n_audio_layer;
+    const int n_mels  = hparams.n_mels;
 
-            assert(mel->type == GGML_TYPE_F32);
-            assert(mel_inp.n_mel == wctx.model.hparams.n_mels);
+    const int n_state_head = n_state/n_head;
 
-            wstate.inp_mel.resize(ggml_nelements(mel));
+    const int n_ctx_pad = GGML_PAD(n_ctx, 256);
 
-            float * dst = wstate.inp_mel.data();
-            memset(dst, 0, ggml_nbytes(mel));
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ sched.meta.size(),
+        /*.mem_buffer =*/ sched.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
 
-            const int i0 = std::min(mel_offset,           mel_inp.n_len);
-            const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+    struct ggml_context * ctx0 = ggml_init(params);
 
-            for (int j = 0; j < mel_inp.n_mel; ++j) {
-                for (int i = i0; i < i1; ++i) {
-                    dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
-                }
-            }
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES*n_parts, false);
 
-            ggml_backend_tensor_set(mel, wstate.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
-        }
+    struct ggml_tensor * mel = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels, n_parts);
+    ggml_set_name(mel, "mel");
+    ggml_set_input(mel);
 
-        if (!whisper_encode_external(wstate)) {
-            if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
-                return false;
-            }
-        } else {
-            ggml_backend_sched_reset(sched);
+    // frames [p*n_ctx, (p + 1)*n_ctx) of a [n, n_ctx*n_parts] tensor
+    const auto part_rows = [&](struct ggml_tensor * t, int p) {
+        return ggml_view_2d(ctx0, t, t->ne[0], n_ctx, t->nb[1], (size_t) p*n_ctx*t->nb[1]);
+    };
 
-#if defined(WHISPER_USE_COREML)
-            whisper_coreml_encode(wstate.ctx_coreml, mel->ne[0], mel->ne[1], (float *) mel->data, (float *) wstate.embd_enc->data);
-#elif defined(WHISPER_USE_OPENVINO)
-            whisper_openvino_encode(wstate.ctx_openvino, mel, wstate.embd_enc);
-#endif
-        }
-    }
+    struct ggml_tensor * cur;
 
-    // encoder
-    if (!whisper_encode_external(wstate)) {
-        auto & sched = wstate.sched_encode.sched;
+    // convolution + gelu
+    {
+        cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
+        cur = ggml_add(ctx0, cur, model.e_conv_1_b);
 
-        ggml_cgraph * gf = whisper_build_graph_encoder(wctx, wstate);
+        cur = ggml_gelu(ctx0, cur);
 
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
-        }
+        cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
+        cur = ggml_add(ctx0, cur, model.e_conv_2_b);
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
-            return false;
-        }
+        cur = ggml_gelu(ctx0, cur);
     }
 
-    // cross
+    // [n_ctx, n_state, n_parts] -> [n_state, n_ctx*n_parts]
     {
-        auto & sched = wstate.sched_cross.sched;
-
-        ggml_cgraph * gf = whisper_build_graph_cross(wctx, wstate);
+        struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, model.e_pe->nb[1], 0);
 
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
-        }
-
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
-            return false;
-        }
+        cur = ggml_add(ctx0, ggml_cont(ctx0, ggml_permute(ctx0, cur, 1, 0, 2, 3)), e_pe);
+        cur = ggml_reshape_2d(ctx0, cur, n_state, n_ctx*n_parts);
     }
 
-    wstate.t_encode_us += ggml_time_us() - t_start_us;
-    wstate.n_encode++;
-
-    return !(abort_callback && abort_callback(abort_callback_data));
-}
-
-static struct ggml_cgraph * whisper_build_graph_decoder(
-         whisper_context & wctx,
-         whisper_state   & wstate,
-     const whisper_batch & batch,
-                    bool   save_alignment_heads_QKs,
-                    bool   worst_case) {
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
-
-    auto & kv_self = wstate.kv_self;
-
-    WHISPER_ASSERT(!!kv_self.buffer);
-
-    const int n_ctx   = kv_self.size;
-    const int n_state = hparams.n_text_state;
-    const int n_head  = hparams.n_text_head;
-    const int n_layer = hparams.n_text_layer;
-
-    const int n_state_head = n_state/n_head;
-
-    const int n_tokens    = batch.n_tokens;
-    const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-
-    const int n_audio_ctx_pad = GGML_PAD(n_audio_ctx, 256);
-
-    const int32_t n_kv    = worst_case ? n_ctx            : kv_self.n;
-    const int32_t kv_head = worst_case ? n_ctx - n_tokens : kv_self.head;
-
-    //WHISPER_LOG_DEBUG("%s: n_past = %d, n_tokens = %d, n_audio_ctx = %d, n_ctx = %d\n", __func__, n_past, n_tokens, n_audio_ctx, n_ctx);
-
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_decode.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_decode.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
-
-    struct ggml_context * ctx0 = ggml_init(params);
-
-    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
-
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
-    ggml_set_name(embd, "embd");
-    ggml_set_input(embd);
-
-    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
-    ggml_set_name(position, "position");
-    ggml_set_input(position);
-
-    const float KQscale = pow(float(n_state_head), -0.25);
-
-    struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD), 1);
-    ggml_set_name(KQ_mask, "KQ_mask");
-    ggml_set_input(KQ_mask);
+    const float KQscale = 1.0f/sqrtf(float(n_state_head));
 
-    struct ggml_tensor * KQ_mask_f16 = ggml_cast(ctx0, KQ_mask, GGML_TYPE_F16);
+    // the K/V rows [n_ctx, n_ctx_pad) of kv_pad are left over from longer windows - the mask hides them
+    struct ggml_tensor * KQ_mask_f16 = nullptr;
+    if (wctx.params.flash_attn) {
+        struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_ctx_pad, GGML_PAD(n_ctx, GGML_KQ_MASK_PAD), 1);
+        ggml_set_name(KQ_mask, "KQ_mask_enc");
+        ggml_set_input(KQ_mask);
 
-    // token encoding + position encoding
-    struct ggml_tensor * cur =
-        ggml_add(ctx0,
-                ggml_get_rows(ctx0, model.d_te, embd),
-                ggml_get_rows(ctx0, model.d_pe, position));
+        KQ_mask_f16 = ggml_cast(ctx0, KQ_mask, GGML_TYPE_F16);
+    }
 
     struct ggml_tensor * inpL = cur;
 
-    // [EXPERIMENTAL] Token-level timestamps with DTW
-    struct ggml_tensor * aheads_cross_QKs = nullptr;
-
     for (int il = 0; il < n_layer; ++il) {
-        const auto & layer = model.layers_decoder[il];
+        const auto & layer = model.layers_encoder[il];
 
         // norm
         {
@@ -2527,9 +3220,7 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
             // cur = ln_0_w*cur + ln_0_b
             cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        cur,
-                        layer.attn_ln_0_w),
+                    ggml_mul(ctx0, cur, layer.attn_ln_0_w),
                     layer.attn_ln_0_b);
         }
 
@@ -2539,96 +3230,93 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                     layer.attn_q_w,
                     cur);
 
-            Qcur = ggml_add(ctx0,
-                        Qcur,
-                        layer.attn_q_b);
-
-            Qcur = ggml_scale(ctx0, Qcur, KQscale);
+            Qcur = ggml_add(ctx0, Qcur, layer.attn_q_b);
 
             // note: no bias for Key
             struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
                     layer.attn_k_w,
                     cur);
 
-            Kcur = ggml_scale(ctx0, Kcur, KQscale);
-
-            // store key and value to memory
-            {
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
-                        layer.attn_v_w,
-                        cur);
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                    layer.attn_v_w,
+                    cur);
 
-                Vcur = ggml_add(ctx0,
-                            Vcur,
-                            layer.attn_v_b);
+            Vcur = ggml_add(ctx0, Vcur, layer.attn_v_b);
 
-                struct ggml_tensor * k;
-                struct ggml_tensor * v;
+            // ------
 
-                if (wctx.params.flash_attn) {
-                    k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+            if (wctx.params.flash_attn) {
+                // the padded K and V of each window live in the kv_pad of its state
+                struct ggml_tensor * outs = nullptr;
 
-                    v = ggml_view_1d(ctx0, kv_self.v, n_tokens*n_state,
-                            (ggml_element_size(kv_self.v)*n_state)*(il*n_ctx + kv_head));
-                } else {
-                    Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens));
+                for (int p = 0; p < n_parts; ++p) {
+                    auto & kv_pad = parts[p].state->kv_pad;
 
-                    k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+                    WHISPER_ASSERT(!!kv_pad.buffer);
 
-                    v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
-                            (   n_ctx)*ggml_element_size(kv_self.v),
-                            (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
-                }
+                    struct ggml_tensor * Q =
+                        ggml_permute(ctx0,
+                                ggml_reshape_3d(ctx0, part_rows(Qcur, p), n_state_head, n_head, n_ctx),
+                                0, 2, 1, 3);
 
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
-            }
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, part_rows(Kcur, p), ggml_view_1d(ctx0, kv_pad.k, n_ctx*n_state, 0)));
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, part_rows(Vcur, p), ggml_view_1d(ctx0, kv_pad.v, n_ctx*n_state, 0)));
 
-            // ------
+                    struct ggml_tensor * K =
+                        ggml_view_3d(ctx0, kv_pad.k,
+                                n_state_head, n_ctx_pad, n_head,
+                                ggml_element_size(kv_pad.k)*n_state,
+                                ggml_element_size(kv_pad.k)*n_state_head,
+                                0);
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_tokens),
-                        0, 2, 1, 3);
+                    struct ggml_tensor * V =
+                        ggml_view_3d(ctx0, kv_pad.v,
+                                n_state_head, n_ctx_pad, n_head,
+                                ggml_element_size(kv_pad.v)*n_state,
+                                ggml_element_size(kv_pad.v)*n_state_head,
+                                0);
 
-            struct ggml_tensor * K =
-                ggml_view_3d(ctx0, kv_self.k,
-                        n_state_head, n_kv, n_head,
-                        ggml_element_size(kv_self.k)*n_state,
-                        ggml_element_size(kv_self.k)*n_state_head,
-                        ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+                    struct ggml_tensor * out = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask_f16, KQscale, 0.0f, 0.0f);
 
-            if (wctx.params.flash_attn) {
-                struct ggml_tensor * V =
-                    ggml_view_3d(ctx0, kv_self.v,
-                            n_state_head, n_kv, n_head,
-                            ggml_element_size(kv_self.v)*n_state,
-                            ggml_element_size(kv_self.v)*n_state_head,
-                            ggml_element_size(kv_self.v)*n_state*n_ctx*il);
+                    out = ggml_reshape_2d(ctx0, out, n_state, n_ctx);
 
-                cur = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask_f16, 1.0f, 0.0f, 0.0f);
+                    outs = outs ? ggml_concat(ctx0, outs, out, 1) : out;
+                }
 
-                cur = ggml_reshape_2d(ctx0, cur, n_state, n_tokens);
+                cur = outs;
             } else {
+                // the windows are the 4th dimension, so each attention product is a single batched multiplication
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_4d(ctx0, Qcur, n_state_head, n_head, n_ctx, n_parts),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * K =
+                    ggml_permute(ctx0,
+                            ggml_cast(ctx0,
+                                ggml_reshape_4d(ctx0, Kcur, n_state_head, n_head, n_ctx, n_parts),
+                                wctx.itype),
+                            0, 2, 1, 3);
+
                 // K * Q
                 struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
 
-                struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask, 1.0f, 0.0f);
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, nullptr, KQscale, 0.0f);
 
                 struct ggml_tensor * V =
-                    ggml_view_3d(ctx0, kv_self.v,
-                            n_kv, n_state_head, n_head,
-                            n_ctx*ggml_element_size(kv_self.v),
-                            n_ctx*ggml_element_size(kv_self.v)*n_state_head,
-                            n_ctx*ggml_element_size(kv_self.v)*n_state*il);
+                    ggml_cast(ctx0,
+                            ggml_permute(ctx0,
+                                ggml_reshape_4d(ctx0,
+                                    Vcur,
+                                    n_state_head, n_head, n_ctx, n_parts),
+                                1, 2, 0, 3),
+                            wctx.itype);
 
                 struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
 
                 struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tokens);
+                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_ctx*n_parts);
             }
         }
 
@@ -2638,340 +3326,1465 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                     layer.attn_ln_1_w,
                     cur);
 
-            cur = ggml_add(ctx0,
-                    cur,
-                    layer.attn_ln_1_b);
+            cur = ggml_add(ctx0, cur, layer.attn_ln_1_b);
         }
 
         // add the input
-        struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
+        cur = ggml_add(ctx0, cur, inpL);
 
-        // norm
+        struct ggml_tensor * inpFF = cur;
+
+        // feed-forward network
         {
-            cur = ggml_norm(ctx0, inpCA, hparams.eps); // note: we use inpCA here
+            // norm
+            {
+                cur = ggml_norm(ctx0, inpFF, hparams.eps);
 
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        cur,
-                        layer.cross_attn_ln_0_w),
-                    layer.cross_attn_ln_0_b);
-        }
+                // cur = mlp_ln_w*cur + mlp_ln_b
+                cur = ggml_add(ctx0,
+                        ggml_mul(ctx0, cur, layer.mlp_ln_w),
+                        layer.mlp_ln_b);
+            }
 
-        // cross-attention
-        {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
-                    layer.cross_attn_q_w,
+            // fully connected
+            cur = ggml_mul_mat(ctx0,
+                    layer.mlp_0_w,
                     cur);
 
-            Qcur = ggml_add(ctx0,
-                        Qcur,
-                        layer.cross_attn_q_b);
+            cur = ggml_add(ctx0, cur, layer.mlp_0_b);
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_tokens),
-                        0, 2, 1, 3);
+            // GELU activation
+            cur = ggml_gelu(ctx0, cur);
+
+            // projection
+            cur = ggml_mul_mat(ctx0,
+                    layer.mlp_1_w,
+                    cur);
+
+            cur = ggml_add(ctx0, cur, layer.mlp_1_b);
+        }
+
+        inpL = ggml_add(ctx0, cur, inpFF);
+    }
+
+    cur = inpL;
+
+    // norm
+    {
+        cur = ggml_norm(ctx0, cur, hparams.eps);
+
+        // cur = ln_f_g*cur + ln_f_b
+        cur = ggml_add(ctx0,
+                ggml_mul(ctx0, cur, model.e_ln_w),
+                model.e_ln_b);
+    }
+
+    // cross-attention memory of each window
+    const float Kscale = pow(float(n_state_head), -0.25);
+
+    for (int il = 0; il < model.hparams.n_text_layer; ++il) {
+        auto & layer = model.layers_decoder[il];
+
+        struct ggml_tensor * Kcross = ggml_mul_mat(ctx0,
+                layer.cross_attn_k_w,
+                cur);
+
+        Kcross = ggml_scale(ctx0, Kcross, Kscale);
+
+        struct ggml_tensor * Vcross = ggml_mul_mat(ctx0,
+                layer.cross_attn_v_w,
+                cur);
+
+        Vcross = ggml_add(ctx0,
+                    Vcross,
+                    layer.cross_attn_v_b);
+
+        for (int p = 0; p < n_parts; ++p) {
+            auto & kv_cross = parts[p].state->kv_cross;
+
+            struct ggml_tensor * Kp = part_rows(Kcross, p);
+            struct ggml_tensor * Vp = part_rows(Vcross, p);
+
+            struct ggml_tensor * k;
+            struct ggml_tensor * v;
 
             if (wctx.params.flash_attn) {
-                struct ggml_tensor * Kcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.k,
-                            n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx_pad*il);
-
-                struct ggml_tensor * Vcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.v,
-                            n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state,
-                            ggml_element_size(wstate.kv_cross.v)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state*n_audio_ctx_pad*il);
-
-                cur = ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, nullptr, KQscale, 0.0f, 0.0f);
-
-                cur = ggml_reshape_2d(ctx0, cur, n_state, n_tokens);
+                k = ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx,
+                        (ggml_element_size(kv_cross.k)*n_state)*(il*n_ctx_pad));
+
+                v = ggml_view_1d(ctx0, kv_cross.v, n_state*n_ctx,
+                        (ggml_element_size(kv_cross.v)*n_state)*(il*n_ctx_pad));
             } else {
-                struct ggml_tensor * Kcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.k,
-                            n_state_head, n_audio_ctx, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx*il);
-
-                struct ggml_tensor * Vcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.v,
-                            n_audio_ctx, n_state_head, n_head,
-                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v),
-                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state_head,
-                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state*il);
+                Vp = ggml_transpose(ctx0, Vp);
 
-                // ------
+                k = ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx,
+                        (ggml_element_size(kv_cross.k)*n_state)*(il*n_ctx));
 
-                // K * Q
-                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
+                v = ggml_view_2d(ctx0, kv_cross.v, n_ctx, n_state,
+                        (   n_ctx)*ggml_element_size(kv_cross.v),
+                        (il*n_ctx)*ggml_element_size(kv_cross.v)*n_state);
+            }
 
-                struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, nullptr, KQscale, 0.0f);
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kp, k));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vp, v));
+        }
+    }
 
-                // [EXPERIMENTAL] Token-level timestamps with DTW
-                if (wctx.params.dtw_token_timestamps) {
-                    if (wstate.aheads_masks.m[il] != nullptr) {
-                        struct ggml_tensor * aheads_KQs = ggml_reshape_2d(ctx0, KQ_soft_max, KQ_soft_max->ne[0] * KQ_soft_max->ne[1], KQ_soft_max->ne[2]);
-                        aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_cont(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_mul_mat(ctx0, wstate.aheads_masks.m[il], aheads_KQs);
-                        aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_cont(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_reshape_3d(ctx0, aheads_KQs, KQ_soft_max->ne[0], KQ_soft_max->ne[1], wstate.aheads_masks.m[il]->ne[1]);
-                        if (aheads_cross_QKs == NULL) {
-                            aheads_cross_QKs = aheads_KQs;
-                        } else {
-                            aheads_cross_QKs = ggml_concat(ctx0, aheads_cross_QKs, aheads_KQs, 2);
-                        }
-                    }
-                }
+    ggml_free(ctx0);
 
-                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, Vcross, KQ_soft_max);
+    return gf;
+}
 
-                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+// true if kv_cross already holds the encoded window at mel_offset
+static bool whisper_encode_cached(const whisper_context & wctx, const whisper_state & wstate, int mel_offset) {
+    const int n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
 
-                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tokens);
-            }
+    return wstate.kv_cross_mel_offset == mel_offset && wstate.kv_cross_n_ctx == n_ctx;
+}
+
+static void whisper_encode_set_cached(const whisper_context & wctx, whisper_state & wstate, int mel_offset) {
+    wstate.kv_cross_mel_offset = mel_offset;
+    wstate.kv_cross_n_ctx      = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+}
+
+// fill a flash-attention mask over padded K/V rows of which only the first n_valid hold data of the current window
+static void whisper_set_pad_mask(struct ggml_tensor * KQ_mask, int n_valid) {
+    const int n_kv = KQ_mask->ne[0];
+
+    std::vector<float> row(n_kv, -INFINITY);
+    std::fill(row.begin(), row.begin() + std::min(n_valid, n_kv), 0.0f);
+
+    for (int64_t i = 0; i < KQ_mask->ne[1]; ++i) {
+        ggml_backend_tensor_set(KQ_mask, row.data(), i*KQ_mask->nb[1], n_kv*sizeof(float));
+    }
+}
+
+// copy the 2*n_ctx mel frames starting at mel_offset into dst [n_mel][2*n_ctx], zero-padded past the end of the audio
+static void whisper_encode_set_mel(const whisper_mel & mel_inp, int mel_offset, int n_ctx, float * dst) {
+    memset(dst, 0, (size_t) mel_inp.n_mel*2*n_ctx*sizeof(float));
+
+    const int i0 = std::min(mel_offset,           mel_inp.n_len);
+    const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+
+    for (int j = 0; j < mel_inp.n_mel; ++j) {
+        for (int i = i0; i < i1; ++i) {
+            dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
         }
+    }
+}
 
-        // projection
+// evaluate the encoder with the given state
+//
+// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
+// part of the transformer model and returns the encoded features
+//
+//   - wctx:      the model
+//   - wstate:     the state of the encoder
+//   - n_threads:  number of threads to use
+//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
+//
+static bool whisper_encode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   mel_offset,
+              const int   n_threads,
+    ggml_abort_callback   abort_callback,
+                   void * abort_callback_data) {
+    // e.g. the first window after the language detection
+    if (whisper_encode_cached(wctx, wstate, mel_offset)) {
+        return !(abort_callback && abort_callback(abort_callback_data));
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+
+    // kv_cross is partially overwritten if any of the graphs fails
+    wstate.kv_cross_mel_offset = -1;
+
+    // conv
+    {
+        auto & sched = wstate.sched_conv.sched;
+
+        ggml_cgraph * gf = whisper_build_graph_conv(wctx, wstate);
+
+        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+            // should never happen as we pre-allocate the memory
+            return false;
+        }
+
+        struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
+
+        // set the input
         {
-            cur = ggml_mul_mat(ctx0,
-                    layer.cross_attn_ln_1_w,
-                    cur);
+            const int n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
 
-            cur = ggml_add(ctx0,
-                    cur,
-                    layer.cross_attn_ln_1_b);
+            assert(mel->type == GGML_TYPE_F32);
+            assert(wstate.mel.n_mel == wctx.model.hparams.n_mels);
+
+            wstate.inp_mel.resize(ggml_nelements(mel));
+
+            whisper_encode_set_mel(wstate.mel, mel_offset, n_ctx, wstate.inp_mel.data());
+
+            ggml_backend_tensor_set(mel, wstate.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
+        }
+
+        if (!whisper_encode_external(wstate)) {
+            if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+                return false;
+            }
+        } else {
+            ggml_backend_sched_reset(sched);
+
+#if defined(WHISPER_USE_COREML)
+            whisper_coreml_encode(wstate.ctx_coreml, mel->ne[0], mel->ne[1], (float *) mel->data, (float *) wstate.embd_enc->data);
+#elif defined(WHISPER_USE_OPENVINO)
+            whisper_openvino_encode(wstate.ctx_openvino, mel, wstate.embd_enc);
+#endif
+        }
+    }
+
+    // encoder
+    if (!whisper_encode_external(wstate)) {
+        auto & sched = wstate.sched_encode.sched;
+
+        ggml_cgraph * gf = whisper_build_graph_encoder(wctx, wstate);
+
+        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+            // should never happen as we pre-allocate the memory
+            return false;
+        }
+
+        if (struct ggml_tensor * KQ_mask = ggml_graph_get_tensor(gf, "KQ_mask_enc")) {
+            whisper_set_pad_mask(KQ_mask, wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx);
+        }
+
+        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+            return false;
+        }
+    }
+
+    // cross
+    {
+        auto & sched = wstate.sched_cross.sched;
+
+        ggml_cgraph * gf = whisper_build_graph_cross(wctx, wstate);
+
+        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+            // should never happen as we pre-allocate the memory
+            return false;
+        }
+
+        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+            return false;
         }
+    }
+
+    whisper_encode_set_cached(wctx, wstate, mel_offset);
+
+    wstate.t_encode_us += ggml_time_us() - t_start_us;
+    wstate.n_encode++;
+
+    return !(abort_callback && abort_callback(abort_callback_data));
+}
+
+// evaluate the conv, the encoder and the cross-attention memory of one window per part in a single graph
+// all the parts must use the same audio context and none of them an external encoder
+// the cross kv of each part is stored in its state
+static bool whisper_encode_internal(
+           whisper_context & wctx,
+             whisper_sched & wsched,
+ const whisper_encode_part * parts,
+                       int   n_parts,
+        std::vector<float> & inp_mel,
+                 const int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    for (int p = 0; p < n_parts; ++p) {
+        parts[p].state->kv_cross_mel_offset = -1;
+    }
+
+    auto & sched = wsched.sched;
+
+    ggml_cgraph * gf = whisper_build_graph_encoder_batch(wctx, wsched, parts, n_parts);
+
+    if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+        // should never happen as we pre-allocate the memory
+        return false;
+    }
+
+    // set the input
+    {
+        struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
+
+        assert(mel->type == GGML_TYPE_F32);
+
+        const int n_ctx = mel->ne[0]/2;
+
+        inp_mel.resize(ggml_nelements(mel));
+
+        for (int p = 0; p < n_parts; ++p) {
+            whisper_encode_set_mel(parts[p].state->mel, parts[p].mel_offset, n_ctx, inp_mel.data() + p*mel->ne[0]*mel->ne[1]);
+        }
+
+        ggml_backend_tensor_set(mel, inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
+
+        if (struct ggml_tensor * KQ_mask = ggml_graph_get_tensor(gf, "KQ_mask_enc")) {
+            whisper_set_pad_mask(KQ_mask, n_ctx);
+        }
+    }
+
+    if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        return false;
+    }
+
+    const int64_t t_us = ggml_time_us() - t_start_us;
+
+    for (int p = 0; p < n_parts; ++p) {
+        whisper_encode_set_cached(wctx, *parts[p].state, parts[p].mel_offset);
+
+        parts[p].state->t_encode_us += t_us;
+        parts[p].state->n_encode++;
+    }
+
+    return true;
+}
+
+// the decoder graph evaluates the batches of one or more states at once
+// the token embeddings and all the weight multiplications run over the concatenated tokens, so the weights are
+// read once per graph, while the attention of each part uses the kv caches of its own state
+// with a single part the graph is the same as the graph of one state
+struct whisper_decode_part {
+          whisper_state * state;
+    const whisper_batch * batch;
+
+    ggml_abort_callback   abort_callback;
+                   void * abort_callback_data;
+};
+
+static struct ggml_cgraph * whisper_build_graph_decoder(
+           whisper_context & wctx,
+             whisper_sched & sched,
+ const whisper_decode_part * parts,
+                       int   n_parts,
+      std::vector<int32_t> & out_ids,
+                      bool   save_alignment_heads_QKs,
+                      bool   worst_case) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_state = hparams.n_text_state;
+    const int n_head  = hparams.n_text_head;
+    const int n_layer = hparams.n_text_layer;
+
+    const int n_state_head = n_state/n_head;
+
+    WHISPER_ASSERT(n_parts > 0);
+    WHISPER_ASSERT(n_parts == 1 || !wctx.params.dtw_token_timestamps);
+
+    // per part: position of its first token in the graph, number of tokens, kv cache window and audio context
+    std::vector<int> p_off(n_parts), p_tokens(n_parts), p_ctx(n_parts), p_kv(n_parts), p_head(n_parts), p_audio(n_parts);
+
+    int n_tokens = 0;
+
+    for (int p = 0; p < n_parts; ++p) {
+        const auto & wstate  = *parts[p].state;
+        const auto & kv_self = wstate.kv_self;
+
+        WHISPER_ASSERT(!!kv_self.buffer);
+
+        p_off   [p] = n_tokens;
+        p_tokens[p] = parts[p].batch->n_tokens;
+        p_ctx   [p] = kv_self.size;
+        p_kv    [p] = worst_case ? kv_self.size                 : kv_self.n;
+        p_head  [p] = worst_case ? kv_self.size - p_tokens[p]   : kv_self.head;
+        p_audio [p] = wstate.exp_n_audio_ctx > 0 && !worst_case ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+        n_tokens += p_tokens[p];
+    }
+
+    //WHISPER_LOG_DEBUG("%s: n_past = %d, n_tokens = %d, n_audio_ctx = %d, n_ctx = %d\n", __func__, n_past, n_tokens, n_audio_ctx, n_ctx);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ sched.meta.size(),
+        /*.mem_buffer =*/ sched.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES*n_parts, false);
+
+    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    ggml_set_name(embd, "embd");
+    ggml_set_input(embd);
+
+    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    ggml_set_name(position, "position");
+    ggml_set_input(position);
+
+    const float KQscale = pow(float(n_state_head), -0.25);
+
+    std::vector<struct ggml_tensor *> KQ_mask    (n_parts);
+    std::vector<struct ggml_tensor *> KQ_mask_f16(n_parts);
+
+    for (int p = 0; p < n_parts; ++p) {
+        KQ_mask[p] = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, p_kv[p], GGML_PAD(p_tokens[p], GGML_KQ_MASK_PAD), 1);
+        ggml_format_name(KQ_mask[p], "KQ_mask_%d", p);
+        ggml_set_input(KQ_mask[p]);
+
+        KQ_mask_f16[p] = ggml_cast(ctx0, KQ_mask[p], GGML_TYPE_F16);
+    }
+
+    // the cross K/V rows [n_audio_ctx, n_audio_ctx_pad) are left over from longer windows - the mask hides them
+    std::vector<struct ggml_tensor *> KQ_mask_cross_f16(n_parts);
+
+    if (wctx.params.flash_attn) {
+        for (int p = 0; p < n_parts; ++p) {
+            struct ggml_tensor * KQ_mask_cross = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, GGML_PAD(p_audio[p], 256), GGML_PAD(p_tokens[p], GGML_KQ_MASK_PAD), 1);
+            ggml_format_name(KQ_mask_cross, "KQ_mask_cross_%d", p);
+            ggml_set_input(KQ_mask_cross);
+
+            KQ_mask_cross_f16[p] = ggml_cast(ctx0, KQ_mask_cross, GGML_TYPE_F16);
+        }
+    }
+
+    // rows [p_off[p], p_off[p] + p_tokens[p]) of a [n, n_tokens] tensor
+    const auto part_rows = [&](struct ggml_tensor * t, int p) {
+        if (n_parts == 1) {
+            return t;
+        }
+        return ggml_view_2d(ctx0, t, t->ne[0], p_tokens[p], t->nb[1], p_off[p]*t->nb[1]);
+    };
+
+    // concatenation of the per-part attention outputs
+    const auto merge_parts = [&](const std::vector<struct ggml_tensor *> & outs) {
+        struct ggml_tensor * res = outs[0];
+        for (int p = 1; p < n_parts; ++p) {
+            res = ggml_concat(ctx0, res, outs[p], 1);
+        }
+        return res;
+    };
+
+    std::vector<struct ggml_tensor *> attn_out(n_parts);
+
+    // token encoding + position encoding
+    struct ggml_tensor * cur =
+        ggml_add(ctx0,
+                ggml_get_rows(ctx0, model.d_te, embd),
+                ggml_get_rows(ctx0, model.d_pe, position));
+
+    struct ggml_tensor * inpL = cur;
+
+    // [EXPERIMENTAL] Token-level timestamps with DTW
+    struct ggml_tensor * aheads_cross_QKs = nullptr;
+
+    for (int il = 0; il < n_layer; ++il) {
+        const auto & layer = model.layers_decoder[il];
+
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpL, hparams.eps);
+
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        cur,
+                        layer.attn_ln_0_w),
+                    layer.attn_ln_0_b);
+        }
+
+        // self-attention
+        {
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                    layer.attn_q_w,
+                    cur);
+
+            Qcur = ggml_add(ctx0,
+                        Qcur,
+                        layer.attn_q_b);
+
+            Qcur = ggml_scale(ctx0, Qcur, KQscale);
+
+            // note: no bias for Key
+            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
+                    layer.attn_k_w,
+                    cur);
+
+            Kcur = ggml_scale(ctx0, Kcur, KQscale);
+
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                    layer.attn_v_w,
+                    cur);
+
+            Vcur = ggml_add(ctx0,
+                        Vcur,
+                        layer.attn_v_b);
+
+            for (int p = 0; p < n_parts; ++p) {
+                auto & kv_self = parts[p].state->kv_self;
+
+                const int n_ctx   = p_ctx   [p];
+                const int n_kv    = p_kv    [p];
+                const int kv_head = p_head  [p];
+                const int n_tok   = p_tokens[p];
+
+                // store key and value to memory
+                {
+                    struct ggml_tensor * Kp = part_rows(Kcur, p);
+                    struct ggml_tensor * Vp = part_rows(Vcur, p);
+
+                    struct ggml_tensor * k;
+                    struct ggml_tensor * v;
+
+                    if (wctx.params.flash_attn) {
+                        k = ggml_view_1d(ctx0, kv_self.k, n_tok*n_state,
+                                (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+
+                        v = ggml_view_1d(ctx0, kv_self.v, n_tok*n_state,
+                                (ggml_element_size(kv_self.v)*n_state)*(il*n_ctx + kv_head));
+                    } else {
+                        Vp = ggml_transpose(ctx0, Vp);
+
+                        k = ggml_view_1d(ctx0, kv_self.k, n_tok*n_state,
+                                (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+
+                        v = ggml_view_2d(ctx0, kv_self.v, n_tok, n_state,
+                                (   n_ctx)*ggml_element_size(kv_self.v),
+                                (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
+                    }
+
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kp, k));
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vp, v));
+                }
+
+                // ------
+
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_view_3d(ctx0, Qcur, n_state_head, n_head, n_tok, Qcur->nb[0]*n_state_head, Qcur->nb[1], p_off[p]*Qcur->nb[1]),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * K =
+                    ggml_view_3d(ctx0, kv_self.k,
+                            n_state_head, n_kv, n_head,
+                            ggml_element_size(kv_self.k)*n_state,
+                            ggml_element_size(kv_self.k)*n_state_head,
+                            ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+
+                if (wctx.params.flash_attn) {
+                    struct ggml_tensor * V =
+                        ggml_view_3d(ctx0, kv_self.v,
+                                n_state_head, n_kv, n_head,
+                                ggml_element_size(kv_self.v)*n_state,
+                                ggml_element_size(kv_self.v)*n_state_head,
+                                ggml_element_size(kv_self.v)*n_state*n_ctx*il);
+
+                    attn_out[p] = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask_f16[p], 1.0f, 0.0f, 0.0f);
+
+                    attn_out[p] = ggml_reshape_2d(ctx0, attn_out[p], n_state, n_tok);
+                } else {
+                    // K * Q
+                    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask[p], 1.0f, 0.0f);
+
+                    struct ggml_tensor * V =
+                        ggml_view_3d(ctx0, kv_self.v,
+                                n_kv, n_state_head, n_head,
+                                n_ctx*ggml_element_size(kv_self.v),
+                                n_ctx*ggml_element_size(kv_self.v)*n_state_head,
+                                n_ctx*ggml_element_size(kv_self.v)*n_state*il);
+
+                    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+                    struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                    attn_out[p] = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tok);
+                }
+            }
+
+            cur = merge_parts(attn_out);
+        }
+
+        // projection
+        {
+            cur = ggml_mul_mat(ctx0,
+                    layer.attn_ln_1_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.attn_ln_1_b);
+        }
+
+        // add the input
+        struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
+
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpCA, hparams.eps); // note: we use inpCA here
+
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        cur,
+                        layer.cross_attn_ln_0_w),
+                    layer.cross_attn_ln_0_b);
+        }
+
+        // cross-attention
+        {
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                    layer.cross_attn_q_w,
+                    cur);
+
+            Qcur = ggml_add(ctx0,
+                        Qcur,
+                        layer.cross_attn_q_b);
+
+            for (int p = 0; p < n_parts; ++p) {
+                const auto & wstate = *parts[p].state;
+
+                const int n_audio_ctx     = p_audio[p];
+                const int n_audio_ctx_pad = GGML_PAD(n_audio_ctx, 256);
+
+                const int n_tok = p_tokens[p];
+
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_view_3d(ctx0, Qcur, n_state_head, n_head, n_tok, Qcur->nb[0]*n_state_head, Qcur->nb[1], p_off[p]*Qcur->nb[1]),
+                            0, 2, 1, 3);
+
+                if (wctx.params.flash_attn) {
+                    struct ggml_tensor * Kcross =
+                        ggml_view_3d(ctx0, wstate.kv_cross.k,
+                                n_state_head, n_audio_ctx_pad, n_head,
+                                ggml_element_size(wstate.kv_cross.k)*n_state,
+                                ggml_element_size(wstate.kv_cross.k)*n_state_head,
+                                ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx_pad*il);
+
+                    struct ggml_tensor * Vcross =
+                        ggml_view_3d(ctx0, wstate.kv_cross.v,
+                                n_state_head, n_audio_ctx_pad, n_head,
+                                ggml_element_size(wstate.kv_cross.v)*n_state,
+                                ggml_element_size(wstate.kv_cross.v)*n_state_head,
+                                ggml_element_size(wstate.kv_cross.v)*n_state*n_audio_ctx_pad*il);
+
+                    attn_out[p] = ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, KQ_mask_cross_f16[p], KQscale, 0.0f, 0.0f);
+
+                    attn_out[p] = ggml_reshape_2d(ctx0, attn_out[p], n_state, n_tok);
+                } else {
+                    struct ggml_tensor * Kcross =
+                        ggml_view_3d(ctx0, wstate.kv_cross.k,
+                                n_state_head, n_audio_ctx, n_head,
+                                ggml_element_size(wstate.kv_cross.k)*n_state,
+                                ggml_element_size(wstate.kv_cross.k)*n_state_head,
+                                ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx*il);
+
+                    struct ggml_tensor * Vcross =
+                        ggml_view_3d(ctx0, wstate.kv_cross.v,
+                                n_audio_ctx, n_state_head, n_head,
+                                n_audio_ctx*ggml_element_size(wstate.kv_cross.v),
+                                n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state_head,
+                                n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state*il);
+
+                    // ------
+
+                    // K * Q
+                    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
+
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, nullptr, KQscale, 0.0f);
+
+                    // [EXPERIMENTAL] Token-level timestamps with DTW
+                    if (wctx.params.dtw_token_timestamps) {
+                        if (wstate.aheads_masks.m[il] != nullptr) {
+                            struct ggml_tensor * aheads_KQs = ggml_reshape_2d(ctx0, KQ_soft_max, KQ_soft_max->ne[0] * KQ_soft_max->ne[1], KQ_soft_max->ne[2]);
+                            aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
+                            aheads_KQs = ggml_cont(ctx0, aheads_KQs);
+                            aheads_KQs = ggml_mul_mat(ctx0, wstate.aheads_masks.m[il], aheads_KQs);
+                            aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
+                            aheads_KQs = ggml_cont(ctx0, aheads_KQs);
+                            aheads_KQs = ggml_reshape_3d(ctx0, aheads_KQs, KQ_soft_max->ne[0], KQ_soft_max->ne[1], wstate.aheads_masks.m[il]->ne[1]);
+                            if (aheads_cross_QKs == NULL) {
+                                aheads_cross_QKs = aheads_KQs;
+                            } else {
+                                aheads_cross_QKs = ggml_concat(ctx0, aheads_cross_QKs, aheads_KQs, 2);
+                            }
+                        }
+                    }
+
+                    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, Vcross, KQ_soft_max);
+
+                    struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                    attn_out[p] = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tok);
+                }
+            }
+
+            cur = merge_parts(attn_out);
+        }
+
+        // projection
+        {
+            cur = ggml_mul_mat(ctx0,
+                    layer.cross_attn_ln_1_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.cross_attn_ln_1_b);
+        }
+
+        // add the input
+        cur = ggml_add(ctx0, cur, inpCA);
+
+        struct ggml_tensor * inpFF = cur;
+
+        // feed-forward network
+        {
+            // norm
+            {
+                cur = ggml_norm(ctx0, inpFF, hparams.eps);
+
+                // cur = mlp_ln_w*cur + mlp_ln_b
+                cur = ggml_add(ctx0,
+                        ggml_mul(ctx0,
+                            cur,
+                            layer.mlp_ln_w),
+                        layer.mlp_ln_b);
+            }
+
+            // fully connected
+            cur = ggml_mul_mat(ctx0,
+                    layer.mlp_0_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.mlp_0_b);
+
+            // GELU activation
+            cur = ggml_gelu(ctx0, cur);
+
+            // projection
+            cur = ggml_mul_mat(ctx0,
+                    layer.mlp_1_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.mlp_1_b);
+        }
+
+        inpL = ggml_add(ctx0, cur, inpFF);
+    }
+
+    cur = inpL;
+
+    // norm
+    {
+        cur = ggml_norm(ctx0, cur, hparams.eps);
+
+        cur = ggml_add(ctx0,
+                ggml_mul(ctx0,
+                    cur,
+                    model.d_ln_w),
+                model.d_ln_b);
+    }
+
+    // compute logits only for the tokens flagged in batch.logits
+    // gathering the rows before the vocab projection avoids an n_tokens x n_vocab GEMM during prompt prefill
+    // the worst-case graph keeps all rows, so the reserved memory covers any batch
+    if (!worst_case) {
+        out_ids.clear();
+        for (int p = 0; p < n_parts; ++p) {
+            const auto & batch = *parts[p].batch;
+
+            const size_t n_prev = out_ids.size();
+
+            for (int i = 0; i < batch.n_tokens; ++i) {
+                if (batch.logits[i]) {
+                    out_ids.push_back(p_off[p] + i);
+                }
+            }
+
+            if (out_ids.size() == n_prev) {
+                out_ids.push_back(p_off[p] + batch.n_tokens - 1);
+            }
+        }
+
+        if ((int) out_ids.size() < n_tokens) {
+            struct ggml_tensor * inp_out_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, out_ids.size());
+            ggml_set_name(inp_out_ids, "inp_out_ids");
+            ggml_set_input(inp_out_ids);
+
+            cur = ggml_get_rows(ctx0, cur, inp_out_ids);
+        }
+    }
+
+    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+
+    // [EXPERIMENTAL] Token-level timestamps with DTW
+    if (wctx.params.dtw_token_timestamps && aheads_cross_QKs != nullptr) {
+        aheads_cross_QKs = ggml_transpose(ctx0, aheads_cross_QKs);
+        aheads_cross_QKs = ggml_cont(ctx0, aheads_cross_QKs);
+        if (save_alignment_heads_QKs) {
+            ggml_build_forward_expand(gf, aheads_cross_QKs);
+            parts[0].state->aheads_cross_QKs = aheads_cross_QKs;
+        }
+    }
+
+    ggml_build_forward_expand(gf, logits);
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+static struct ggml_cgraph * whisper_build_graph_decoder(
+         whisper_context & wctx,
+         whisper_state   & wstate,
+     const whisper_batch & batch,
+                    bool   save_alignment_heads_QKs,
+                    bool   worst_case) {
+    const whisper_decode_part part = { &wstate, &batch, nullptr, nullptr, };
+
+    return whisper_build_graph_decoder(wctx, wstate.sched_decode, &part, 1, wstate.inp_out_ids, save_alignment_heads_QKs, worst_case);
+}
+
+// reserve the kv cache cells for the batch and update the attended window
+static bool whisper_decode_find_slot(
+        whisper_context & wctx,
+          whisper_state & wstate,
+    const whisper_batch & batch) {
+    auto & kv_self = wstate.kv_self;
+
+    if (!whisper_kv_cache_find_slot(kv_self, batch)) {
+        return false;
+    }
+
+    const uint32_t pad = whisper_kv_cache_get_padding(wctx);
+    kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(whisper_kv_cache_cell_max(kv_self), pad)));
+
+    //kv_self.n = std::min((int32_t) hparams.n_text_ctx, std::max(32, whisper_kv_cache_cell_max(kv_self)));
+    //printf("n_tokens = %5d, kv_self.head = %5d, kv_self.n = %5d, seq_id = %5d\n", batch.n_tokens, kv_self.head, kv_self.n, batch.seq_id[0][0]);
+
+    return true;
+}
+
+// evaluate the decoder for the batches of one or more states in a single graph
+// the kv cache slots of all the parts must have been reserved with whisper_decode_find_slot
+// the logits of each part are stored in its state
+static bool whisper_decode_internal(
+                 whisper_context & wctx,
+                   whisper_sched & wsched,
+       const whisper_decode_part * parts,
+                             int   n_parts,
+            std::vector<int32_t> & out_ids,
+                       const int   n_threads,
+                            bool   save_alignment_heads_QKs) {
+    const int64_t t_start_us = ggml_time_us();
+
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_vocab = hparams.n_vocab;
+
+    struct ggml_tensor * logits;
+
+    // decoder
+    {
+        auto & sched = wsched.sched;
+
+        ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wsched, parts, n_parts, out_ids, save_alignment_heads_QKs, false);
+
+        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+            // should never happen as we pre-allocate the memory
+            return false;
+        }
+
+        // set the inputs
+        {
+            struct ggml_tensor * embd     = ggml_graph_get_tensor(gf, "embd");
+            struct ggml_tensor * position = ggml_graph_get_tensor(gf, "position");
+
+            for (int p = 0, off = 0; p < n_parts; ++p) {
+                const auto & batch = *parts[p].batch;
+
+                ggml_backend_tensor_set(embd, batch.token, off*ggml_element_size(embd), batch.n_tokens*ggml_element_size(embd));
+                ggml_backend_tensor_set(position, batch.pos, off*sizeof(int32_t),       batch.n_tokens*sizeof(int32_t));
+
+                off += batch.n_tokens;
+            }
+        }
+
+        // only present when some of the tokens do not need logits
+        if (struct ggml_tensor * inp_out_ids = ggml_graph_get_tensor(gf, "inp_out_ids")) {
+            ggml_backend_tensor_set(inp_out_ids, out_ids.data(), 0, ggml_nbytes(inp_out_ids));
+        }
+
+        for (int p = 0; p < n_parts; ++p) {
+            auto & wstate = *parts[p].state;
+            const auto & batch = *parts[p].batch;
+
+            const int n_tokens = batch.n_tokens;
+
+            char name[32];
+            snprintf(name, sizeof(name), "KQ_mask_%d", p);
+
+            struct ggml_tensor * KQ_mask = ggml_graph_get_tensor(gf, name);
+
+            auto & kv_self = wstate.kv_self;
+
+            const int32_t n_kv = kv_self.n;
+
+            wstate.inp_mask.resize(ggml_nelements(KQ_mask));
+
+            float * data = wstate.inp_mask.data();
+
+            // each token starts from the row of its sequence - only the cells that changed since the
+            // previous step have been refreshed
+            whisper_kv_cache_mask_sync(kv_self);
+
+            for (int h = 0; h < 1; ++h) {
+                for (int j = 0; j < n_tokens; ++j) {
+                    const whisper_pos    pos    = batch.pos[j];
+                    const whisper_seq_id seq_id = batch.seq_id[j][0];
+
+                    float * dst = data + h*(n_kv*n_tokens) + j*n_kv;
+
+                    memcpy(dst, kv_self.mask_rows.data() + (size_t) seq_id*kv_self.size, n_kv*sizeof(float));
+
+                    // causal masking is only needed when the sequence has cells past this token,
+                    // i.e. for the prompt tokens that are decoded together
+                    if (kv_self.mask_pos_max[seq_id] > pos) {
+                        for (int i = 0; i < n_kv; ++i) {
+                            if (kv_self.cells[i].pos > pos) {
+                                dst[i] = -INFINITY;
+                            }
+                        }
+                    }
+                }
+
+                std::fill(data + h*(n_kv*n_tokens) + n_tokens*n_kv, data + h*(n_kv*n_tokens) + GGML_PAD(n_tokens, GGML_KQ_MASK_PAD)*n_kv, -INFINITY);
+            }
+
+            ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
+
+            snprintf(name, sizeof(name), "KQ_mask_cross_%d", p);
+
+            if (struct ggml_tensor * KQ_mask_cross = ggml_graph_get_tensor(gf, name)) {
+                whisper_set_pad_mask(KQ_mask_cross, wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx);
+            }
+        }
+
+        logits = ggml_graph_node(gf, -1);
+
+        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+            return false;
+        }
+    }
+
+    // row k of the logits tensor belongs to the graph token out_ids[k]
+    // only these rows are kept, so the storage does not grow with the prompt length
+    // the rows of each part are contiguous since out_ids is sorted
+    for (int p = 0, k0 = 0, off = 0; p < n_parts; ++p) {
+        auto & wstate = *parts[p].state;
+
+        const int n_tokens = parts[p].batch->n_tokens;
+
+        int k1 = k0;
+        while (k1 < (int) out_ids.size() && out_ids[k1] < off + n_tokens) {
+            k1++;
+        }
+
+        const int n_outputs = k1 - k0;
+
+        wstate.output_ids.assign(n_tokens, -1);
+        for (int k = k0; k < k1; k++) {
+            wstate.output_ids[out_ids[k] - off] = k - k0;
+        }
+
+        wstate.logits.resize((size_t) n_outputs*n_vocab);
+        ggml_backend_tensor_get(logits, wstate.logits.data(), sizeof(float)*k0*n_vocab, sizeof(float)*n_outputs*n_vocab);
+
+        k0   = k1;
+        off += n_tokens;
+    }
+
+    const int64_t t_us = ggml_time_us() - t_start_us;
+
+    for (int p = 0; p < n_parts; ++p) {
+        auto & wstate = *parts[p].state;
+
+        const int n_tokens = parts[p].batch->n_tokens;
+
+        if (n_tokens == 1) {
+            wstate.t_decode_us += t_us;
+            wstate.n_decode++;
+        } else if (n_tokens < 16) {
+            wstate.t_batchd_us += t_us;
+            wstate.n_batchd += n_tokens;
+        } else {
+            wstate.t_prompt_us += t_us;
+            wstate.n_prompt += n_tokens;
+        }
+    }
+
+    return true;
+}
+
+// evaluate the decoder
+//
+// given text prompt + audio features -> computes the logits for the next token
+//
+//   - model:      the model
+//   - n_threads:  number of threads to use
+//   - tokens:     text prompt
+//   - n_tokens:   number of tokens in the prompt
+//   - n_past:     number of past tokens to prefix the prompt with
+//
+static bool whisper_decode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+    const whisper_batch & batch,
+              const int   n_threads,
+                   bool   save_alignment_heads_QKs,
+    ggml_abort_callback   abort_callback,
+                   void * abort_callback_data) {
+    if (!whisper_decode_find_slot(wctx, wstate, batch)) {
+        return false;
+    }
+
+    const whisper_decode_part part = { &wstate, &batch, abort_callback, abort_callback_data, };
+
+    if (!whisper_decode_internal(wctx, wstate.sched_decode, &part, 1, wstate.inp_out_ids, n_threads, save_alignment_heads_QKs)) {
+        return false;
+    }
+
+    return !(abort_callback && abort_callback(abort_callback_data));
+}
+
+//
+// decode group
+//
+
+// a decoder step waiting to be evaluated together with the steps of the other states of the group
+struct whisper_decode_group_request {
+    whisper_decode_part part;
+
+    int n_threads;
+
+    bool done = false;
+    bool ok   = false;
+};
+
+// an audio window waiting to be encoded together with the windows of the other states of the group
+struct whisper_decode_group_encode_request {
+    whisper_encode_part part;
+
+    int n_threads;
+
+    bool done = false;
+    bool ok   = false;
+};
+
+// the states of a group decode in lockstep: a step is evaluated once every state that is currently decoding
+// has submitted its batch, and the thread that completes the set evaluates all of them in one graph
+// a state counts as decoding only between whisper_decode_group_begin() and whisper_decode_group_end(),
+// so the others do not wait for its encoder
+// with batch_encoder the windows are also encoded in lockstep: once every member of the group has submitted its
+// next window, they are encoded in one graph (a state is a member between whisper_decode_group_join() and
+// whisper_decode_group_leave())
+struct whisper_decode_group {
+    whisper_decode_group(whisper_context * ctx, int n_states_max, bool batch_encoder) :
+        ctx(ctx), n_states_max(n_states_max), batch_encoder(batch_encoder) {}
+
+    whisper_context * ctx;
+
+    const int  n_states_max;
+    const bool batch_encoder;
+
+    // created on the first step that merges several states
+    std::vector<ggml_backend_t> backends;
+    whisper_sched               sched;
+    whisper_sched               sched_encode;
+
+    std::vector<int32_t> inp_out_ids;
+    std::vector<float>   inp_mel;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    int  n_decoding = 0;
+    int  n_members  = 0;
+    bool running    = false;
+
+    std::vector<whisper_decode_group_request *>        pending;
+    std::vector<whisper_decode_group_encode_request *> pending_encode;
+};
+
+static void whisper_decode_group_eval(whisper_decode_group & group, const std::vector<whisper_decode_group_request *> & reqs) {
+    auto & wctx = *group.ctx;
+
+    std::vector<whisper_decode_part>            parts;
+    std::vector<whisper_decode_group_request *> parts_reqs;
+
+    int n_threads = 1;
+
+    for (auto * req : reqs) {
+        if (!whisper_decode_find_slot(wctx, *req->part.state, *req->part.batch)) {
+            req->ok = false;
+            continue;
+        }
+
+        parts.push_back(req->part);
+        parts_reqs.push_back(req);
+
+        n_threads = std::max(n_threads, req->n_threads);
+    }
+
+    for (size_t i0 = 0; i0 < parts.size(); i0 += group.n_states_max) {
+        const int n_parts = std::min<int>(group.n_states_max, parts.size() - i0);
+
+        const whisper_decode_part * cur = parts.data() + i0;
+
+        bool ok;
+
+        if (n_parts == 1) {
+            ok = whisper_decode_internal(wctx, cur->state->sched_decode, cur, 1, cur->state->inp_out_ids, n_threads, false);
+        } else {
+            if (!group.sched.sched) {
+                if (group.backends.empty()) {
+                    group.backends = whisper_backend_init(wctx.params);
+                }
+
+                // reserve for the largest step - n_states_max states with a full text context each,
+                // the state of the first part stands in for the missing ones
+                const int n_text_ctx = wctx.model.hparams.n_text_ctx;
+
+                whisper_batch batch_worst = whisper_batch_init(n_text_ctx, 1);
+                whisper_batch_prep_legacy(batch_worst, nullptr, n_text_ctx, 0, 0);
+
+                const whisper_decode_part part_worst = { cur->state, &batch_worst, nullptr, nullptr, };
+                const std::vector<whisper_decode_part> parts_worst(group.n_states_max, part_worst);
+
+                const bool ok_init = !group.backends.empty() && whisper_sched_graph_init(group.sched, group.backends,
+                        [&]() {
+                            return whisper_build_graph_decoder(wctx, group.sched, parts_worst.data(), parts_worst.size(), group.inp_out_ids, false, true);
+                        }, WHISPER_MAX_NODES*group.n_states_max);
+
+                whisper_batch_free(batch_worst);
+
+                if (!ok_init) {
+                    WHISPER_LOG_ERROR("%s: failed to init the decode group allocator\n", __func__);
+
+                    for (int p = 0; p < n_parts; ++p) {
+                        parts_reqs[i0 + p]->ok = false;
+                    }
+                    continue;
+                }
+            }
+
+            ok = whisper_decode_internal(wctx, group.sched, cur, n_parts, group.inp_out_ids, n_threads, false);
+        }
+
+        for (int p = 0; p < n_parts; ++p) {
+            const auto & part = cur[p];
+
+            parts_reqs[i0 + p]->ok = ok && !(part.abort_callback && part.abort_callback(part.abort_callback_data));
+        }
+    }
+}
+
+static void whisper_decode_group_eval_encode(whisper_decode_group & group, std::vector<whisper_decode_group_encode_request *> & reqs) {
+    auto & wctx = *group.ctx;
+
+    const auto n_audio_ctx = [&](const whisper_decode_group_encode_request * req) {
+        const auto & wstate = *req->part.state;
+        return wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+    };
+
+    int n_threads = 1;
+
+    std::vector<whisper_encode_part>                   parts;
+    std::vector<whisper_decode_group_encode_request *> parts_reqs;
+
+    for (auto * req : reqs) {
+        n_threads = std::max(n_threads, req->n_threads);
+
+        // the external encoders take one window at a time
+        if (whisper_encode_external(*req->part.state)) {
+            const auto & part = req->part;
+            req->ok = whisper_encode_internal(wctx, *part.state, part.mel_offset, req->n_threads, part.abort_callback, part.abort_callback_data);
+            continue;
+        }
+
+        parts_reqs.push_back(req);
+    }
+
+    // only the windows with the same audio context can share a graph
+    std::stable_sort(parts_reqs.begin(), parts_reqs.end(),
+            [&](const whisper_decode_group_encode_request * a, const whisper_decode_group_encode_request * b) {
+                return n_audio_ctx(a) < n_audio_ctx(b);
+            });
+
+    for (size_t i0 = 0; i0 < parts_reqs.size(); ) {
+        size_t i1 = i0 + 1;
+        while (i1 < parts_reqs.size() && (int) (i1 - i0) < group.n_states_max && n_audio_ctx(parts_reqs[i1]) == n_audio_ctx(parts_reqs[i0])) {
+            i1++;
+        }
+
+        const int n_parts = i1 - i0;
+
+        parts.clear();
+        for (size_t i = i0; i < i1; ++i) {
+            parts.push_back(parts_reqs[i]->part);
+        }
+
+        bool ok;
+
+        if (n_parts == 1) {
+            const auto & part = parts[0];
+            ok = whisper_encode_internal(wctx, *part.state, part.mel_offset, n_threads, nullptr, nullptr);
+        } else {
+            if (!group.sched_encode.sched) {
+                if (group.backends.empty()) {
+                    group.backends = whisper_backend_init(wctx.params);
+                }
+
+                // reserve for the largest batch - the windows of the first part stand in for the missing ones
+                const std::vector<whisper_encode_part> parts_worst(group.n_states_max, parts[0]);
+
+                const bool ok_init = !group.backends.empty() && whisper_sched_graph_init(group.sched_encode, group.backends,
+                        [&]() {
+                            return whisper_build_graph_encoder_batch(wctx, group.sched_encode, parts_worst.data(), parts_worst.size());
+                        }, WHISPER_MAX_NODES*group.n_states_max);
+
+                if (!ok_init) {
+                    WHISPER_LOG_ERROR("%s: failed to init the batched encoder allocator\n", __func__);
+
+                    for (size_t i = i0; i < i1; ++i) {
+                        parts_reqs[i]->ok = false;
+                    }
+
+                    i0 = i1;
+                    continue;
+                }
+            }
+
+            ok = whisper_encode_internal(wctx, group.sched_encode, parts.data(), n_parts, group.inp_mel, n_threads);
+        }
+
+        for (int p = 0; p < n_parts; ++p) {
+            const auto & part = parts[p];
 
-        // add the input
-        cur = ggml_add(ctx0, cur, inpCA);
+            parts_reqs[i0 + p]->ok = ok && !(part.abort_callback && part.abort_callback(part.abort_callback_data));
+        }
 
-        struct ggml_tensor * inpFF = cur;
+        i0 = i1;
+    }
+}
 
-        // feed-forward network
-        {
-            // norm
-            {
-                cur = ggml_norm(ctx0, inpFF, hparams.eps);
+// evaluate the pending steps if every decoding state has submitted one, and the pending windows if every
+// member has submitted one
+// called with the group mutex held, which is released while evaluating
+static void whisper_decode_group_try_eval(whisper_decode_group & group, std::unique_lock<std::mutex> & lock) {
+    while (!group.running) {
+        std::vector<whisper_decode_group_request *>        reqs;
+        std::vector<whisper_decode_group_encode_request *> reqs_encode;
 
-                // cur = mlp_ln_w*cur + mlp_ln_b
-                cur = ggml_add(ctx0,
-                        ggml_mul(ctx0,
-                            cur,
-                            layer.mlp_ln_w),
-                        layer.mlp_ln_b);
-            }
+        if (!group.pending.empty() && (int) group.pending.size() >= group.n_decoding) {
+            reqs.swap(group.pending);
+        } else if (!group.pending_encode.empty() && (int) group.pending_encode.size() >= group.n_members) {
+            reqs_encode.swap(group.pending_encode);
+        } else {
+            break;
+        }
 
-            // fully connected
-            cur = ggml_mul_mat(ctx0,
-                    layer.mlp_0_w,
-                    cur);
+        group.running = true;
+        lock.unlock();
 
-            cur = ggml_add(ctx0,
-                    cur,
-                    layer.mlp_0_b);
+        if (!reqs.empty()) {
+            whisper_decode_group_eval(group, reqs);
+        } else {
+            whisper_decode_group_eval_encode(group, reqs_encode);
+        }
 
-            // GELU activation
-            cur = ggml_gelu(ctx0, cur);
+        lock.lock();
+        group.running = false;
 
-            // projection
-            cur = ggml_mul_mat(ctx0,
-                    layer.mlp_1_w,
-                    cur);
+        for (auto * req : reqs) {
+            req->done = true;
+        }
 
-            cur = ggml_add(ctx0,
-                    cur,
-                    layer.mlp_1_b);
+        for (auto * req : reqs_encode) {
+            req->done = true;
         }
 
-        inpL = ggml_add(ctx0, cur, inpFF);
+        group.cv.notify_all();
     }
+}
 
-    cur = inpL;
+static void whisper_decode_group_begin(whisper_decode_group & group) {
+    std::lock_guard<std::mutex> lock(group.mutex);
 
-    // norm
-    {
-        cur = ggml_norm(ctx0, cur, hparams.eps);
+    group.n_decoding++;
+}
 
-        cur = ggml_add(ctx0,
-                ggml_mul(ctx0,
-                    cur,
-                    model.d_ln_w),
-                model.d_ln_b);
-    }
+static void whisper_decode_group_end(whisper_decode_group & group) {
+    std::unique_lock<std::mutex> lock(group.mutex);
 
-    // compute logits only for the last token
-    // comment this line to compute logits for all n_tokens
-    // might be useful in the future
-    //cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    group.n_decoding--;
 
-    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+    whisper_decode_group_try_eval(group, lock);
+}
 
-    // [EXPERIMENTAL] Token-level timestamps with DTW
-    if (wctx.params.dtw_token_timestamps && aheads_cross_QKs != nullptr) {
-        aheads_cross_QKs = ggml_transpose(ctx0, aheads_cross_QKs);
-        aheads_cross_QKs = ggml_cont(ctx0, aheads_cross_QKs);
-        if (save_alignment_heads_QKs) {
-            ggml_build_forward_expand(gf, aheads_cross_QKs);
-            wstate.aheads_cross_QKs = aheads_cross_QKs;
-        }
-    }
+static void whisper_decode_group_join(whisper_decode_group & group) {
+    std::lock_guard<std::mutex> lock(group.mutex);
 
-    ggml_build_forward_expand(gf, logits);
+    group.n_members++;
+}
 
-    ggml_free(ctx0);
+static void whisper_decode_group_leave(whisper_decode_group & group) {
+    std::unique_lock<std::mutex> lock(group.mutex);
 
-    return gf;
+    group.n_members--;
+
+    whisper_decode_group_try_eval(group, lock);
 }
 
-// evaluate the decoder
-//
-// given text prompt + audio features -> computes the logits for the next token
-//
-//   - model:      the model
-//   - n_threads:  number of threads to use
-//   - tokens:     text prompt
-//   - n_tokens:   number of tokens in the prompt
-//   - n_past:     number of past tokens to prefix the prompt with
-//
-static bool whisper_decode_internal(
-        whisper_context & wctx,
+// same as whisper_encode_internal(), but evaluated together with the windows of the other members of the group
+static bool whisper_decode_group_encode(
+   whisper_decode_group & group,
           whisper_state & wstate,
-    const whisper_batch & batch,
+              const int   mel_offset,
               const int   n_threads,
-                   bool   save_alignment_heads_QKs,
     ggml_abort_callback   abort_callback,
                    void * abort_callback_data) {
-    const int64_t t_start_us = ggml_time_us();
+    if (whisper_encode_cached(*group.ctx, wstate, mel_offset)) {
+        return !(abort_callback && abort_callback(abort_callback_data));
+    }
 
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
+    whisper_decode_group_encode_request req;
 
-    const int n_vocab  = hparams.n_vocab;
-    const int n_tokens = batch.n_tokens;
+    req.part      = { &wstate, mel_offset, abort_callback, abort_callback_data, };
+    req.n_threads = n_threads;
 
-    auto & logits_out = wstate.logits;
+    std::unique_lock<std::mutex> lock(group.mutex);
 
-    struct ggml_tensor * logits;
+    group.pending_encode.push_back(&req);
 
-    // find KV slot for the batch
-    {
-        auto & kv_self = wstate.kv_self;
+    whisper_decode_group_try_eval(group, lock);
 
-        if (!whisper_kv_cache_find_slot(kv_self, batch)) {
-            return false;
-        }
+    group.cv.wait(lock, [&] { return req.done; });
 
-        const uint32_t pad = whisper_kv_cache_get_padding(wctx);
-        kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(whisper_kv_cache_cell_max(kv_self), pad)));
+    return req.ok;
+}
 
-        //kv_self.n = std::min((int32_t) hparams.n_text_ctx, std::max(32, whisper_kv_cache_cell_max(kv_self)));
-        //printf("n_tokens = %5d, kv_self.head = %5d, kv_self.n = %5d, seq_id = %5d\n", batch.n_tokens, kv_self.head, kv_self.n, batch.seq_id[0][0]);
-    }
+// same as whisper_decode_internal(), but evaluated together with the other states of the group
+static bool whisper_decode_group_decode(
+   whisper_decode_group & group,
+          whisper_state & wstate,
+    const whisper_batch & batch,
+              const int   n_threads,
+    ggml_abort_callback   abort_callback,
+                   void * abort_callback_data) {
+    whisper_decode_group_request req;
 
-    // decoder
-    {
-        auto & sched = wstate.sched_decode.sched;
+    req.part      = { &wstate, &batch, abort_callback, abort_callback_data, };
+    req.n_threads = n_threads;
 
-        ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, batch, save_alignment_heads_QKs, false);
+    std::unique_lock<std::mutex> lock(group.mutex);
 
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
-        }
+    group.pending.push_back(&req);
 
-        // set the inputs
-        {
-            struct ggml_tensor * embd = ggml_graph_get_tensor(gf, "embd");
-            ggml_backend_tensor_set(embd, batch.token, 0, n_tokens*ggml_element_size(embd));
-        }
+    whisper_decode_group_try_eval(group, lock);
 
-        {
-            struct ggml_tensor * position = ggml_graph_get_tensor(gf, "position");
-            for (int i = 0; i < n_tokens; ++i) {
-                const int32_t val = batch.pos[i];
-                ggml_backend_tensor_set(position, &val, i*sizeof(int32_t), sizeof(int32_t));
-            }
+    group.cv.wait(lock, [&] { return req.done; });
+
+    return req.ok;
+}
+
+// membership of a state in a decode group for the duration of a scope
+struct whisper_decode_group_scope {
+    explicit whisper_decode_group_scope(whisper_decode_group * group) : group(group) {
+        if (group) {
+            whisper_decode_group_begin(*group);
         }
+    }
 
-        {
-            struct ggml_tensor * KQ_mask = ggml_graph_get_tensor(gf, "KQ_mask");
+    ~whisper_decode_group_scope() {
+        end();
+    }
 
-            auto & kv_self = wstate.kv_self;
+    void end() {
+        if (group) {
+            whisper_decode_group_end(*group);
+            group = nullptr;
+        }
+    }
 
-            const int32_t n_kv = kv_self.n;
+    whisper_decode_group * group;
+};
 
-            wstate.inp_mask.resize(ggml_nelements(KQ_mask));
+// membership of a state in the batched encoder of a group for the duration of a scope
+struct whisper_decode_group_member {
+    explicit whisper_decode_group_member(whisper_decode_group * group) : group(group && group->batch_encoder ? group : nullptr) {
+        if (this->group) {
+            whisper_decode_group_join(*this->group);
+        }
+    }
 
-            float * data = wstate.inp_mask.data();
-            memset(data, 0, ggml_nbytes(KQ_mask));
+    ~whisper_decode_group_member() {
+        leave();
+    }
 
-            for (int h = 0; h < 1; ++h) {
-                for (int j = 0; j < n_tokens; ++j) {
-                    const whisper_pos    pos    = batch.pos[j];
-                    const whisper_seq_id seq_id = batch.seq_id[j][0];
+    void leave() {
+        if (group) {
+            whisper_decode_group_leave(*group);
+            group = nullptr;
+        }
+    }
 
-                    for (int i = 0; i < n_kv; ++i) {
-                        if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                            data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                        }
-                    }
-                }
+    whisper_decode_group * group;
+};
 
-                for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                    for (int j = 0; j < n_kv; ++j) {
-                        data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                    }
-                }
-            }
+// logits of the token at batch position i of the last decode
+static const float * whisper_state_logits(const whisper_context & wctx, const whisper_state & wstate, int i) {
+    WHISPER_ASSERT(i >= 0 && i < (int) wstate.output_ids.size() && wstate.output_ids[i] >= 0);
 
-            ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
-        }
+    return wstate.logits.data() + (size_t) wstate.output_ids[i]*wctx.vocab.n_vocab;
+}
 
-        logits = ggml_graph_node(gf, -1);
+// low-memory mode: drop the per-vocab buffers of an idle state
+static void whisper_state_release_logits(whisper_state & wstate) {
+    std::vector<float>().swap(wstate.logits);
+    std::vector<int32_t>().swap(wstate.output_ids);
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
-            return false;
-        }
+    for (auto & decoder : wstate.decoders) {
+        std::vector<float>().swap(decoder.probs);
+        std::vector<float>().swap(decoder.logits);
+        std::vector<float>().swap(decoder.logprobs);
+        decltype(decoder.logits_id)().swap(decoder.logits_id);
     }
 
-    logits_out.resize(n_tokens*n_vocab);
-    for (int i = 0; i < n_tokens; i++) {
-        if (batch.logits[i] == 0) {
-            continue;
-        }
-        ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*i), sizeof(float)*n_vocab);
+    if (wstate.draft_state) {
+        whisper_state_release_logits(*wstate.draft_state);
     }
+}
 
-    if (batch.n_tokens > 1) {
-        //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
-        //        ggml_used_mem(ctx0)/1e6,
-        //        wstate.get_buf_max_mem(0)/1e6,
-        //        wstate.get_buf_max_mem(1)/1e6,
-        //        wstate.get_buf_max_mem(2)/1e6,
-        //        wstate.get_buf_max_mem(3)/1e6);
-    }
+// releases the per-vocab buffers of a low-memory state when the scope ends, on every return path
+struct whisper_state_logits_scope {
+    whisper_state_logits_scope(whisper_state * state, bool low_mem) : state(low_mem ? state : nullptr) {}
 
-    if (batch.n_tokens == 1) {
-        wstate.t_decode_us += ggml_time_us() - t_start_us;
-        wstate.n_decode++;
-    } else if (batch.n_tokens < 16) {
-        wstate.t_batchd_us += ggml_time_us() - t_start_us;
-        wstate.n_batchd += n_tokens;
-    } else {
-        wstate.t_prompt_us += ggml_time_us() - t_start_us;
-        wstate.n_prompt += n_tokens;
+    ~whisper_state_logits_scope() {
+        if (state) {
+            whisper_state_release_logits(*state);
+        }
     }
 
-    return !(abort_callback && abort_callback(abort_callback_data));
-}
+    whisper_state * state;
+};
 
 //  500 -> 00:05.000
 // 6000 -> 01:00.000
@@ -2990,6 +4803,253 @@ static std::string to_timestamp(int64_t t, bool comma = false) {
     return std::string(buf);
 }
 
+// precomputed plan for a real-input FFT of even size n
+//
+// the n real samples are packed into n/2 complex values (x[2i] + i*x[2i + 1]), transformed with an
+// iterative mixed-radix decimation-in-time FFT over a digit-reversed input and finally split into the
+// n/2 + 1 non-redundant bins of the real transform
+//
+// for WHISPER_N_FFT = 400 this is a 200-point complex FFT with the radices 4, 2, 5, 5
+struct whisper_fft_plan {
+    int n = 0; // real input size
+    int m = 0; // complex transform size (n/2)
+
+    std::vector<int>   radix;   // radix of each stage, in the order the stages are applied
+    std::vector<int>   perm;    // digit-reversal permutation: perm[pos] = index of the packed input
+    std::vector<float> tw;      // per-stage twiddles W_L^(j*k), interleaved re/im
+    std::vector<float> tw_real; // W_n^k for k in [0, m], used to split the packed transform
+};
+
+static void whisper_fft_plan_init(whisper_fft_plan & plan, int n) {
+    WHISPER_ASSERT(n > 0 && n % 2 == 0);
+
+    const int m = n/2;
+
+    plan.n = n;
+    plan.m = m;
+
+    // factorize m - specialized radices first, anything left goes through the generic butterfly
+    plan.radix.clear();
+    {
+        int rem = m;
+        for (int r : { 4, 2, 3, 5 }) {
+            while (rem % r == 0) {
+                plan.radix.push_back(r);
+                rem /= r;
+            }
+        }
+        for (int r = 7; rem > 1; r += 2) {
+            while (rem % r == 0) {
+                plan.radix.push_back(r);
+                rem /= r;
+            }
+        }
+    }
+
+    const int n_stages = plan.radix.size();
+
+    // the last stage splits the input by index mod radix[n_stages - 1], the one before that by the
+    // next digit, etc. - place each input at the position its mixed-radix digits select
+    plan.perm.resize(m);
+    for (int i = 0; i < m; ++i) {
+        int rem = i;
+        int pos = 0;
+        int len = m;
+        for (int t = n_stages - 1; t >= 0; --t) {
+            len /= plan.radix[t];
+            pos += (rem % plan.radix[t])*len;
+            rem /= plan.radix[t];
+        }
+        plan.perm[pos] = i;
+    }
+
+    plan.tw.clear();
+    {
+        int len_prev = 1;
+        for (int t = 0; t < n_stages; ++t) {
+            const int p   = plan.radix[t];
+            const int len = len_prev*p;
+            for (int k = 0; k < len_prev; ++k) {
+                for (int j = 1; j < p; ++j) {
+                    const double theta = -2.0*M_PI*j*k/len;
+                    plan.tw.push_back(cos(theta));
+                    plan.tw.push_back(sin(theta));
+                }
+            }
+            len_prev = len;
+        }
+    }
+
+    plan.tw_real.resize(2*(m + 1));
+    for (int k = 0; k <= m; ++k) {
+        const double theta = -2.0*M_PI*k/n;
+        plan.tw_real[2*k + 0] = cos(theta);
+        plan.tw_real[2*k + 1] = sin(theta);
+    }
+}
+
+// one decimation-in-time stage: combine groups of p adjacent sub-transforms of length len_prev
+static void whisper_fft_stage(float * z, int m, int len_prev, int p, const float * tw) {
+    const int len = len_prev*p;
+
+    // radix 5 constants
+    const float c1 =  0.309016994374947f; // cos(2*pi/5)
+    const float c2 = -0.809016994374947f; // cos(4*pi/5)
+    const float s1 =  0.951056516295154f; // sin(2*pi/5)
+    const float s2 =  0.587785252292473f; // sin(4*pi/5)
+
+    // radix 3 constant
+    const float s3 = 0.866025403784439f;  // sin(2*pi/3)
+
+    float a[2*64];
+    float y[2*64];
+
+    WHISPER_ASSERT(p <= 64);
+
+    for (int b = 0; b < m; b += len) {
+        for (int k = 0; k < len_prev; ++k) {
+            float * x = z + 2*(b + k);
+            const float * w = tw + 2*k*(p - 1);
+
+            // load and apply the twiddles
+            a[0] = x[0];
+            a[1] = x[1];
+            for (int j = 1; j < p; ++j) {
+                const float xr = x[2*j*len_prev + 0];
+                const float xi = x[2*j*len_prev + 1];
+                const float wr = w[2*(j - 1) + 0];
+                const float wi = w[2*(j - 1) + 1];
+                a[2*j + 0] = xr*wr - xi*wi;
+                a[2*j + 1] = xr*wi + xi*wr;
+            }
+
+            switch (p) {
+                case 2:
+                    {
+                        y[0] = a[0] + a[2]; y[1] = a[1] + a[3];
+                        y[2] = a[0] - a[2]; y[3] = a[1] - a[3];
+                    } break;
+                case 3:
+                    {
+                        const float sr = a[2] + a[4], si = a[3] + a[5];
+                        const float dr = a[2] - a[4], di = a[3] - a[5];
+                        const float tr = a[0] - 0.5f*sr, ti = a[1] - 0.5f*si;
+
+                        y[0] = a[0] + sr;   y[1] = a[1] + si;
+                        y[2] = tr + s3*di;  y[3] = ti - s3*dr;
+                        y[4] = tr - s3*di;  y[5] = ti + s3*dr;
+                    } break;
+                case 4:
+                    {
+                        const float t0r = a[0] + a[4], t0i = a[1] + a[5];
+                        const float t1r = a[0] - a[4], t1i = a[1] - a[5];
+                        const float t2r = a[2] + a[6], t2i = a[3] + a[7];
+                        const float t3r = a[2] - a[6], t3i = a[3] - a[7];
+
+                        y[0] = t0r + t2r; y[1] = t0i + t2i;
+                        y[2] = t1r + t3i; y[3] = t1i - t3r;
+                        y[4] = t0r - t2r; y[5] = t0i - t2i;
+                        y[6] = t1r - t3i; y[7] = t1i + t3r;
+                    } break;
+                case 5:
+                    {
+                        const float b1r = a[2] + a[8], b1i = a[3] + a[9];
+                        const float b2r = a[4] + a[6], b2i = a[5] + a[7];
+                        const float d1r = a[2] - a[8], d1i = a[3] - a[9];
+                        const float d2r = a[4] - a[6], d2i = a[5] - a[7];
+
+                        const float t1r = a[0] + c1*b1r + c2*b2r, t1i = a[1] + c1*b1i + c2*b2i;
+                        const float t2r = a[0] + c2*b1r + c1*b2r, t2i = a[1] + c2*b1i + c1*b2i;
+                        const float u1r = s1*d1r + s2*d2r,        u1i = s1*d1i + s2*d2i;
+                        const float u2r = s2*d1r - s1*d2r,        u2i = s2*d1i - s1*d2i;
+
+                        y[0] = a[0] + b1r + b2r; y[1] = a[1] + b1i + b2i;
+                        y[2] = t1r + u1i;        y[3] = t1i - u1r;
+                        y[4] = t2r + u2i;        y[5] = t2i - u2r;
+                        y[6] = t2r - u2i;        y[7] = t2i + u2r;
+                        y[8] = t1r - u1i;        y[9] = t1i + u1r;
+                    } break;
+                default:
+                    {
+                        // generic O(p^2) butterfly for the remaining prime radices
+                        for (int q = 0; q < p; ++q) {
+                            float yr = 0.0f;
+                            float yi = 0.0f;
+                            for (int j = 0; j < p; ++j) {
+                                const double theta = -2.0*M_PI*((j*q) % p)/p;
+                                const float wr = cos(theta);
+                                const float wi = sin(theta);
+                                yr += a[2*j + 0]*wr - a[2*j + 1]*wi;
+                                yi += a[2*j + 0]*wi + a[2*j + 1]*wr;
+                            }
+                            y[2*q + 0] = yr;
+                            y[2*q + 1] = yi;
+                        }
+                    } break;
+            }
+
+            for (int q = 0; q < p; ++q) {
+                x[2*q*len_prev + 0] = y[2*q + 0];
+                x[2*q*len_prev + 1] = y[2*q + 1];
+            }
+        }
+    }
+}
+
+// real-input FFT using a precomputed plan
+// in:      plan.n real samples
+// out:     plan.n/2 + 1 complex bins (interleaved re/im)
+// scratch: plan.n floats
+static void whisper_fft_real(const whisper_fft_plan & plan, const float * in, float * out, float * scratch) {
+    const int m = plan.m;
+
+    float * z = scratch;
+
+    // pack pairs of real samples into complex values, in digit-reversed order
+    for (int pos = 0; pos < m; ++pos) {
+        const int i = plan.perm[pos];
+        z[2*pos + 0] = in[2*i + 0];
+        z[2*pos + 1] = in[2*i + 1];
+    }
+
+    {
+        const float * tw = plan.tw.data();
+
+        int len_prev = 1;
+        for (const int p : plan.radix) {
+            whisper_fft_stage(z, m, len_prev, p, tw);
+
+            tw += 2*len_prev*(p - 1);
+            len_prev *= p;
+        }
+    }
+
+    // split the packed transform Z into the transforms of the even (E) and odd (O) samples:
+    //   E[k] = (Z[k] + conj(Z[m - k]))/2
+    //   O[k] = (Z[k] - conj(Z[m - k]))/2i
+    //   X[k] = E[k] + W_n^k O[k]
+    for (int k = 0; k <= m; ++k) {
+        const int k0 = k == m ? 0 : k;
+        const int k1 = k == 0 ? 0 : m - k;
+
+        const float zr =  z[2*k0 + 0];
+        const float zi =  z[2*k0 + 1];
+        const float cr =  z[2*k1 + 0];
+        const float ci = -z[2*k1 + 1];
+
+        const float er = 0.5f*(zr + cr);
+        const float ei = 0.5f*(zi + ci);
+        const float or_ = 0.5f*(zi - ci);
+        const float oi  = -0.5f*(zr - cr);
+
+        const float wr = plan.tw_real[2*k + 0];
+        const float wi = plan.tw_real[2*k + 1];
+
+        out[2*k + 0] = er + wr*or_ - wi*oi;
+        out[2*k + 1] = ei + wr*oi  + wi*or_;
+    }
+}
+
 #define SIN_COS_N_COUNT WHISPER_N_FFT
 namespace {
 struct whisper_global_cache {
@@ -3003,9 +5063,13 @@ struct whisper_global_cache {
     // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
     float hann_window[WHISPER_N_FFT];
 
+    // plan for the per-frame real FFT of the mel spectrogram
+    whisper_fft_plan fft_plan;
+
     whisper_global_cache() {
         fill_sin_cos_table();
         fill_hann_window(sizeof(hann_window)/sizeof(hann_window[0]), true, hann_window);
+        whisper_fft_plan_init(fft_plan, WHISPER_N_FFT);
     }
 
     void fill_sin_cos_table() {
@@ -3050,7 +5114,8 @@ static void dft(const float* in, int N, float* out) {
 }
 
 // Cooley-Tukey FFT
-// poor man's implementation - use something better
+// poor man's implementation - the mel spectrogram uses whisper_fft_real(), this one is kept
+// as the reference for whisper_bench_fft()
 // input is real-valued
 // output is complex-valued
 static void fft(float* in, int N, float* out) {
@@ -3086,71 +5151,116 @@ static void fft(float* in, int N, float* out) {
         float re = global_cache.cos_vals[idx]; // cos(t)
         float im = -global_cache.sin_vals[idx]; // sin(t)
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+        float re_odd = odd_fft[2*k + 0];
+        float im_odd = odd_fft[2*k + 1];
+
+        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
+        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+
+        out[2*(k + half_N) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
+        out[2*(k + half_N) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+    }
+}
+
+// dot product of a power spectrum band with the weights of a mel filter
+static float whisper_mel_dot(const float * x, const float * w, int n) {
+    int k = 0;
+
+#if defined(__ARM_NEON)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (; k + 8 <= n; k += 8) {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(x + k + 0), vld1q_f32(w + k + 0));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(x + k + 4), vld1q_f32(w + k + 4));
+    }
+    acc0 = vaddq_f32(acc0, acc1);
+    float32x2_t acc2 = vadd_f32(vget_low_f32(acc0), vget_high_f32(acc0));
+    float sum = vget_lane_f32(vpadd_f32(acc2, acc2), 0);
+#elif defined(__SSE__)
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    for (; k + 8 <= n; k += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + k + 0), _mm_loadu_ps(w + k + 0)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + k + 4), _mm_loadu_ps(w + k + 4)));
+    }
+    float tmp[4];
+    _mm_storeu_ps(tmp, _mm_add_ps(acc0, acc1));
+    float sum = (tmp[0] + tmp[1]) + (tmp[2] + tmp[3]);
+#else
+    float sum = 0.0f;
+#endif
+
+    // handle the remainder
+    for (; k < n; k++) {
+        sum += x[k]*w[k];
+    }
+
+    return sum;
+}
+
+// per-thread buffers for computing log mel frames
+struct whisper_mel_frame_buf {
+    std::vector<float> fft_in;
+    std::vector<float> fft_out;
+    std::vector<float> fft_scratch;
+
+    explicit whisper_mel_frame_buf(int frame_size) :
+        fft_in(frame_size, 0.0f), fft_out(frame_size + 2), fft_scratch(frame_size) {}
+};
+
+// log mel values of a single frame, before clamping and normalization
+// the first n_avail samples of the frame are read, the rest of the window is zero
+// the value of mel band j is written to dst[j*dst_stride]
+static void log_mel_spectrogram_frame(whisper_mel_frame_buf & buf, const float * hann, const float * frame, int n_avail,
+                                      const whisper_filters & filters, int n_mel, float * dst, int dst_stride) {
+    const int frame_size = buf.fft_in.size();
+    const int n_fft      = filters.n_fft;
+
+    float * fft_in  = buf.fft_in.data();
+    float * fft_out = buf.fft_out.data();
+
+    // apply Hann window (~10% faster)
+    n_avail = std::min(frame_size, n_avail);
+    for (int j = 0; j < n_avail; j++) {
+        fft_in[j] = hann[j] * frame[j];
+    }
+
+    // fill the rest with zeros
+    std::fill(fft_in + n_avail, fft_in + frame_size, 0.0f);
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+    // FFT
+    whisper_fft_real(global_cache.fft_plan, fft_in, fft_out, buf.fft_scratch.data());
 
-        out[2*(k + half_N) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + half_N) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+    // Calculate modulus^2 of complex numbers
+    // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
+    for (int j = 0; j < n_fft; j++) {
+        fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
+    }
+
+    // mel spectrogram - only the non-zero band of each filter contributes
+    for (int j = 0; j < n_mel; j++) {
+        const float sum = whisper_mel_dot(fft_out + filters.sparse_start[j], filters.sparse_data.data() + filters.sparse_offs[j], filters.sparse_len[j]);
+
+        dst[j*dst_stride] = log10(std::max(sum, 1e-10f));
     }
 }
 
 static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const std::vector<float> & samples,
                                               int n_samples, int frame_size, int frame_step, int n_threads,
                                               const whisper_filters & filters, whisper_mel & mel) {
-    std::vector<float> fft_in(frame_size * 2, 0.0);
-    std::vector<float> fft_out(frame_size * 2 * 2 * 2);
+    whisper_mel_frame_buf buf(frame_size);
 
-    int n_fft = filters.n_fft;
     int i = ith;
 
     // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
-    assert(n_fft == 1 + (frame_size / 2));
+    assert(filters.n_fft == 1 + (frame_size / 2));
+    assert(frame_size == global_cache.fft_plan.n);
 
     // calculate FFT only when fft_in are not all zero
     for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
         const int offset = i * frame_step;
 
-        // apply Hann window (~10% faster)
-        for (int j = 0; j < std::min(frame_size, n_samples - offset); j++) {
-            fft_in[j] = hann[j] * samples[offset + j];
-        }
-
-        // fill the rest with zeros
-        if (n_samples - offset < frame_size) {
-            std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
-        }
-
-        // FFT
-        fft(fft_in.data(), frame_size, fft_out.data());
-
-        // Calculate modulus^2 of complex numbers
-        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < n_fft; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
-        }
-
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
-            }
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
-            }
-            sum = log10(std::max(sum, 1e-10));
-            mel.data[j * mel.n_len + i] = sum;
-        }
+        log_mel_spectrogram_frame(buf, hann, samples.data() + offset, n_samples - offset, filters, mel.n_mel, mel.data.data() + i, mel.n_len);
     }
 
     // Otherwise fft_out are all zero
@@ -3174,7 +5284,8 @@ static bool log_mel_spectrogram(
               const int   n_threads,
               const whisper_filters & filters,
               const bool   debug,
-              whisper_mel & mel) {
+              whisper_mel & mel,
+              whisper_threadpool & threadpool) {
     const int64_t t_start_us = ggml_time_us();
 
     // Hann window
@@ -3204,22 +5315,9 @@ static bool log_mel_spectrogram(
     mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
     mel.data.resize(mel.n_mel * mel.n_len);
 
-    {
-        std::vector<std::thread> workers(n_threads - 1);
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, hann, std::cref(samples_padded),
-                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
-                    std::cref(filters), std::ref(mel));
-        }
-
-        // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
-
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw].join();
-        }
-    }
+    threadpool.parallel_for(n_threads, n_threads, [&](int ith) {
+        log_mel_spectrogram_worker_thread(ith, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
+    });
 
     // clamping and normalization
     double mmax = -1e20;
@@ -3265,7 +5363,9 @@ static bool log_mel_spectrogram(
 // Regex (C++):
 // R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
 //
-static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
+// regex + substring probing tokenizer - tokenize() produces the same tokens, this one is kept
+// as the reference for whisper_bench_tokenize()
+static std::vector<whisper_vocab::id> tokenize_ref(const whisper_vocab & vocab, const std::string & text) {
     std::vector<std::string> words;
 
     // first split the text into words
@@ -3315,6 +5415,94 @@ static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, cons
     return tokens;
 }
 
+static bool tokenize_is_alpha(uint8_t c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static bool tokenize_is_digit(uint8_t c) {
+    return c >= '0' && c <= '9';
+}
+
+static bool tokenize_is_space(uint8_t c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static bool tokenize_is_other(uint8_t c) {
+    return !tokenize_is_alpha(c) && !tokenize_is_digit(c) && !tokenize_is_space(c);
+}
+
+// length of the word starting at text[i], the same split as the GPT-2 pattern (ASCII classes):
+//   's|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+
+static int tokenize_word_len(const char * text, int n, int i) {
+    const uint8_t c = text[i];
+
+    if (c == '\'') {
+        static const char * suffixes[] = { "s", "t", "re", "ve", "m", "ll", "d", };
+
+        for (const char * suffix : suffixes) {
+            const int len = strlen(suffix);
+            if (i + 1 + len <= n && strncmp(text + i + 1, suffix, len) == 0) {
+                return 1 + len;
+            }
+        }
+    }
+
+    // a run of one class, optionally preceded by a single space
+    for (auto is_class : { tokenize_is_alpha, tokenize_is_digit, tokenize_is_other }) {
+        int j = i;
+        if (c == ' ' && i + 1 < n && is_class(text[i + 1])) {
+            ++j;
+        } else if (!is_class(c)) {
+            continue;
+        }
+
+        while (j < n && is_class(text[j])) {
+            ++j;
+        }
+
+        return j - i;
+    }
+
+    // whitespace - the last one is left for the next word unless the text ends or it is the only one
+    int j = i;
+    while (j < n && tokenize_is_space(text[j])) {
+        ++j;
+    }
+
+    const int len = j - i;
+
+    return (j == n || len == 1) ? len : len - 1;
+}
+
+static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
+    std::vector<whisper_vocab::id> tokens;
+
+    const char * str = text.data();
+    const int    n   = text.size();
+
+    for (int i0 = 0; i0 < n; ) {
+        const int i1 = i0 + tokenize_word_len(str, n, i0);
+
+        // find the longest tokens that form the word
+        for (int i = i0; i < i1; ) {
+            whisper_vocab::id id = -1;
+
+            const int len = vocab.trie.longest_prefix(str + i, i1 - i, id);
+            if (len > 0) {
+                tokens.push_back(id);
+                i += len;
+            } else {
+                WHISPER_LOG_ERROR("unknown token\n");
+                ++i;
+            }
+        }
+
+        i0 = i1;
+    }
+
+    return tokens;
+}
+
 //
 // interface implementation
 //
@@ -3451,17 +5639,20 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     }
 #endif
 
-    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
-
     state->batch = whisper_batch_init(ctx->model.hparams.n_text_ctx, WHISPER_MAX_DECODERS);
 
     // TAGS: WHISPER_DECODER_INIT
     state->decoders[0].sequence.tokens.reserve(ctx->model.hparams.n_text_ctx);
 
-    state->decoders[0].probs.reserve    (ctx->vocab.n_vocab);
-    state->decoders[0].logits.reserve   (ctx->vocab.n_vocab);
-    state->decoders[0].logprobs.reserve (ctx->vocab.n_vocab);
-    state->decoders[0].logits_id.reserve(ctx->model.hparams.n_vocab);
+    // in low-memory mode the logits buffers are allocated on first use and released after each whisper_full
+    if (!ctx->params.low_mem) {
+        state->logits.reserve(ctx->vocab.n_vocab);
+
+        state->decoders[0].probs.reserve    (ctx->vocab.n_vocab);
+        state->decoders[0].logits.reserve   (ctx->vocab.n_vocab);
+        state->decoders[0].logprobs.reserve (ctx->vocab.n_vocab);
+        state->decoders[0].logits_id.reserve(ctx->model.hparams.n_vocab);
+    }
 
     state->decoders[0].rng = std::mt19937(0);
 
@@ -3613,12 +5804,63 @@ struct whisper_context_params whisper_context_default_params() {
             /*.heads            =*/ NULL,
         },
         /*.dtw_mem_size         =*/ 1024*1024*128,
+
+        /*.use_mmap             =*/ true,
+        /*.mmap_prefetch        =*/ true,
+
+        /*.threadpool           =*/ nullptr,
+
+        /*.low_mem              =*/ false,
     };
     return result;
 }
 
+static struct whisper_context * whisper_init_with_params_no_state_impl(
+        struct whisper_model_loader * loader,
+      struct whisper_context_params   params,
+       std::unique_ptr<whisper_mmap>   mapping);
+
 struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
     WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
+
+    if (params.use_mmap) {
+        auto mapping = whisper_mmap_open(path_model, params.mmap_prefetch);
+        if (mapping) {
+            whisper_model_loader loader = {};
+
+            loader.context = mapping.get();
+
+            loader.read = [](void * ctx, void * output, size_t read_size) {
+                whisper_mmap * mapping = reinterpret_cast<whisper_mmap *>(ctx);
+
+                size_t size_to_copy = mapping->offs + read_size < mapping->size ? read_size : mapping->size - mapping->offs;
+
+                memcpy(output, (const uint8_t *) mapping->addr + mapping->offs, size_to_copy);
+                mapping->offs += size_to_copy;
+
+                return size_to_copy;
+            };
+
+            loader.eof = [](void * ctx) {
+                whisper_mmap * mapping = reinterpret_cast<whisper_mmap *>(ctx);
+
+                return mapping->offs >= mapping->size;
+            };
+
+            loader.close = [](void * /*ctx*/) { };
+
+            auto ctx = whisper_init_with_params_no_state_impl(&loader, params, std::move(mapping));
+
+            if (ctx) {
+                ctx->path_model = path_model;
+            }
+
+            return ctx;
+        }
+
+        WHISPER_LOG_WARN("%s: failed to mmap '%s', falling back to regular reads\n", __func__, path_model);
+    }
+
 #ifdef _MSC_VER
     // Convert UTF-8 path to wide string (UTF-16) for Windows, resolving character encoding issues.
     std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
@@ -3699,6 +5941,13 @@ struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * bu
 }
 
 struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
+    return whisper_init_with_params_no_state_impl(loader, params, nullptr);
+}
+
+static struct whisper_context * whisper_init_with_params_no_state_impl(
+        struct whisper_model_loader * loader,
+      struct whisper_context_params   params,
+       std::unique_ptr<whisper_mmap>   mapping) {
     ggml_time_init();
 
     if (params.flash_attn && params.dtw_token_timestamps) {
@@ -3715,6 +5964,14 @@ struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_
 
     whisper_context * ctx = new whisper_context;
     ctx->params = params;
+    ctx->model.mapping = std::move(mapping);
+
+    if (params.threadpool) {
+        ctx->threadpool = params.threadpool;
+    } else {
+        ctx->threadpool_own.reset(whisper_threadpool_init(-1));
+        ctx->threadpool = ctx->threadpool_own.get();
+    }
 
     if (!whisper_model_load(loader, *ctx)) {
         loader->close(loader->context);
@@ -3831,83 +6088,363 @@ void whisper_free_state(struct whisper_state * state) {
         // [EXPERIMENTAL] Token-level timestamps with DTW
         aheads_masks_free(state->aheads_masks);
 
-        if (state->vad_context != nullptr) {
-            whisper_vad_free(state->vad_context);
-            state->vad_context = nullptr;
+        if (state->vad_context != nullptr) {
+            whisper_vad_free(state->vad_context);
+            state->vad_context = nullptr;
+        }
+
+        whisper_free_state(state->draft_state);
+
+        delete state;
+    }
+}
+
+void whisper_free(struct whisper_context * ctx) {
+    if (ctx) {
+        for (ggml_context * context : ctx->model.ctxs) {
+            ggml_free(context);
+        }
+
+        for (ggml_backend_buffer_t buf : ctx->model.buffers) {
+            ggml_backend_buffer_free(buf);
+        }
+
+        whisper_free_state(ctx->state);
+
+        delete ctx;
+    }
+}
+
+void whisper_free_context_params(struct whisper_context_params * params) {
+    if (params) {
+        delete params;
+    }
+}
+
+struct whisper_threadpool * whisper_threadpool_init(int n_threads) {
+    if (n_threads < 0) {
+        n_threads = (int) std::thread::hardware_concurrency() - 1;
+    }
+
+    return new whisper_threadpool(n_threads);
+}
+
+void whisper_threadpool_free(struct whisper_threadpool * pool) {
+    delete pool;
+}
+
+struct whisper_decode_group * whisper_decode_group_init(struct whisper_context * ctx, int n_states_max, bool batch_encoder) {
+    if (ctx->params.dtw_token_timestamps) {
+        WHISPER_LOG_ERROR("%s: decode groups do not support DTW token timestamps\n", __func__);
+        return nullptr;
+    }
+
+    return new whisper_decode_group(ctx, std::max(1, n_states_max), batch_encoder);
+}
+
+void whisper_decode_group_free(struct whisper_decode_group * group) {
+    if (group == nullptr) {
+        return;
+    }
+
+    ggml_backend_sched_free(group->sched.sched);
+    ggml_backend_sched_free(group->sched_encode.sched);
+
+    for (auto & backend : group->backends) {
+        ggml_backend_free(backend);
+    }
+
+    delete group;
+}
+
+void whisper_free_params(struct whisper_full_params * params) {
+    if (params) {
+        delete params;
+    }
+}
+
+int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    state->kv_cross_mel_offset = -1;
+
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel, *ctx->threadpool)) {
+        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
+}
+
+int whisper_set_mel_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                   const float * data,
+                           int   n_len,
+                           int   n_mel) {
+    if (n_mel != ctx->model.filters.n_mel) {
+        WHISPER_LOG_ERROR("%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, ctx->model.filters.n_mel);
+        return -1;
+    }
+
+    state->kv_cross_mel_offset = -1;
+
+    state->mel.n_len     = n_len;
+    state->mel.n_len_org = n_len;
+    state->mel.n_mel     = n_mel;
+
+    state->mel.data.resize(n_len*n_mel);
+    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+
+    return 0;
+}
+
+int whisper_set_mel(
+        struct whisper_context * ctx,
+        const float * data,
+        int n_len,
+        int n_mel) {
+    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
+}
+
+//
+// incremental log mel spectrogram
+//
+
+struct whisper_mel_stream {
+    const whisper_filters * filters = nullptr;
+
+    whisper_threadpool * threadpool = nullptr;
+
+    int n_mel = 0;
+
+    bool started = false;
+
+    std::vector<float> head; // samples received before the reflective pad at the start can be built
+    std::vector<float> pcm;  // padded samples, starting at the first frame that is not computed yet
+
+    int64_t n_samples = 0;   // samples pushed since the last reset
+    int64_t f0        = 0;   // absolute index of the first retained frame
+
+    int n_frames = 0;        // retained complete frames
+
+    std::vector<float> data;      // [n_frames][n_mel], before clamping and normalization
+    std::vector<float> frame_max; // max over the mel bands of each retained frame
+
+    float mmax = -1e20f;     // running max over the retained frames
+
+    whisper_mel_frame_buf buf { WHISPER_N_FFT };
+    std::vector<float>    tail; // frames that still depend on samples not received yet
+};
+
+struct whisper_mel_stream * whisper_mel_stream_init(struct whisper_context * ctx) {
+    if (ctx == nullptr) {
+        return nullptr;
+    }
+
+    whisper_mel_stream * stream = new whisper_mel_stream;
+
+    stream->filters    = &ctx->model.filters;
+    stream->threadpool = ctx->threadpool;
+    stream->n_mel      = ctx->model.filters.n_mel;
+
+    return stream;
+}
+
+void whisper_mel_stream_free(struct whisper_mel_stream * stream) {
+    delete stream;
+}
+
+void whisper_mel_stream_reset(struct whisper_mel_stream * stream) {
+    stream->started = false;
+
+    stream->head.clear();
+    stream->pcm.clear();
+
+    stream->n_samples = 0;
+    stream->f0        = 0;
+    stream->n_frames  = 0;
+
+    stream->data.clear();
+    stream->frame_max.clear();
+
+    stream->mmax = -1e20f;
+}
+
+int whisper_mel_stream_push(struct whisper_mel_stream * stream, const float * samples, int n_samples, int n_threads) {
+    if (n_samples <= 0) {
+        return 0;
+    }
+
+    const int frame_size = WHISPER_N_FFT;
+    const int frame_step = WHISPER_HOP_LENGTH;
+    const int pad        = frame_size / 2;
+
+    stream->n_samples += n_samples;
+
+    if (!stream->started) {
+        stream->head.insert(stream->head.end(), samples, samples + n_samples);
+
+        // the reflective pad at the beginning of the audio needs samples [1, pad]
+        if ((int) stream->head.size() <= pad) {
+            return 0;
+        }
+
+        stream->pcm.resize(pad);
+        std::reverse_copy(stream->head.begin() + 1, stream->head.begin() + 1 + pad, stream->pcm.begin());
+        stream->pcm.insert(stream->pcm.end(), stream->head.begin(), stream->head.end());
+
+        stream->head.clear();
+        stream->head.shrink_to_fit();
+
+        stream->started = true;
+    } else {
+        stream->pcm.insert(stream->pcm.end(), samples, samples + n_samples);
+    }
+
+    const int n_pcm = stream->pcm.size();
+    const int n_new = n_pcm >= frame_size ? (n_pcm - frame_size)/frame_step + 1 : 0;
+
+    if (n_new == 0) {
+        return 0;
+    }
+
+    const int n_mel = stream->n_mel;
+
+    stream->data.resize((size_t) (stream->n_frames + n_new)*n_mel);
+    stream->frame_max.resize(stream->n_frames + n_new);
+
+    float * dst = stream->data.data() + (size_t) stream->n_frames*n_mel;
+
+    const whisper_filters & filters = *stream->filters;
+    const float * hann = global_cache.hann_window;
+
+    n_threads = std::max(1, std::min(n_threads, n_new));
+
+    if (n_threads == 1) {
+        for (int i = 0; i < n_new; ++i) {
+            log_mel_spectrogram_frame(stream->buf, hann, stream->pcm.data() + i*frame_step, frame_size, filters, n_mel, dst + i*n_mel, 1);
         }
+    } else {
+        stream->threadpool->parallel_for(n_threads, n_threads, [&](int ith) {
+            whisper_mel_frame_buf buf(frame_size);
+            for (int i = ith; i < n_new; i += n_threads) {
+                log_mel_spectrogram_frame(buf, hann, stream->pcm.data() + i*frame_step, frame_size, filters, n_mel, dst + i*n_mel, 1);
+            }
+        });
+    }
 
-        delete state;
+    for (int i = 0; i < n_new; ++i) {
+        const float fmax = *std::max_element(dst + i*n_mel, dst + (i + 1)*n_mel);
+
+        stream->frame_max[stream->n_frames + i] = fmax;
+        stream->mmax = std::max(stream->mmax, fmax);
     }
-}
 
-void whisper_free(struct whisper_context * ctx) {
-    if (ctx) {
-        for (ggml_context * context : ctx->model.ctxs) {
-            ggml_free(context);
-        }
+    stream->n_frames += n_new;
 
-        for (ggml_backend_buffer_t buf : ctx->model.buffers) {
-            ggml_backend_buffer_free(buf);
-        }
+    // keep only the samples needed by the next frame
+    stream->pcm.erase(stream->pcm.begin(), stream->pcm.begin() + (size_t) n_new*frame_step);
 
-        whisper_free_state(ctx->state);
+    return n_new;
+}
 
-        delete ctx;
+void whisper_mel_stream_discard(struct whisper_mel_stream * stream, int n_frames) {
+    n_frames = std::min(n_frames, stream->n_frames);
+    if (n_frames <= 0) {
+        return;
     }
-}
 
-void whisper_free_context_params(struct whisper_context_params * params) {
-    if (params) {
-        delete params;
+    const int n_mel = stream->n_mel;
+
+    bool drop_max = false;
+    for (int i = 0; i < n_frames; ++i) {
+        drop_max = drop_max || stream->frame_max[i] >= stream->mmax;
     }
-}
 
-void whisper_free_params(struct whisper_full_params * params) {
-    if (params) {
-        delete params;
+    stream->data.erase(stream->data.begin(), stream->data.begin() + (size_t) n_frames*n_mel);
+    stream->frame_max.erase(stream->frame_max.begin(), stream->frame_max.begin() + n_frames);
+
+    stream->n_frames -= n_frames;
+    stream->f0       += n_frames;
+
+    // the running max only has to be rebuilt when the frame holding it slides out
+    if (drop_max) {
+        stream->mmax = -1e20f;
+        for (const float fmax : stream->frame_max) {
+            stream->mmax = std::max(stream->mmax, fmax);
+        }
     }
 }
 
-int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
-        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
+int whisper_mel_stream_n_len(struct whisper_mel_stream * stream) {
+    return stream->n_frames;
+}
+
+int whisper_mel_stream_to_state(struct whisper_context * ctx, struct whisper_state * state, struct whisper_mel_stream * stream) {
+    if (stream->n_mel != ctx->model.filters.n_mel) {
+        WHISPER_LOG_ERROR("%s: invalid number of mel bands: %d (expected %d)\n", __func__, stream->n_mel, ctx->model.filters.n_mel);
         return -1;
     }
 
-    return 0;
-}
+    const int64_t t_start_us = ggml_time_us();
 
-int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
-}
+    const int frame_step = WHISPER_HOP_LENGTH;
+    const int n_mel      = stream->n_mel;
 
-int whisper_set_mel_with_state(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-                   const float * data,
-                           int   n_len,
-                           int   n_mel) {
-    if (n_mel != ctx->model.filters.n_mel) {
-        WHISPER_LOG_ERROR("%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, ctx->model.filters.n_mel);
-        return -1;
+    // frames overlapping the end of the received audio are zero-padded, same as whisper_pcm_to_mel()
+    int n_tail = 0;
+    if (stream->started) {
+        n_tail = stream->pcm.size()/frame_step + 1;
+
+        stream->tail.resize((size_t) n_tail*n_mel);
+        for (int i = 0; i < n_tail; ++i) {
+            log_mel_spectrogram_frame(stream->buf, global_cache.hann_window, stream->pcm.data() + i*frame_step, (int) stream->pcm.size() - i*frame_step,
+                                      *stream->filters, n_mel, stream->tail.data() + i*n_mel, 1);
+        }
     }
 
-    state->mel.n_len     = n_len;
-    state->mel.n_len_org = n_len;
-    state->mel.n_mel     = n_mel;
+    float mmax = stream->mmax;
+    for (int i = 0; i < n_tail*n_mel; ++i) {
+        mmax = std::max(mmax, stream->tail[i]);
+    }
 
-    state->mel.data.resize(n_len*n_mel);
-    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+    // the audio is followed by 30 seconds of silence, same as whisper_pcm_to_mel()
+    const float silence = log10(1e-10);
 
-    return 0;
-}
+    mmax = std::max(mmax, silence) - 8.0f;
 
-int whisper_set_mel(
-        struct whisper_context * ctx,
-        const float * data,
-        int n_len,
-        int n_mel) {
-    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
+    const int64_t n_total = (stream->n_samples + WHISPER_SAMPLE_RATE*30)/frame_step;
+
+    whisper_mel & mel = state->mel;
+
+    state->kv_cross_mel_offset = -1;
+
+    mel.n_mel     = n_mel;
+    mel.n_len     = std::max<int64_t>(n_total - stream->f0, stream->n_frames + n_tail);
+    mel.n_len_org = stream->n_frames;
+    mel.data.resize((size_t) mel.n_len*n_mel);
+
+    const float v_silence = (std::max(silence, mmax) + 4.0f)/4.0f;
+
+    for (int j = 0; j < n_mel; ++j) {
+        float * row = mel.data.data() + (size_t) j*mel.n_len;
+
+        for (int i = 0; i < stream->n_frames; ++i) {
+            row[i] = (std::max(stream->data[(size_t) i*n_mel + j], mmax) + 4.0f)/4.0f;
+        }
+        for (int i = 0; i < n_tail; ++i) {
+            row[stream->n_frames + i] = (std::max(stream->tail[(size_t) i*n_mel + j], mmax) + 4.0f)/4.0f;
+        }
+
+        std::fill(row + stream->n_frames + n_tail, row + mel.n_len, v_silence);
+    }
+
+    state->t_mel_us += ggml_time_us() - t_start_us;
+
+    return 0;
 }
 
 int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
@@ -3938,6 +6475,19 @@ int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state
         return 1;
     }
 
+    // the public layout has one row per token with the logits of the last token in the last row,
+    // while only that row is computed - move it into place and zero the rows of the other tokens
+    // (their output_ids stay -1)
+    if (n_tokens > 1) {
+        const size_t n_vocab = ctx->vocab.n_vocab;
+
+        state->logits.resize(n_tokens*n_vocab);
+        memmove(state->logits.data() + (n_tokens - 1)*n_vocab, state->logits.data(), n_vocab*sizeof(float));
+        std::fill(state->logits.begin(), state->logits.begin() + (n_tokens - 1)*n_vocab, 0.0f);
+
+        state->output_ids[n_tokens - 1] = n_tokens - 1;
+    }
+
     return 0;
 }
 
@@ -4050,7 +6600,7 @@ int whisper_lang_auto_detect_with_state(
 
     for (const auto & kv : g_lang) {
         const auto token_lang = whisper_token_lang(ctx, kv.second.first);
-        logits_id.emplace_back(state->logits[token_lang], kv.second.first);
+        logits_id.emplace_back(whisper_state_logits(*ctx, *state, prompt.size() - 1)[token_lang], kv.second.first);
     }
 
     // sort descending
@@ -4271,6 +6821,9 @@ void whisper_print_timings(struct whisper_context * ctx) {
         WHISPER_LOG_INFO("%s:   decode time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
         WHISPER_LOG_INFO("%s:   batchd time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_batchd_us, n_batchd, 1e-3f * ctx->state->t_batchd_us / n_batchd);
         WHISPER_LOG_INFO("%s:   prompt time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_prompt_us, n_prompt, 1e-3f * ctx->state->t_prompt_us / n_prompt);
+        if (ctx->state->n_draft > 0) {
+            WHISPER_LOG_INFO("%s:    draft time = %8.2f ms / %5d tokens ( %5d accepted, %5.1f%%)\n", __func__, 1e-3f * ctx->state->t_draft_us, ctx->state->n_draft, ctx->state->n_accept, 100.0f * ctx->state->n_accept / ctx->state->n_draft);
+        }
     }
     WHISPER_LOG_INFO("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
 }
@@ -4284,11 +6837,14 @@ void whisper_reset_timings(struct whisper_context * ctx) {
         ctx->state->t_decode_us = 0;
         ctx->state->t_batchd_us = 0;
         ctx->state->t_prompt_us = 0;
+        ctx->state->t_draft_us = 0;
         ctx->state->n_sample = 0;
         ctx->state->n_encode = 0;
         ctx->state->n_decode = 0;
         ctx->state->n_batchd = 0;
         ctx->state->n_prompt = 0;
+        ctx->state->n_draft = 0;
+        ctx->state->n_accept = 0;
     }
 }
 
@@ -4410,16 +6966,17 @@ struct whisper_vad_context {
     int     n_threads;
 
     std::vector<ggml_backend_t> backends;
-    ggml_backend_buffer_t       buffer = nullptr;
     whisper_context_params      params;
-    std::vector<uint8_t>        ctx_buf;
     whisper_sched               sched;
 
     whisper_vad_model    model;
     std::string          path_model;
-    struct ggml_tensor * h_state;
-    struct ggml_tensor * c_state;
     std::vector<float>   probs;
+
+    // the LSTM recurrence and the output layer run on the host, one window at a time
+    std::vector<float>   lstm_hh;     // [hdim, 4*hdim]
+    std::vector<float>   final_w;     // [hdim]
+    float                final_b = 0.0f;
 };
 
 struct whisper_vad_context_params whisper_vad_default_context_params(void) {
@@ -4523,9 +7080,9 @@ static ggml_tensor * whisper_vad_build_stft_layer(ggml_context * ctx0,
     int cutoff = model.stft_forward_basis->ne[2] / 2;
 
     // Extract real part (first half of the STFT output).
-    struct ggml_tensor * real_part = ggml_view_2d(ctx0, stft, 4, cutoff, stft->nb[1], 0);
+    struct ggml_tensor * real_part = ggml_view_3d(ctx0, stft, 4, cutoff, stft->ne[2], stft->nb[1], stft->nb[2], 0);
     // Extract imaginary part (second half of the STFT output).
-    struct ggml_tensor * img_part = ggml_view_2d(ctx0, stft, 4, cutoff, stft->nb[1], cutoff * stft->nb[1]);
+    struct ggml_tensor * img_part = ggml_view_3d(ctx0, stft, 4, cutoff, stft->ne[2], stft->nb[1], stft->nb[2], cutoff * stft->nb[1]);
 
     // Calculate magnitude: sqrt(real^2 + imag^2)
     struct ggml_tensor * real_squared = ggml_mul(ctx0, real_part, real_part);
@@ -4560,52 +7117,53 @@ static ggml_tensor * whisper_vad_build_encoder_layer(ggml_context * ctx0,
     return cur;
 }
 
-static ggml_tensor * whisper_vad_build_lstm_layer(ggml_context * ctx0,
-        const whisper_vad_context & vctx, ggml_tensor * cur, ggml_cgraph * gf) {
-    const whisper_vad_model & model = vctx.model;
-    const int hdim = model.hparams.lstm_hidden_size;
-
-    struct ggml_tensor * x_t = ggml_transpose(ctx0, cur);
+// LSTM cell followed by the output layer (ReLU, 1x1 conv, sigmoid) for a single window
+// gates is the input projection of the window with both biases added, h/c are updated in place
+static float whisper_vad_lstm_step(const whisper_vad_context & vctx, const float * gates, float * h, float * c, float * pre) {
+    const int hdim = vctx.model.hparams.lstm_hidden_size;
 
-    // Create operations using the input-to-hidden weights.
-    struct ggml_tensor * inp_gate = ggml_mul_mat(ctx0, model.lstm_ih_weight, x_t);
-    inp_gate = ggml_add(ctx0, inp_gate, model.lstm_ih_bias);
+    const float * w_hh = vctx.lstm_hh.data();
 
-    // Create operations using the hidden-to-hidden weights.
-    struct ggml_tensor * hid_gate = ggml_mul_mat(ctx0, model.lstm_hh_weight, vctx.h_state);
-    hid_gate = ggml_add(ctx0, hid_gate, model.lstm_hh_bias);
+    // preactivations of the input, forget, cell and output gates
+    for (int r = 0; r < 4*hdim; ++r) {
+        const float * w = w_hh + (size_t) r*hdim;
 
-    // Create add operation to get preactivations for all gates.
-    struct ggml_tensor * out_gate = ggml_add(ctx0, inp_gate, hid_gate);
+        float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
 
-    const size_t hdim_size = ggml_row_size(out_gate->type, hdim);
-
-    // Create sigmoid for input gate (using the first 128 bytes from the preactivations).
-    struct ggml_tensor * i_t = ggml_sigmoid(ctx0, ggml_view_1d(ctx0, out_gate, hdim, 0 * hdim_size));
+        int k = 0;
+        for (; k + 3 < hdim; k += 4) {
+            sum[0] += w[k + 0]*h[k + 0];
+            sum[1] += w[k + 1]*h[k + 1];
+            sum[2] += w[k + 2]*h[k + 2];
+            sum[3] += w[k + 3]*h[k + 3];
+        }
+        for (; k < hdim; ++k) {
+            sum[0] += w[k]*h[k];
+        }
 
-    // Create sigmoid for the forget gate (using the second 128 bytes from the preactivations).
-    struct ggml_tensor * f_t = ggml_sigmoid(ctx0, ggml_view_1d(ctx0, out_gate, hdim, 1 * hdim_size));
+        pre[r] = gates[r] + (sum[0] + sum[1]) + (sum[2] + sum[3]);
+    }
 
-    // Create sigmoid for the cell gate (using the third 128 bytes from the preactivations).
-    struct ggml_tensor * g_t = ggml_tanh(ctx0, ggml_view_1d(ctx0, out_gate, hdim, 2 * hdim_size));
+    float logit = vctx.final_b;
 
-    // Create sigmoid for the output gate (using the fourth 128 bytes from the preactivations).
-    struct ggml_tensor * o_t = ggml_sigmoid(ctx0, ggml_view_1d(ctx0, out_gate, hdim, 3 * hdim_size));
+    for (int j = 0; j < hdim; ++j) {
+        const float i_t = 1.0f/(1.0f + expf(-pre[0*hdim + j]));
+        const float f_t = 1.0f/(1.0f + expf(-pre[1*hdim + j]));
+        const float g_t = tanhf(pre[2*hdim + j]);
+        const float o_t = 1.0f/(1.0f + expf(-pre[3*hdim + j]));
 
-    // Update cell state
-    struct ggml_tensor * c_out = ggml_add(ctx0,
-        ggml_mul(ctx0, f_t, vctx.c_state),
-        ggml_mul(ctx0, i_t, g_t));
-    ggml_build_forward_expand(gf, ggml_cpy(ctx0, c_out, vctx.c_state));
+        c[j] = f_t*c[j] + i_t*g_t;
+        h[j] = o_t*tanhf(c[j]);
 
-    // Update hidden state
-    struct ggml_tensor * out = ggml_mul(ctx0, o_t, ggml_tanh(ctx0, c_out));
-    ggml_build_forward_expand(gf, ggml_cpy(ctx0, out,   vctx.h_state));
+        logit += vctx.final_w[j]*std::max(h[j], 0.0f);
+    }
 
-    return out;
+    return 1.0f/(1.0f + expf(-logit));
 }
 
-static struct ggml_cgraph * whisper_vad_build_graph(whisper_vad_context & vctx) {
+// the windows do not depend on each other up to the LSTM, so the STFT, the encoder and the input projection of
+// the LSTM are evaluated for n_batch windows at once - only the recurrence is left for whisper_vad_lstm_step
+static struct ggml_cgraph * whisper_vad_build_graph(whisper_vad_context & vctx, int n_batch) {
     const auto & model = vctx.model;
 
     struct ggml_init_params params = {
@@ -4618,26 +7176,24 @@ static struct ggml_cgraph * whisper_vad_build_graph(whisper_vad_context & vctx)
 
     ggml_cgraph * gf = ggml_new_graph(ctx0);
 
-    struct ggml_tensor * frame = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, vctx.n_window, 1);
-    ggml_set_name(frame, "frame");
-    ggml_set_input(frame);
+    struct ggml_tensor * frames = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, vctx.n_window, 1, n_batch);
+    ggml_set_name(frames, "frames");
+    ggml_set_input(frames);
 
     struct ggml_tensor * cur = nullptr;
     {
-        cur = whisper_vad_build_stft_layer(ctx0, model, frame);
+        cur = whisper_vad_build_stft_layer(ctx0, model, frames);
 
         cur = whisper_vad_build_encoder_layer(ctx0, model, cur);
 
-        // Extract the first element of the first dimension
-        // (equivalent to pytorch's [:, :, 0])
-        cur = ggml_view_2d(ctx0, cur, 1, 128, cur->nb[1], 0);
+        // a single output position is left per window (equivalent to pytorch's [:, :, 0])
+        GGML_ASSERT(cur->ne[0] == 1);
+        cur = ggml_reshape_2d(ctx0, cur, cur->ne[1], n_batch);
 
-        cur = whisper_vad_build_lstm_layer(ctx0, vctx, cur, gf);
-        cur = ggml_relu(ctx0, cur);
-        cur = ggml_conv_1d(ctx0, model.final_conv_weight, cur, 1, 0, 1);
-        cur = ggml_add(ctx0, cur, model.final_conv_bias);
-        cur = ggml_sigmoid(ctx0, cur);
-        ggml_set_name(cur, "prob");
+        cur = ggml_mul_mat(ctx0, model.lstm_ih_weight, cur);
+        cur = ggml_add(ctx0, cur, model.lstm_ih_bias);
+        cur = ggml_add(ctx0, cur, model.lstm_hh_bias);
+        ggml_set_name(cur, "gates");
         ggml_set_output(cur);
     }
 
@@ -4648,6 +7204,94 @@ static struct ggml_cgraph * whisper_vad_build_graph(whisper_vad_context & vctx)
     return gf;
 }
 
+// speech probabilities of the windows of samples, the last one is padded with zeros
+// h/c hold the LSTM state and carry it from window to window
+static bool whisper_vad_eval(
+        whisper_vad_context & vctx,
+                const float * samples,
+                        int   n_samples,
+                      float * h,
+                      float * c,
+                      float * probs) {
+    const int n_window = vctx.n_window;
+    const int n_chunks = (n_samples + n_window - 1)/n_window;
+    const int n_gates  = 4*vctx.model.hparams.lstm_hidden_size;
+
+    if (n_chunks <= 0) {
+        return true;
+    }
+
+    const int n_batch = std::min(n_chunks, WHISPER_VAD_N_BATCH);
+
+    auto & sched = vctx.sched.sched;
+
+    ggml_cgraph * gf = whisper_vad_build_graph(vctx, n_batch);
+
+    if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+        WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
+        return false;
+    }
+
+    struct ggml_tensor * frames = ggml_graph_get_tensor(gf, "frames");
+    struct ggml_tensor * gates  = ggml_graph_get_tensor(gf, "gates");
+
+    std::vector<float> inp((size_t) n_batch*n_window);
+    std::vector<float> out((size_t) n_batch*n_gates);
+    std::vector<float> pre(n_gates);
+
+    bool ok = true;
+
+    for (int i0 = 0; i0 < n_chunks; i0 += n_batch) {
+        const int n_cur = std::min(n_batch, n_chunks - i0);
+
+        const int64_t offset = (int64_t) i0*n_window;
+        const int64_t n_copy = std::min<int64_t>((int64_t) n_cur*n_window, n_samples - offset);
+
+        std::copy(samples + offset, samples + offset + n_copy, inp.begin());
+        std::fill(inp.begin() + n_copy, inp.end(), 0.0f);
+
+        ggml_backend_tensor_set(frames, inp.data(), 0, ggml_nbytes(frames));
+
+        // do not reset the scheduler - we will reuse the graph in the next batch
+        if (!ggml_graph_compute_helper(sched, gf, vctx.n_threads, false)) {
+            WHISPER_LOG_ERROR("%s: failed to compute VAD graph\n", __func__);
+            ok = false;
+            break;
+        }
+
+        ggml_backend_tensor_get(gates, out.data(), 0, (size_t) n_cur*n_gates*sizeof(float));
+
+        for (int i = 0; i < n_cur; ++i) {
+            probs[i0 + i] = whisper_vad_lstm_step(vctx, out.data() + (size_t) i*n_gates, h, c, pre.data());
+        }
+    }
+
+    ggml_backend_sched_reset(sched);
+
+    return ok;
+}
+
+// float copy of a weight tensor
+static bool whisper_vad_tensor_to_f32(const ggml_tensor * t, std::vector<float> & dst) {
+    dst.resize(ggml_nelements(t));
+
+    if (t->type == GGML_TYPE_F32) {
+        ggml_backend_tensor_get(t, dst.data(), 0, ggml_nbytes(t));
+        return true;
+    }
+
+    const auto * traits = ggml_get_type_traits(t->type);
+    if (!traits->to_float || !ggml_is_contiguous(t)) {
+        return false;
+    }
+
+    std::vector<uint8_t> raw(ggml_nbytes(t));
+    ggml_backend_tensor_get(t, raw.data(), 0, raw.size());
+    traits->to_float(raw.data(), dst.data(), ggml_nelements(t));
+
+    return true;
+}
+
 static bool whisper_vad_init_context(whisper_vad_context * vctx) {
 
     auto whisper_context_params = whisper_context_default_params();
@@ -4662,41 +7306,27 @@ static bool whisper_vad_init_context(whisper_vad_context * vctx) {
         return false;
     }
 
-    const int32_t lstm_hidden_size = vctx->model.hparams.lstm_hidden_size;
-
-    vctx->ctx_buf.resize(2u*ggml_tensor_overhead());
+    const auto & model = vctx->model;
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ vctx->ctx_buf.size(),
-        /*.mem_buffer =*/ vctx->ctx_buf.data(),
-        /*.no_alloc   =*/ true,
-    };
-
-    ggml_context * ctx = ggml_init(params);
-    if (!ctx) {
-        WHISPER_LOG_ERROR("%s: failed to init LSTM state ggml context\n", __func__);
+    if (!whisper_vad_tensor_to_f32(model.lstm_hh_weight,    vctx->lstm_hh) ||
+        !whisper_vad_tensor_to_f32(model.final_conv_weight, vctx->final_w)) {
+        WHISPER_LOG_ERROR("%s: unsupported type of the LSTM weights\n", __func__);
         return false;
     }
 
-    // LSTM Hidden state
-    vctx->h_state = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, lstm_hidden_size);
-    ggml_set_name(vctx->h_state, "h_state");
-
-    // LSTM Cell state
-    vctx->c_state = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, lstm_hidden_size);
-    ggml_set_name(vctx->c_state, "c_state");
-
-    vctx->buffer = ggml_backend_alloc_ctx_tensors(ctx, vctx->backends[0]);
-    ggml_free(ctx);
-    if (!vctx->buffer) {
-        WHISPER_LOG_ERROR("%s: failed to allocate memory for the VAD state\n", __func__);
-        return false;
+    {
+        std::vector<float> final_b;
+        if (!whisper_vad_tensor_to_f32(model.final_conv_bias, final_b)) {
+            WHISPER_LOG_ERROR("%s: unsupported type of the LSTM weights\n", __func__);
+            return false;
+        }
+        vctx->final_b = final_b[0];
     }
 
     {
         bool ok = whisper_sched_graph_init(vctx->sched, vctx->backends,
                 [&]() {
-                    return whisper_vad_build_graph(*vctx);
+                    return whisper_vad_build_graph(*vctx, WHISPER_VAD_N_BATCH);
                 });
 
         if (!ok) {
@@ -5091,74 +7721,21 @@ bool whisper_vad_detect_speech(
     WHISPER_LOG_INFO("%s: detecting speech in %d samples\n", __func__, n_samples);
     WHISPER_LOG_INFO("%s: n_chunks: %d\n", __func__, n_chunks);
 
-    // Reset LSTM hidden/cell states
-    ggml_backend_buffer_clear(vctx->buffer, 0);
-
     vctx->probs.resize(n_chunks);
     WHISPER_LOG_INFO("%s: props size: %u\n", __func__, n_chunks);
 
-    std::vector<float> window(vctx->n_window, 0.0f);
-
-    auto & sched = vctx->sched.sched;
-
-    ggml_cgraph * gf = whisper_vad_build_graph(*vctx);
-
-    if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-        WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
-        return false;
-    }
+    // the LSTM starts from a zero state
+    std::vector<float> h_state(vctx->model.hparams.lstm_hidden_size, 0.0f);
+    std::vector<float> c_state(vctx->model.hparams.lstm_hidden_size, 0.0f);
 
-    struct ggml_tensor * frame = ggml_graph_get_tensor(gf, "frame");
-    struct ggml_tensor * prob  = ggml_graph_get_tensor(gf, "prob");
-
-    // we are going to reuse the graph multiple times for each chunk
     const int64_t t_start_vad_us = ggml_time_us();
 
-    for (int i = 0; i < n_chunks; i++) {
-        const int idx_start = i * vctx->n_window;
-        const int idx_end = std::min(idx_start + vctx->n_window, n_samples);
-
-        const int chunk_len = idx_end - idx_start;
-
-        if (chunk_len < vctx->n_window) {
-            WHISPER_LOG_INFO("%s: chunk_len: %d < n_window: %d\n", __func__, chunk_len, vctx->n_window);
-            std::vector<float> partial_chunk(vctx->n_window, 0.0f);
-            std::copy(samples + idx_start, samples + idx_end, partial_chunk.begin());
-
-            // Copy the zero-padded chunk to the window.
-            const int samples_to_copy_max = vctx->n_window;
-            const int samples_to_copy_cur = std::min(samples_to_copy_max, (int)partial_chunk.size());
-            std::copy(partial_chunk.begin(), partial_chunk.begin() + samples_to_copy_cur, window.begin());
-            if (samples_to_copy_cur < samples_to_copy_max) {
-                std::fill(window.begin() + samples_to_copy_cur, window.end(), 0.0f);
-            }
-        } else {
-            // Copy current frame samples to the window.
-            const int samples_to_copy = std::min(idx_end - idx_start, vctx->n_window);
-            std::copy(samples + idx_start, samples + idx_start + samples_to_copy, window.begin());
-        }
-
-        // Set the frame tensor data with the samples.
-        ggml_backend_tensor_set(frame, window.data(), 0, ggml_nelements(frame) * sizeof(float));
-
-        // do not reset the scheduler - we will reuse the graph in the next chunk
-        if (!ggml_graph_compute_helper(sched, gf, vctx->n_threads, false)) {
-            WHISPER_LOG_ERROR("%s: failed to compute VAD graph\n", __func__);
-            break;
-        }
-
-        // Get the probability for this chunk.
-        ggml_backend_tensor_get(prob, &vctx->probs[i], 0, sizeof(float));
-
-        //WHISPER_LOG_DEBUG("chunk %d: p = %7.3f\n", i, probs[i]);
-    }
+    const bool ok = whisper_vad_eval(*vctx, samples, n_samples, h_state.data(), c_state.data(), vctx->probs.data());
 
     vctx->t_vad_us += ggml_time_us() - t_start_vad_us;
     WHISPER_LOG_INFO("%s: vad time = %.2f ms processing %d samples\n", __func__, 1e-3f * vctx->t_vad_us, n_samples);
 
-    ggml_backend_sched_reset(sched);
-
-    return true;
+    return ok;
 }
 
 int whisper_vad_segments_n_segments(struct whisper_vad_segments * segments) {
@@ -5398,43 +7975,247 @@ struct whisper_vad_segments * whisper_vad_segments_from_probs(
                 (speeches[i].end + speech_pad_samples) : audio_length_samples;
         }
 
-        // Convert from samples to centiseconds
-        segments[i].start = samples_to_cs(speeches[i].start);
-        segments[i].end   = samples_to_cs(speeches[i].end);
+        // Convert from samples to centiseconds
+        segments[i].start = samples_to_cs(speeches[i].start);
+        segments[i].end   = samples_to_cs(speeches[i].end);
+
+        WHISPER_LOG_INFO("%s: VAD segment %d: start = %.2f, end = %.2f (duration: %.2f)\n",
+                        __func__, i, segments[i].start/100.0, segments[i].end/100.0, (segments[i].end - segments[i].start)/100.0);
+    }
+
+    whisper_vad_segments * vad_segments = new whisper_vad_segments;
+    if (vad_segments == NULL) {
+        WHISPER_LOG_ERROR("%s: failed to allocate memory for whisper_vad_segments\n", __func__);
+        return nullptr;
+    }
+
+    vad_segments->data = std::move(segments);
+
+    return vad_segments;
+}
+
+struct whisper_vad_segments * whisper_vad_segments_from_samples(
+        whisper_vad_context * vctx,
+        whisper_vad_params params,
+        const float * samples,
+        int n_samples) {
+    WHISPER_LOG_INFO("%s: detecting speech timestamps in %d samples\n", __func__, n_samples);
+    if (!whisper_vad_detect_speech(vctx, samples, n_samples)) {
+        WHISPER_LOG_ERROR("%s: failed to detect speech\n", __func__);
+        return nullptr;
+    }
+    return whisper_vad_segments_from_probs(vctx, params);
+}
+
+//
+// streaming VAD
+//
+
+struct whisper_vad_stream {
+    whisper_vad_context * vctx;
+    whisper_vad_params    params;
+
+    // LSTM state between the pushes
+    std::vector<float> h_state;
+    std::vector<float> c_state;
+
+    std::vector<float> pending; // samples of the incomplete window
+    std::vector<float> window;  // complete windows of the current push
+    std::vector<float> probs;
+
+    int64_t n_samples = 0; // samples pushed so far
+    int64_t n_done    = 0; // samples of the evaluated windows
+
+    // hysteresis, positions in samples
+    bool    above     = false; // probability at or above threshold since t_above
+    bool    speech    = false; // a speech segment is open since t_start
+    int64_t t_above   = 0;
+    int64_t t_start   = 0;
+    int64_t t_silence = -1;     // start of the silence inside the segment, -1 - none
+
+    std::vector<whisper_vad_event> events;
+};
+
+static void whisper_vad_stream_emit(whisper_vad_stream & stream, whisper_vad_event_type type, int64_t sample) {
+    stream.events.push_back({ type, std::max<int64_t>(0, sample) });
+}
+
+// advance the speech segment state with the probability of the window starting at sample t
+static void whisper_vad_stream_update(whisper_vad_stream & stream, float prob, int64_t t) {
+    const auto & params = stream.params;
+
+    const int64_t n_window    = stream.vctx->n_window;
+    const int64_t min_speech  = (int64_t) WHISPER_SAMPLE_RATE*params.min_speech_duration_ms/1000;
+    const int64_t min_silence = (int64_t) WHISPER_SAMPLE_RATE*params.min_silence_duration_ms/1000;
+    const int64_t pad         = (int64_t) WHISPER_SAMPLE_RATE*params.speech_pad_ms/1000;
+
+    const int64_t max_speech = params.max_speech_duration_s > 100000.0f ?
+        std::numeric_limits<int64_t>::max() : (int64_t) (WHISPER_SAMPLE_RATE*params.max_speech_duration_s);
+
+    const float neg_threshold = std::max(params.threshold - 0.15f, 0.01f);
+
+    if (prob >= params.threshold) {
+        if (!stream.above) {
+            stream.above   = true;
+            stream.t_above = t;
+        }
+
+        stream.t_silence = -1;
+
+        if (!stream.speech && t + n_window - stream.t_above >= min_speech) {
+            stream.speech  = true;
+            stream.t_start = stream.t_above;
+
+            whisper_vad_stream_emit(stream, WHISPER_VAD_EVENT_SPEECH_START, stream.t_start - pad);
+        }
+    } else {
+        if (prob < neg_threshold) {
+            stream.above = false;
+        }
+
+        if (stream.speech && prob < neg_threshold) {
+            if (stream.t_silence < 0) {
+                stream.t_silence = t;
+            }
+
+            if (t + n_window - stream.t_silence >= min_silence) {
+                stream.speech = false;
+
+                whisper_vad_stream_emit(stream, WHISPER_VAD_EVENT_SPEECH_END, stream.t_silence + pad);
+
+                stream.t_silence = -1;
+            }
+        }
+    }
+
+    // split long segments
+    if (stream.speech && t + n_window - stream.t_start > max_speech) {
+        whisper_vad_stream_emit(stream, WHISPER_VAD_EVENT_SPEECH_END,   t + n_window);
+        whisper_vad_stream_emit(stream, WHISPER_VAD_EVENT_SPEECH_START, t + n_window);
+
+        stream.t_start   = t + n_window;
+        stream.t_silence = -1;
+    }
+}
+
+struct whisper_vad_stream * whisper_vad_stream_init(struct whisper_vad_context * vctx, struct whisper_vad_params params) {
+    if (vctx == nullptr) {
+        return nullptr;
+    }
+
+    whisper_vad_stream * stream = new whisper_vad_stream;
+
+    stream->vctx   = vctx;
+    stream->params = params;
+
+    stream->pending.reserve(vctx->n_window);
+
+    whisper_vad_stream_reset(stream);
+
+    return stream;
+}
+
+void whisper_vad_stream_free(struct whisper_vad_stream * stream) {
+    delete stream;
+}
+
+void whisper_vad_stream_reset(struct whisper_vad_stream * stream) {
+    const int hdim = stream->vctx->model.hparams.lstm_hidden_size;
+
+    stream->h_state.assign(hdim, 0.0f);
+    stream->c_state.assign(hdim, 0.0f);
+
+    stream->pending.clear();
 
-        WHISPER_LOG_INFO("%s: VAD segment %d: start = %.2f, end = %.2f (duration: %.2f)\n",
-                        __func__, i, segments[i].start/100.0, segments[i].end/100.0, (segments[i].end - segments[i].start)/100.0);
+    stream->n_samples = 0;
+    stream->n_done    = 0;
+
+    stream->above     = false;
+    stream->speech    = false;
+    stream->t_above   = 0;
+    stream->t_start   = 0;
+    stream->t_silence = -1;
+
+    stream->events.clear();
+}
+
+int whisper_vad_stream_push(struct whisper_vad_stream * stream, const float * samples, int n_samples) {
+    stream->events.clear();
+
+    if (samples == nullptr || n_samples <= 0) {
+        return 0;
     }
 
-    whisper_vad_segments * vad_segments = new whisper_vad_segments;
-    if (vad_segments == NULL) {
-        WHISPER_LOG_ERROR("%s: failed to allocate memory for whisper_vad_segments\n", __func__);
-        return nullptr;
+    auto & vctx = *stream->vctx;
+
+    const int n_window = vctx.n_window;
+
+    stream->n_samples += n_samples;
+
+    // complete windows of the pending and the new samples, the rest waits for the next push
+    const int n_pending = stream->pending.size();
+    const int n_chunks  = (n_pending + n_samples)/n_window;
+    const int n_take    = n_chunks*n_window - n_pending;
+
+    if (n_chunks == 0) {
+        stream->pending.insert(stream->pending.end(), samples, samples + n_samples);
+        return 0;
     }
 
-    vad_segments->data = std::move(segments);
+    const int64_t t_start_vad_us = ggml_time_us();
 
-    return vad_segments;
+    stream->window.assign(stream->pending.begin(), stream->pending.end());
+    stream->window.insert(stream->window.end(), samples, samples + n_take);
+
+    stream->pending.assign(samples + n_take, samples + n_samples);
+
+    stream->probs.resize(n_chunks);
+
+    // the eval can fail after some of the windows have advanced the LSTM state
+    const std::vector<float> h_prev = stream->h_state;
+    const std::vector<float> c_prev = stream->c_state;
+
+    const bool ok = whisper_vad_eval(vctx, stream->window.data(), (int) stream->window.size(),
+            stream->h_state.data(), stream->c_state.data(), stream->probs.data());
+
+    if (ok) {
+        for (int i = 0; i < n_chunks; ++i) {
+            whisper_vad_stream_update(*stream, stream->probs[i], stream->n_done);
+
+            stream->n_done += n_window;
+        }
+    } else {
+        // keep the samples of the failed windows, so the positions of the next events still match the audio
+        stream->h_state = h_prev;
+        stream->c_state = c_prev;
+
+        stream->window.insert(stream->window.end(), stream->pending.begin(), stream->pending.end());
+        stream->pending.swap(stream->window);
+    }
+
+    vctx.t_vad_us += ggml_time_us() - t_start_vad_us;
+
+    return ok ? (int) stream->events.size() : -1;
 }
 
-struct whisper_vad_segments * whisper_vad_segments_from_samples(
-        whisper_vad_context * vctx,
-        whisper_vad_params params,
-        const float * samples,
-        int n_samples) {
-    WHISPER_LOG_INFO("%s: detecting speech timestamps in %d samples\n", __func__, n_samples);
-    if (!whisper_vad_detect_speech(vctx, samples, n_samples)) {
-        WHISPER_LOG_ERROR("%s: failed to detect speech\n", __func__);
-        return nullptr;
+struct whisper_vad_event whisper_vad_stream_get_event(struct whisper_vad_stream * stream, int i) {
+    if (i < 0 || i >= (int) stream->events.size()) {
+        return { WHISPER_VAD_EVENT_SPEECH_END, -1 };
     }
-    return whisper_vad_segments_from_probs(vctx, params);
+
+    return stream->events[i];
+}
+
+bool whisper_vad_stream_is_speech(struct whisper_vad_stream * stream) {
+    return stream->speech;
+}
+
+int64_t whisper_vad_stream_n_samples(struct whisper_vad_stream * stream) {
+    return stream->n_samples;
 }
 
 void whisper_vad_free(whisper_vad_context * ctx) {
     if (ctx) {
-        if (ctx->buffer) {
-            ggml_backend_buffer_free(ctx->buffer);
-        }
         for (ggml_context * context : ctx->model.ctxs) {
             ggml_free(context);
         }
@@ -5525,6 +8306,101 @@ static std::pair<std::vector<uint32_t>, whisper_partial_utf8> decode_utf8(
     return std::make_pair(std::move(code_points), whisper_partial_utf8{ value, n_remain });
 }
 
+// entries [i0, i1) of the sorted tokens share their first depth code points and end up below node
+static void whisper_vocab_cp_trie_build_node(
+            whisper_vocab_cp_trie & trie,
+        const std::vector<std::pair<std::vector<uint32_t>, int32_t>> & entries,
+                          int32_t   node,
+                              int   i0,
+                              int   i1,
+                           size_t   depth) {
+    trie.nodes[node].tok0 = i0;
+    trie.nodes[node].tok1 = i1;
+
+    // the tokens that end here sort first
+    while (i0 < i1 && entries[i0].first.size() == depth) {
+        ++trie.nodes[node].n_end;
+        ++i0;
+    }
+
+    int n_edges = 0;
+    for (int i = i0; i < i1; ++i) {
+        if (i == i0 || entries[i].first[depth] != entries[i - 1].first[depth]) {
+            ++n_edges;
+        }
+    }
+
+    const int32_t edge0 = trie.edge_cp.size();
+
+    trie.nodes[node].edge0   = edge0;
+    trie.nodes[node].n_edges = n_edges;
+
+    trie.edge_cp  .resize(edge0 + n_edges);
+    trie.edge_node.resize(edge0 + n_edges);
+
+    for (int i = i0, e = edge0; i < i1; ++e) {
+        const uint32_t cp = entries[i].first[depth];
+
+        int j = i + 1;
+        while (j < i1 && entries[j].first[depth] == cp) {
+            ++j;
+        }
+
+        const int32_t child = trie.nodes.size();
+        trie.nodes.emplace_back();
+
+        trie.edge_cp  [e] = cp;
+        trie.edge_node[e] = child;
+
+        whisper_vocab_cp_trie_build_node(trie, entries, child, i, j, depth + 1);
+
+        i = j;
+    }
+}
+
+static void whisper_vocab_cp_trie_build(whisper_vocab & vocab) {
+    auto & trie = vocab.cp_trie;
+
+    trie = {};
+
+    // code points of the text tokens, the same candidates as whisper_suppress_invalid_grammar() considers
+    std::vector<std::pair<std::vector<uint32_t>, int32_t>> entries;
+    std::vector<whisper_partial_utf8>                      partial(vocab.token_eot);
+
+    for (whisper_vocab::id id = 0; id < vocab.token_eot; ++id) {
+        const auto it = vocab.id_to_token.find(id);
+        if (it == vocab.id_to_token.end() || it->second.empty()) {
+            continue;
+        }
+
+        auto decoded = decode_utf8(it->second.c_str(), { 0, 0 });
+        if (decoded.second.n_remain < 0) {
+            trie.invalid.push_back(id);
+            continue;
+        }
+
+        // drop the terminating 0
+        decoded.first.pop_back();
+
+        partial[id] = decoded.second;
+        entries.emplace_back(std::move(decoded.first), id);
+    }
+
+    std::sort(entries.begin(), entries.end());
+
+    trie.ids    .resize(entries.size());
+    trie.partial.resize(entries.size());
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        trie.ids[i]     = entries[i].second;
+        trie.partial[i] = partial[entries[i].second];
+    }
+
+    trie.nodes.emplace_back();
+
+    whisper_vocab_cp_trie_build_node(trie, entries, 0, 0, (int) entries.size(), 0);
+}
+
 // returns true iff pos points to the end of one of the definitions of a rule
 static bool whisper_grammar_is_end_of_sequence(const whisper_grammar_element * pos) {
     switch (pos->type) {
@@ -5769,6 +8645,82 @@ static std::vector<whisper_grammar_candidate> whisper_grammar_reject_candidates(
     return rejects;
 }
 
+// sets the bits of the tokens below node that none of the stacks accepts
+// the tokens share the code points up to node, so each prefix is matched once for all of them
+static void whisper_grammar_reject_trie(
+        const std::vector<std::vector<whisper_grammar_element>>         & rules,
+        const whisper_vocab_cp_trie                                     & trie,
+                                                          int32_t         node,
+        const std::vector<std::vector<const whisper_grammar_element *>> & stacks,
+                                            std::vector<uint64_t>       & mask) {
+    const auto & nd = trie.nodes[node];
+
+    auto reject = [&](int k) {
+        const int32_t id = trie.ids[k];
+        mask[id/64] |= uint64_t(1) << (id%64);
+    };
+
+    // tokens that end here, accepted if a stack is complete or can continue their incomplete UTF-8 sequence
+    for (int k = nd.tok0; k < nd.tok0 + nd.n_end; ++k) {
+        const auto & partial = trie.partial[k];
+
+        bool accept = false;
+        for (const auto & stack : stacks) {
+            if (stack.empty() ? partial.n_remain == 0 :
+                    (partial.n_remain == 0 || whisper_grammar_match_partial_char(stack.back(), partial))) {
+                accept = true;
+                break;
+            }
+        }
+
+        if (!accept) {
+            reject(k);
+        }
+    }
+
+    std::vector<std::vector<const whisper_grammar_element *>> next_stacks;
+
+    for (int e = nd.edge0; e < nd.edge0 + nd.n_edges; ++e) {
+        const uint32_t cp    = trie.edge_cp[e];
+        const int32_t  child = trie.edge_node[e];
+
+        next_stacks.clear();
+
+        for (const auto & stack : stacks) {
+            if (stack.empty()) {
+                continue;
+            }
+
+            const auto match = whisper_grammar_match_char(stack.back(), cp);
+            if (!match.first) {
+                continue;
+            }
+
+            // update top of stack to next element, if any
+            std::vector<const whisper_grammar_element *> stack_after(stack.begin(), stack.end() - 1);
+            if (!whisper_grammar_is_end_of_sequence(match.second)) {
+                stack_after.push_back(match.second);
+            }
+            whisper_grammar_advance_stack(rules, stack_after, next_stacks);
+        }
+
+        if (next_stacks.empty()) {
+            const auto & nc = trie.nodes[child];
+            for (int k = nc.tok0; k < nc.tok1; ++k) {
+                reject(k);
+            }
+            continue;
+        }
+
+        if (next_stacks.size() > 1) {
+            std::sort(next_stacks.begin(), next_stacks.end());
+            next_stacks.erase(std::unique(next_stacks.begin(), next_stacks.end()), next_stacks.end());
+        }
+
+        whisper_grammar_reject_trie(rules, trie, child, next_stacks, mask);
+    }
+}
+
 static struct whisper_grammar whisper_grammar_init(
             const whisper_grammar_element ** rules,
                                  size_t      n_rules,
@@ -5806,7 +8758,13 @@ static struct whisper_grammar whisper_grammar_init(
         }
     } while (true);
 
-    return { std::move(vec_rules), std::move(stacks), {} };
+    // moving the rules keeps the element addresses the stacks point to
+    return {
+        std::make_shared<const std::vector<std::vector<whisper_grammar_element>>>(std::move(vec_rules)),
+        std::move(stacks),
+        {},
+        std::make_shared<whisper_grammar_cache>(),
+    };
 }
 
 static void whisper_suppress_invalid_grammar(
@@ -5815,7 +8773,7 @@ static void whisper_suppress_invalid_grammar(
            std::vector<float> & logits,
     const     whisper_grammar & grammar) {
 
-    if (grammar.rules.empty() || grammar.stacks.empty()) {
+    if (!grammar.rules || grammar.rules->empty() || grammar.stacks.empty()) {
         return;
     }
 
@@ -5829,6 +8787,54 @@ static void whisper_suppress_invalid_grammar(
 
     const whisper_token eot = whisper_token_eot(&ctx);
 
+    // from a clean UTF-8 state the token code points are known in advance and the rejections only depend on the stacks
+    if (grammar.partial_utf8.n_remain == 0 && grammar.cache) {
+        const auto & trie = ctx.vocab.cp_trie;
+
+        std::vector<const whisper_grammar_element *> key;
+        for (const auto & stack : grammar.stacks) {
+            key.insert(key.end(), stack.begin(), stack.end());
+            key.push_back(nullptr);
+        }
+
+        std::shared_ptr<const std::vector<uint64_t>> mask;
+        {
+            std::lock_guard<std::mutex> lock(grammar.cache->mutex);
+
+            const auto it = grammar.cache->masks.find(key);
+            if (it != grammar.cache->masks.end()) {
+                mask = it->second;
+            }
+        }
+
+        if (!mask) {
+            auto mask_new = std::make_shared<std::vector<uint64_t>>((eot + 63)/64, 0);
+
+            for (const auto id : trie.invalid) {
+                (*mask_new)[id/64] |= uint64_t(1) << (id%64);
+            }
+
+            whisper_grammar_reject_trie(*grammar.rules, trie, 0, grammar.stacks, *mask_new);
+
+            mask = mask_new;
+
+            std::lock_guard<std::mutex> lock(grammar.cache->mutex);
+
+            if (grammar.cache->masks.size() >= WHISPER_GRAMMAR_CACHE_MAX) {
+                grammar.cache->masks.clear();
+            }
+            grammar.cache->masks.emplace(std::move(key), mask);
+        }
+
+        for (int i = 0; i < (int) mask->size(); ++i) {
+            for (uint64_t bits = (*mask)[i]; bits != 0; bits &= bits - 1) {
+                logits[64*i + whisper_bit_lowest(bits)] -= params.grammar_penalty;
+            }
+        }
+
+        return;
+    }
+
     std::vector<std::pair<std::vector<uint32_t>, whisper_partial_utf8>> candidates_decoded;
     std::vector<whisper_grammar_candidate>                              candidates_grammar;
 
@@ -5840,7 +8846,7 @@ static void whisper_suppress_invalid_grammar(
         }
     }
 
-    const auto rejects = whisper_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+    const auto rejects = whisper_grammar_reject_candidates(*grammar.rules, grammar.stacks, candidates_grammar);
 
     for (const auto & reject : rejects) {
         logits[reject.id] -= params.grammar_penalty;
@@ -5854,7 +8860,7 @@ static void whisper_suppress_invalid_grammar(
 }
 
 static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar & grammar, whisper_token token) {
-    if (grammar.rules.empty() || grammar.stacks.empty()) {
+    if (!grammar.rules || grammar.rules->empty() || grammar.stacks.empty()) {
         return;
     }
 
@@ -5872,7 +8878,7 @@ static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar
     const auto   decoded     = decode_utf8(text.c_str(), grammar.partial_utf8);
     const auto & code_points = decoded.first;
     for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
-        grammar.stacks = whisper_grammar_accept(grammar.rules, grammar.stacks, *it);
+        grammar.stacks = whisper_grammar_accept(*grammar.rules, grammar.stacks, *it);
     }
     grammar.partial_utf8 = decoded.second;
 }
@@ -5946,6 +8952,9 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.max_initial_ts    =*/  1.0f,
         /*.length_penalty    =*/ -1.0f,
 
+        /*.top_k             =*/  0,
+        /*.top_p             =*/  1.0f,
+
         /*.temperature_inc   =*/  0.2f,
         /*.entropy_thold     =*/  2.4f,
         /*.logprob_thold     =*/ -1.0f,
@@ -5961,6 +8970,13 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
             /*.patience  =*/ -1.0f,
         },
 
+        /*.decode_group     =*/ nullptr,
+
+        /*.speculative      =*/ {
+            /*.ctx     =*/ nullptr,
+            /*.n_draft =*/ 8,
+        },
+
         /*.new_segment_callback           =*/ nullptr,
         /*.new_segment_callback_user_data =*/ nullptr,
 
@@ -6095,38 +9111,141 @@ static const std::vector<std::string> non_speech_tokens = {
     "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
 };
 
-static void whisper_compute_logprobs(
-                const std::vector<float> & logits,
-                              const int    n_logits,
-                      std::vector<float> & logprobs) {
-    const float logit_max = *std::max_element(logits.begin(), logits.end());
-    float logsumexp = 0.0f;
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] > -INFINITY) {
-            logsumexp += expf(logits[i] - logit_max);
+// logsumexp of the logits, split at n_text (the first timestamp token)
+struct whisper_logits_lse {
+    float max      = -INFINITY; // max over all logits
+    float max_text = -INFINITY; // max over the text tokens
+    float sum_text = 0.0f;      // sum of exp(logit - max) over the text tokens
+    float sum_ts   = 0.0f;      // sum of exp(logit - max) over the timestamp tokens
+    float lse      = -INFINITY; // logsumexp over all logits
+};
+
+// two passes over the logits: the maxima, then the exponentials
+// exps receives exp(logit - max), which is 0 for suppressed logits
+static whisper_logits_lse whisper_logits_logsumexp(const float * logits, int n_logits, int n_text, float * exps) {
+    whisper_logits_lse res;
+
+    float max_ts = -INFINITY;
+    for (int i = 0; i < n_text; ++i) {
+        res.max_text = logits[i] > res.max_text ? logits[i] : res.max_text;
+    }
+    for (int i = n_text; i < n_logits; ++i) {
+        max_ts = logits[i] > max_ts ? logits[i] : max_ts;
+    }
+
+    res.max = std::max(res.max_text, max_ts);
+
+    if (res.max == -INFINITY) {
+        std::fill(exps, exps + n_logits, 0.0f);
+        return res;
+    }
+
+    for (int i = 0; i < n_text; ++i) {
+        exps[i] = expf(logits[i] - res.max);
+        res.sum_text += exps[i];
+    }
+    for (int i = n_text; i < n_logits; ++i) {
+        exps[i] = expf(logits[i] - res.max);
+        res.sum_ts += exps[i];
+    }
+
+    res.lse = res.max + logf(res.sum_text + res.sum_ts);
+
+    return res;
+}
+
+// compile the static logit suppressions of the params, unless the cached ones still match
+static void whisper_suppress_prepare(
+              struct whisper_context & ctx,
+             struct whisper_suppress & sup,
+    const struct whisper_full_params & params) {
+    const auto & vocab = ctx.vocab;
+
+    const std::string regex = params.suppress_regex ? params.suppress_regex : "";
+
+    if (sup.valid &&
+        sup.no_timestamps  == params.no_timestamps &&
+        sup.tdrz_enable    == params.tdrz_enable &&
+        sup.suppress_nst   == params.suppress_nst &&
+        sup.suppress_regex == regex) {
+        return;
+    }
+
+    sup.valid          = true;
+    sup.no_timestamps  = params.no_timestamps;
+    sup.tdrz_enable    = params.tdrz_enable;
+    sup.suppress_nst   = params.suppress_nst;
+    sup.suppress_regex = regex;
+
+    sup.pre.clear();
+    sup.post.clear();
+    sup.post_mask.clear();
+
+    // suppress <|notimestamps|> token
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
+    sup.pre.push_back(vocab.token_not);
+
+    // suppress sot and nosp tokens
+    sup.pre.push_back(vocab.token_sot);
+    sup.pre.push_back(vocab.token_nosp);
+
+    // [TDRZ] when tinydiarize is disabled, suppress solm token
+    if (params.tdrz_enable == false) {
+        sup.pre.push_back(vocab.token_solm);
+    }
+
+    // suppress task tokens
+    sup.pre.push_back(vocab.token_translate);
+    sup.pre.push_back(vocab.token_transcribe);
+    sup.pre.push_back(vocab.token_prev);
+
+    // suppress lang tokens
+    for (size_t i = 0; i < g_lang.size(); ++i) {
+        sup.pre.push_back(whisper_token_lang(&ctx, i));
+    }
+
+    // suppress any tokens matching a regular expression
+    // ref: https://github.com/openai/whisper/discussions/1041
+    if (!regex.empty()) {
+        try {
+            std::regex re(regex);
+            for (const auto & token_id : vocab.token_to_id) {
+                if (std::regex_match(token_id.first, re)) {
+                    sup.post.push_back(token_id.second);
+                }
+            }
+        } catch (const std::regex_error & e) {
+            WHISPER_LOG_ERROR("%s: invalid suppress_regex '%s': %s\n", __func__, regex.c_str(), e.what());
         }
     }
-    logsumexp = logf(logsumexp) + logit_max;
 
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] > -INFINITY) {
-            logprobs[i] = logits[i] - logsumexp;
-        } else {
-            logprobs[i] = -INFINITY;
+    // suppress non-speech tokens
+    // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+    if (params.suppress_nst) {
+        for (const std::string & token : non_speech_tokens) {
+            const std::string suppress_tokens[] = {token, " " + token};
+            for (const std::string & suppress_token : suppress_tokens) {
+                const auto it = vocab.token_to_id.find(suppress_token);
+                if (it != vocab.token_to_id.end()) {
+                    sup.post.push_back(it->second);
+                }
+            }
+        }
+
+        // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+        for (const char * suppress_token : { " -", " '" }) {
+            const auto it = vocab.token_to_id.find(suppress_token);
+            if (it != vocab.token_to_id.end()) {
+                sup.post.push_back(it->second);
+            }
         }
     }
-}
 
-static void whisper_compute_probs(
-    const std::vector<float> & logits,
-                  const int    n_logits,
-    const std::vector<float> & logprobs,
-          std::vector<float> & probs)     {
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] == -INFINITY) {
-            probs[i] = 0.0f;
-        } else {
-            probs[i] = expf(logprobs[i]);
+    // a broad regex can match a large part of the vocab - add a dense mask instead of scattering
+    if (sup.post.size() > (size_t) vocab.n_vocab/16) {
+        sup.post_mask.assign(vocab.n_vocab, 0.0f);
+        for (const whisper_token id : sup.post) {
+            sup.post_mask[id] = -INFINITY;
         }
     }
 }
@@ -6156,12 +9275,16 @@ static void whisper_process_logits(
     auto & logprobs = decoder.logprobs;
     {
         logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + decoder.i_batch*n_logits, n_logits*sizeof(float));
+
+        const float * src = whisper_state_logits(ctx, state, decoder.i_batch);
 
         if (temperature > 0.0f) {
+            const float scale = 1.0f/temperature;
             for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
+                logits[i] = src[i]*scale;
             }
+        } else {
+            memcpy(logits.data(), src, n_logits*sizeof(float));
         }
 
         // will be populated a bit later
@@ -6181,70 +9304,29 @@ static void whisper_process_logits(
             }
         }
 
-        // suppress <|notimestamps|> token
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
-        logits[vocab.token_not] = -INFINITY;
-        if (params.no_timestamps) {
-            for (int i = vocab.token_beg; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
-            }
-        }
-
-        // suppress sot and nosp tokens
-        logits[vocab.token_sot]  = -INFINITY;
-        logits[vocab.token_nosp] = -INFINITY;
+        // static suppressions (special, task and language tokens), see whisper_suppress_prepare()
+        const auto & sup = state.suppress;
 
-        // [TDRZ] when tinydiarize is disabled, suppress solm token
-        if (params.tdrz_enable == false) {
-            logits[vocab.token_solm] = -INFINITY;
+        for (const whisper_token id : sup.pre) {
+            logits[id] = -INFINITY;
         }
-
-        // suppress task tokens
-        logits[vocab.token_translate]  = -INFINITY;
-        logits[vocab.token_transcribe] = -INFINITY;
-        logits[vocab.token_prev]       = -INFINITY;
-
-        // suppress lang tokens
-        for (size_t i = 0; i < g_lang.size(); ++i) {
-            logits[whisper_token_lang(&ctx, i)] = -INFINITY;
+        if (params.no_timestamps) {
+            std::fill(logits.begin() + vocab.token_beg, logits.end(), -INFINITY);
         }
 
-        // suppress prev token
-        logits[vocab.token_prev] = -INFINITY;
-
         if (params.logits_filter_callback) {
             params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
         }
 
-        // suppress any tokens matching a regular expression
-        // ref: https://github.com/openai/whisper/discussions/1041
-        if (params.suppress_regex != nullptr) {
-            std::regex re(params.suppress_regex);
-            for (std::pair<whisper_vocab::token, whisper_vocab::id> token_id : vocab.token_to_id) {
-                if (std::regex_match(token_id.first, re)) {
-                    logits[token_id.second] = -INFINITY;
-                }
-            }
-        }
-
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
-        if (params.suppress_nst) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
-
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
+        // suppress_regex and non-speech tokens
+        if (!sup.post_mask.empty()) {
+            const float * mask = sup.post_mask.data();
+            for (int i = 0; i < n_logits; ++i) {
+                logits[i] += mask[i];
             }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
+        } else {
+            for (const whisper_token id : sup.post) {
+                logits[id] = -INFINITY;
             }
         }
 
@@ -6269,6 +9351,15 @@ static void whisper_process_logits(
             }
         }
 
+        // with a reduced audio context, the timestamps cannot be past the end of the encoded window
+        {
+            const int n_audio_ctx = state.exp_n_audio_ctx > 0 ? state.exp_n_audio_ctx : ctx.model.hparams.n_audio_ctx;
+
+            for (int i = vocab.token_beg + n_audio_ctx + 1; i < n_logits; ++i) {
+                logits[i] = -INFINITY;
+            }
+        }
+
         // the initial timestamp cannot be larger than max_initial_ts
         // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L426-L429
         if (is_initial && params.max_initial_ts > 0.0f) {
@@ -6280,77 +9371,92 @@ static void whisper_process_logits(
             }
         }
 
-        // condition timestamp tokens to be increasing
-        // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
-        if (decoder.has_ts) {
-            const int tid0 = decoder.seek_delta/2;
+        // condition timestamp tokens to be increasing
+        // ref: https://github.com/openai/whisper/pull/831#issuecomment-1385910556
+        if (decoder.has_ts) {
+            const int tid0 = decoder.seek_delta/2;
+
+            for (int i = vocab.token_beg; i < vocab.token_beg + tid0; ++i) {
+                logits[i] = -INFINITY;
+            }
+        }
+
+        // log_softmax, keeping exp(logit - max) in probs so that the probs only need a rescale
+        whisper_logits_lse lse = whisper_logits_logsumexp(logits.data(), n_logits, vocab.token_beg, probs.data());
+
+        // text tokens whose logprobs are forced to -INF because a timestamp has to be sampled
+        int n_text_off = 0;
+
+        // if sum of probability over timestamps is above any other token, sample timestamp
+        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
+        {
+            // logsumexp over timestamps
+            const float timestamp_logprob      = lse.sum_ts > 0.0f ? logf(lse.sum_ts) + lse.max - lse.lse : -INFINITY;
+            const float max_text_token_logprob = lse.max_text - lse.lse;
+
+            //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
+
+            if (timestamp_logprob > max_text_token_logprob) {
+                // the timestamp logprobs keep the normalization over the full vocab
+                std::fill(logits.begin(), logits.begin() + vocab.token_beg, -INFINITY);
+                n_text_off = vocab.token_beg;
+            } else {
+                if (params.n_grammar_rules > 0) {
+                    whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
+
+                    // populate the logprobs array (log_softmax)
+                    lse = whisper_logits_logsumexp(logits.data(), n_logits, vocab.token_beg, probs.data());
+                }
+            }
+        }
+
+        // final pass: logprobs, probs and the statistics used by the samplers
+        {
+            const float scale = lse.max == -INFINITY ? 0.0f : 1.0f/(lse.sum_text + lse.sum_ts);
+
+            decoder.best_id = -1;
+            decoder.best_p  = 0.0f;
 
-            for (int i = vocab.token_beg; i < vocab.token_beg + tid0; ++i) {
-                logits[i] = -INFINITY;
+            for (int i = 0; i < n_text_off; ++i) {
+                probs[i]    = 0.0f;
+                logprobs[i] = -INFINITY;
             }
-        }
 
-        // populate the logprobs array (log_softmax)
-        whisper_compute_logprobs(logits, n_logits, logprobs);
+            for (int i = n_text_off; i < n_logits; ++i) {
+                probs[i]    = probs[i]*scale;
+                logprobs[i] = logits[i] - lse.lse;
+            }
 
-        // if sum of probability over timestamps is above any other token, sample timestamp
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
-        {
-            // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
+            for (int i = n_text_off; i < vocab.token_beg; ++i) {
+                if (decoder.best_p < probs[i]) {
+                    decoder.best_p  = probs[i];
+                    decoder.best_id = i;
                 }
             }
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+            double sum_ts = 0.0;
+            double max_ts = 0.0;
 
-            //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
+            decoder.ts_id = -1;
 
-            if (timestamp_logprob > max_text_token_logprob) {
-                for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
+            for (int i = vocab.token_beg; i < n_logits; ++i) {
+                sum_ts += probs[i];
+                if (max_ts < probs[i]) {
+                    max_ts = probs[i];
+                    decoder.ts_id = i;
                 }
-            } else {
-                if (params.n_grammar_rules > 0) {
-                    whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
+            }
 
-                    // populate the logprobs array (log_softmax)
-                    {
-                        const float logit_max = *std::max_element(logits.begin(), logits.end());
-                        float logsumexp = 0.0f;
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logsumexp += expf(logits[i] - logit_max);
-                            }
-                        }
-                        logsumexp = logf(logsumexp) + logit_max;
+            decoder.ts_sum = sum_ts;
+            decoder.ts_max = max_ts;
 
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logprobs[i] = logits[i] - logsumexp;
-                            } else {
-                                logprobs[i] = -INFINITY;
-                            }
-                        }
-                    }
-                }
+            if (decoder.best_p < max_ts) {
+                decoder.best_p  = max_ts;
+                decoder.best_id = decoder.ts_id;
             }
         }
     }
 
-    // compute probs
-    whisper_compute_probs(logits, n_logits, logprobs, probs);
-
 #if 0
     // print first 100 logits - token string : logit
     //for (int i = 0; i < 10; i++) {
@@ -6405,22 +9511,186 @@ static void whisper_process_logits(
 #endif
 }
 
-static bool whisper_sequence_tokens_equal(const whisper_sequence & a, const whisper_sequence & b) {
-    if (a.tokens.size() != b.tokens.size()) {
-        return false;
+// child of parent with the given token, nodes from n_reuse onwards are checked so that equal sequences share a node
+static int32_t whisper_beam_node_add(
+        std::vector<whisper_beam_node> & nodes,
+                               int32_t   n_reuse,
+                               int32_t   parent,
+              const whisper_token_data & token) {
+    for (int32_t i = n_reuse; i < (int32_t) nodes.size(); ++i) {
+        if (nodes[i].parent == parent && nodes[i].token.id == token.id) {
+            return i;
+        }
     }
-    // sequences are more likely to diverge at the end
-    for (int i = a.tokens.size() - 1; i >= 0; i--) {
-        if (a.tokens[i].id != b.tokens[i].id) {
-            return false;
+
+    nodes.push_back({ parent, parent < 0 ? 0 : nodes[parent].depth + 1, token, });
+
+    return nodes.size() - 1;
+}
+
+// move the decoder to the trie node, rewriting only the tokens past the common prefix with its current sequence
+static void whisper_beam_decoder_set(
+    const std::vector<whisper_beam_node> & nodes,
+                         whisper_decoder & decoder,
+                                 int32_t   node) {
+    const auto depth = [&](int32_t n) {
+        return n < 0 ? -1 : nodes[n].depth;
+    };
+
+    auto & tokens = decoder.sequence.tokens;
+
+    tokens.resize(depth(node) + 1);
+
+    int32_t a = node;
+    int32_t b = decoder.beam_node;
+
+    while (depth(b) > depth(a)) {
+        b = nodes[b].parent;
+    }
+
+    while (a != b) {
+        tokens[nodes[a].depth] = nodes[a].token;
+
+        if (depth(b) == depth(a)) {
+            b = nodes[b].parent;
         }
+        a = nodes[a].parent;
+    }
+
+    decoder.beam_node = node;
+}
+
+// draw n_draws tokens from the decoder probs
+// the candidates are truncated to the top_k most likely tokens and then to the smallest set whose mass reaches top_p
+// the cumulative distribution is built in the decoder work containers and sampled with a binary search
+// without truncation the draws are the same as std::discrete_distribution over probs for the same rng state
+static void whisper_sample_candidates(
+            whisper_decoder & decoder,
+                        int   top_k,
+                      float   top_p,
+                        int   n_draws,
+              whisper_token * out) {
+    const auto & probs = decoder.probs;
+
+    const int n_probs = probs.size();
+
+    auto & cands = decoder.logits_id;
+    auto & cdf   = decoder.sample_cdf;
+
+    cands.clear();
+
+    const bool truncate = (top_k > 0 && top_k < n_probs) || top_p < 1.0f;
+
+    if (truncate) {
+        using pair_type = std::remove_reference<decltype(cands)>::type::value_type;
+
+        const auto by_prob = [](const pair_type & a, const pair_type & b) {
+            return a.first > b.first;
+        };
+
+        // mass the top_p threshold is relative to
+        double total = 0.0;
+
+        if (top_k > 0 && top_k < n_probs) {
+            // min-heap of the top_k most likely tokens - most tokens fail the comparison with the heap top
+            for (int i = 0; i < n_probs; ++i) {
+                if (probs[i] <= 0.0f) {
+                    continue;
+                }
+                if ((int) cands.size() < top_k) {
+                    cands.emplace_back(probs[i], i);
+                    std::push_heap(cands.begin(), cands.end(), by_prob);
+                } else if (probs[i] > cands.front().first) {
+                    std::pop_heap(cands.begin(), cands.end(), by_prob);
+                    cands.back() = pair_type(probs[i], i);
+                    std::push_heap(cands.begin(), cands.end(), by_prob);
+                }
+            }
+
+            for (const auto & c : cands) {
+                total += c.first;
+            }
+        } else {
+            // the probs need not sum to 1 (e.g. when only the timestamp tokens are allowed)
+            for (int i = 0; i < n_probs; ++i) {
+                total += probs[i];
+            }
+
+            // the tokens below this threshold hold less than 1 - top_p of the mass in total,
+            // so they cannot be part of the nucleus
+            const float thold = (1.0f - top_p)*total/n_probs;
+
+            for (int i = 0; i < n_probs; ++i) {
+                if (probs[i] > 0.0f && probs[i] >= thold) {
+                    cands.emplace_back(probs[i], i);
+                }
+            }
+        }
+
+        if (top_p < 1.0f) {
+            // the nucleus is usually a handful of tokens - sort a growing prefix until it holds enough mass
+            size_t n_sorted = std::min<size_t>(64, cands.size());
+
+            double cum = 0.0;
+            size_t n_keep = 0;
+            while (true) {
+                std::partial_sort(cands.begin() + n_keep, cands.begin() + n_sorted, cands.end(), by_prob);
+
+                while (n_keep < n_sorted && (n_keep == 0 || cum < top_p*total)) {
+                    cum += cands[n_keep++].first;
+                }
+
+                if (n_keep < n_sorted || n_sorted == cands.size() || (n_keep > 0 && cum >= top_p*total)) {
+                    break;
+                }
+
+                n_sorted = std::min(2*n_sorted, cands.size());
+            }
+            cands.resize(n_keep);
+        }
+
+        if (cands.empty()) {
+            std::fill(out, out + n_draws, 0);
+            return;
+        }
+    }
+
+    const int n_cands = truncate ? (int) cands.size() : n_probs;
+
+    cdf.resize(n_cands);
+
+    double cum = 0.0;
+    if (truncate) {
+        for (int i = 0; i < n_cands; ++i) {
+            cum += cands[i].first;
+            cdf[i] = cum;
+        }
+    } else {
+        for (int i = 0; i < n_cands; ++i) {
+            cum += probs[i];
+            cdf[i] = cum;
+        }
+    }
+
+    if (cum <= 0.0) {
+        std::fill(out, out + n_draws, 0);
+        return;
+    }
+
+    for (int i = 0; i < n_draws; ++i) {
+        const double u = std::uniform_real_distribution<double>(0.0, cum)(decoder.rng);
+
+        const int idx = std::min<int>(std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin(), n_cands - 1);
+
+        out[i] = truncate ? cands[idx].second : idx;
     }
-    return true;
 }
 
 static whisper_token_data whisper_sample_token(
             whisper_context & ctx,
-      const whisper_decoder & decoder,
+            whisper_decoder & decoder,
+                        int   top_k,
+                      float   top_p,
                        bool   best) {
     whisper_token_data result = {
         0, 0, 0.0f, 0.0f, 0.0f, 0.0f, -1, -1, -1, 0.0f,
@@ -6431,40 +9701,23 @@ static whisper_token_data whisper_sample_token(
     const auto & probs    = decoder.probs;
     const auto & logprobs = decoder.logprobs;
 
-    const int n_logits = vocab.n_vocab;
-
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
-
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
-
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                result.tid = i;
-            }
-        }
-
-        result.pt    = max_ts/(sum_ts + 1e-10);
-        result.ptsum = sum_ts;
+    // the timestamp statistics and the argmax come from whisper_process_logits
+    if (decoder.ts_id >= 0) {
+        result.tid = decoder.ts_id;
     }
 
+    result.pt    = decoder.ts_max/(decoder.ts_sum + 1e-10);
+    result.ptsum = decoder.ts_sum;
+
     if (best) {
-        for (int i = 0; i < n_logits; ++i) {
-            if (result.p < probs[i]) {
-                result.id   = i;
-                result.p    = probs[i];
-                result.plog = logprobs[i];
-            }
+        if (decoder.best_id >= 0) {
+            result.id   = decoder.best_id;
+            result.p    = decoder.best_p;
+            result.plog = logprobs[decoder.best_id];
         }
     } else {
-        std::discrete_distribution<> dist(probs.begin(), probs.end());
+        whisper_sample_candidates(decoder, top_k, top_p, 1, &result.id);
 
-        result.id   = dist(decoder.rng);
         result.p    = probs[result.id];
         result.plog = logprobs[result.id];
     }
@@ -6480,65 +9733,28 @@ static whisper_token_data whisper_sample_token(
 static std::vector<whisper_token_data> whisper_sample_token_topk(
             whisper_context & ctx,
             whisper_decoder & decoder,
+                        int   top_k,
+                      float   top_p,
                         int   k) {
     const auto & vocab = ctx.vocab;
 
     const auto & probs    = decoder.probs;
-    const auto & logits   = decoder.logits;
     const auto & logprobs = decoder.logprobs;
 
-    const int n_logits = vocab.n_vocab;
-
-    auto & logits_id = decoder.logits_id;
-
-    logits_id.resize(n_logits);
-    for (int i = 0; i < n_logits; ++i) {
-        logits_id[i].first = logits[i];
-        logits_id[i].second = i;
-    }
-
-    {
-        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
-        std::partial_sort(
-                logits_id.begin(),
-                logits_id.begin() + k, logits_id.end(),
-                [](const pair_type & a, const pair_type & b) {
-            return a.first > b.first;
-        });
-    }
+    std::vector<whisper_token> ids(k);
+    whisper_sample_candidates(decoder, top_k, top_p, k, ids.data());
 
     std::vector<whisper_token_data> result;
     result.reserve(k);
 
-    whisper_token tid = vocab.token_beg;
-
-    float pt    = 0.0;
-    float ptsum = 0.0;
-
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
-
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
-
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                tid = i;
-            }
-        }
-
-        pt    = max_ts/(sum_ts + 1e-10);
-        ptsum = sum_ts;
-    }
+    // computed by whisper_process_logits
+    const whisper_token tid = decoder.ts_id >= 0 ? decoder.ts_id : vocab.token_beg;
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
+    const float pt    = decoder.ts_max/(decoder.ts_sum + 1e-10);
+    const float ptsum = decoder.ts_sum;
 
     for (int i = 0; i < k; ++i) {
-        const auto id = dist(decoder.rng);
+        const auto id = ids[i];
         //printf("XXX %d %d %f %f %f %f\n", id, tid, probs[id], logprobs[id], pt, ptsum);
 
         result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, -1, 0.0f, });
@@ -6785,6 +10001,114 @@ static bool whisper_vad(
     return true;
 }
 
+//
+// speculative decoding
+//
+
+// the draft model must produce the same token ids from the same mel spectrogram
+static bool whisper_speculative_compatible(const whisper_context & ctx, const whisper_context & dctx) {
+    const auto & hparams  = ctx.model.hparams;
+    const auto & dhparams = dctx.model.hparams;
+
+    return hparams.n_vocab     == dhparams.n_vocab     &&
+           hparams.n_mels      == dhparams.n_mels      &&
+           hparams.n_audio_ctx == dhparams.n_audio_ctx &&
+           hparams.n_text_ctx  == dhparams.n_text_ctx;
+}
+
+// propose up to n_draft tokens following the context with greedy decoding of the draft model
+// dtokens are the tokens in the kv cache of the draft state - only the part that differs from the context is
+// decoded again, which usually is the last accepted token and the correction of the decoder
+static bool whisper_speculative_draft(
+                 whisper_context & dctx,
+                   whisper_state & dstate,
+      std::vector<whisper_token> & dtokens,
+const std::vector<whisper_token> & context,
+                             int   n_draft,
+                             int   n_threads,
+      std::vector<whisper_token> & draft) {
+    draft.clear();
+
+    if (n_draft <= 0 || context.empty()) {
+        return true;
+    }
+
+    // at least the last token of the context is decoded to obtain its logits
+    size_t n_keep = 0;
+    while (n_keep < dtokens.size() && n_keep + 1 < context.size() && dtokens[n_keep] == context[n_keep]) {
+        n_keep++;
+    }
+
+    whisper_kv_cache_seq_rm(dstate.kv_self, 0, n_keep, -1);
+    dtokens.resize(n_keep);
+
+    auto & batch = dstate.batch;
+
+    whisper_batch_prep_legacy(batch, context.data() + n_keep, context.size() - n_keep, n_keep, 0);
+    dtokens.insert(dtokens.end(), context.begin() + n_keep, context.end());
+
+    const int n_vocab = dctx.vocab.n_vocab;
+
+    while (true) {
+        if (!whisper_decode_internal(dctx, dstate, batch, n_threads, false, nullptr, nullptr)) {
+            whisper_kv_cache_clear(dstate.kv_self);
+            dtokens.clear();
+            draft.clear();
+            return false;
+        }
+
+        const float * logits = whisper_state_logits(dctx, dstate, batch.n_tokens - 1);
+
+        const whisper_token id = std::max_element(logits, logits + n_vocab) - logits;
+
+        draft.push_back(id);
+
+        if (id == whisper_token_eot(&dctx) || (int) draft.size() >= n_draft) {
+            break;
+        }
+
+        whisper_batch_prep_legacy(batch, &id, 1, dtokens.size(), 0);
+        dtokens.push_back(id);
+    }
+
+    return true;
+}
+
+// encoder context for a window with n_frames of audio left, see WHISPER_AUDIO_CTX_PAD
+static int whisper_audio_ctx_auto(const whisper_context & ctx, int n_frames) {
+    const int n_audio_ctx = ctx.model.hparams.n_audio_ctx;
+
+    const int n_ctx = GGML_PAD(std::max(n_frames, 0)/2 + WHISPER_AUDIO_CTX_PAD, WHISPER_AUDIO_CTX_STEP);
+
+    return std::min(n_ctx, n_audio_ctx);
+}
+
+// encode the window alone or, with a batched encoder in params.decode_group, together with the other states of the group
+static bool whisper_full_encode(
+          whisper_context & ctx,
+            whisper_state & state,
+                const int   mel_offset,
+const whisper_full_params & params) {
+    if (params.decode_group && params.decode_group->batch_encoder) {
+        return whisper_decode_group_encode(*params.decode_group, state, mel_offset, params.n_threads, params.abort_callback, params.abort_callback_user_data);
+    }
+
+    return whisper_encode_internal(ctx, state, mel_offset, params.n_threads, params.abort_callback, params.abort_callback_user_data);
+}
+
+// decode the batch alone or, with params.decode_group, together with the other states of the group
+static bool whisper_full_decode(
+          whisper_context & ctx,
+            whisper_state & state,
+      const whisper_batch & batch,
+const whisper_full_params & params) {
+    if (params.decode_group) {
+        return whisper_decode_group_decode(*params.decode_group, state, batch, params.n_threads, params.abort_callback, params.abort_callback_user_data);
+    }
+
+    return whisper_decode_internal(ctx, state, batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data);
+}
+
 int whisper_full_with_state(
         struct whisper_context * ctx,
           struct whisper_state * state,
@@ -6796,6 +10120,9 @@ int whisper_full_with_state(
 
     result_all.clear();
 
+    // low-memory mode: the logits and sampling buffers do not outlive the call, also on failure
+    whisper_state_logits_scope logits_scope(state, ctx->params.low_mem);
+
     if (n_samples > 0) {
         // compute log mel spectrogram
         if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
@@ -6804,6 +10131,22 @@ int whisper_full_with_state(
         }
     }
 
+    // compile the logit suppressions once for the whole call
+    whisper_suppress_prepare(*ctx, state->suppress, params);
+
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+
+    // the language detection encodes the first window with the same context as the main loop, so it is reused
+    if (params.audio_ctx < 0) {
+        state->exp_n_audio_ctx = whisper_audio_ctx_auto(*ctx, whisper_n_len_from_state(state) - params.offset_ms/10);
+    } else {
+        state->exp_n_audio_ctx = params.audio_ctx;
+    }
+
     // auto-detect language if not specified
     if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
         std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
@@ -6939,13 +10282,6 @@ int whisper_full_with_state(
         }
     }
 
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
-    }
-    state->exp_n_audio_ctx = params.audio_ctx;
-
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx), };
 
@@ -6978,19 +10314,67 @@ int whisper_full_with_state(
     std::vector<whisper_token> prompt;
     prompt.reserve(whisper_n_text_ctx(ctx));
 
+    // the sequence and the grammar of a candidate are those of its decoder plus the new token
     struct beam_candidate {
         int decoder_idx;
         int seek_delta;
 
         bool has_ts;
 
-        whisper_sequence sequence;
-        whisper_grammar grammar;
+        int32_t            parent; // beam trie node of the decoder sequence
+        whisper_token_data token;
+
+        int    result_len;
+        double sum_logprobs_all;
     };
 
     std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
     std::vector<beam_candidate> beam_candidates;
 
+    // selected candidate and the parent grammar for each decoder
+    std::vector<int>             beam_selected(n_decoders);
+    std::vector<whisper_grammar> beam_grammars(n_decoders);
+
+    // the initial grammar of every decoder - the copies share the rules and the memoized rejection masks
+    whisper_grammar grammar_init = {};
+    if (params.grammar_rules != nullptr) {
+        grammar_init = whisper_grammar_init(params.grammar_rules, params.n_grammar_rules, params.i_start_rule);
+    }
+
+    // with a batched encoder the windows are encoded together with those of the other states of the group
+    whisper_decode_group_member group_member(params.decode_group);
+
+    // speculative decoding: the draft model has its own state, which encodes the same windows on first use
+    // the state is created on the first call and reused by the next ones with the same draft model
+    whisper_state * draft_state = nullptr;
+
+    if (params.speculative.ctx && params.speculative.n_draft > 0 && params.strategy == WHISPER_SAMPLING_GREEDY) {
+        if (!whisper_speculative_compatible(*ctx, *params.speculative.ctx)) {
+            WHISPER_LOG_WARN("%s: the draft model does not match the model - speculative decoding disabled\n", __func__);
+        } else {
+            if (state->draft_ctx != params.speculative.ctx) {
+                whisper_free_state(state->draft_state);
+
+                state->draft_state = whisper_init_state(params.speculative.ctx);
+                state->draft_ctx   = state->draft_state ? params.speculative.ctx : nullptr;
+            }
+
+            draft_state = state->draft_state;
+            if (!draft_state) {
+                WHISPER_LOG_WARN("%s: failed to init the draft state - speculative decoding disabled\n", __func__);
+            } else {
+                // the spectrogram is new, so is whatever the draft state encoded before
+                draft_state->kv_cross_mel_offset = -1;
+            }
+        }
+    }
+
+    bool draft_encoded = false;
+
+    std::vector<whisper_token> draft_tokens; // tokens in the kv cache of the draft state
+    std::vector<whisper_token> spec_context;
+    std::vector<whisper_token> spec_draft;   // draft tokens of the last verification
+
     // main loop
     while (true) {
         if (params.progress_callback) {
@@ -7012,8 +10396,15 @@ int whisper_full_with_state(
             }
         }
 
+        if (params.audio_ctx < 0) {
+            state->exp_n_audio_ctx = whisper_audio_ctx_auto(*ctx, seek_end - seek);
+        }
+
+        // number of mel frames covered by the window
+        const int n_window = 2*(state->exp_n_audio_ctx > 0 ? state->exp_n_audio_ctx : whisper_n_audio_ctx(ctx));
+
         // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+        if (!whisper_full_encode(*ctx, *state, seek, params)) {
             WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
             return -6;
         }
@@ -7025,6 +10416,11 @@ int whisper_full_with_state(
             prompt_past1.clear();
         }
 
+        // the decoder steps of this window are evaluated together with the other states of the group
+        whisper_decode_group_scope decode_group(params.decode_group);
+
+        draft_encoded = false;
+
         int best_decoder_id = 0;
 
         for (int it = 0; it < (int) temperatures.size(); ++it) {
@@ -7051,6 +10447,13 @@ int whisper_full_with_state(
 
             n_decoders_cur = std::max(1, n_decoders_cur);
 
+            // the draft is only verified against the most likely token
+            const bool spec = draft_state && n_decoders_cur == 1 && t_cur < 1e-6f;
+
+            // row k > 0 of the last verification has the logits after spec_draft[k - 1]
+            int spec_row = 0;
+            spec_draft.clear();
+
             WHISPER_LOG_DEBUG("\n%s: strategy = %d, decoding with %d decoders, temperature = %.2f\n", __func__, params.strategy, n_decoders_cur, t_cur);
 
             // TAGS: WHISPER_DECODER_INIT
@@ -7065,19 +10468,18 @@ int whisper_full_with_state(
                 decoder.sequence.entropy          = 0.0;
                 decoder.sequence.score            = -INFINITY;
 
-                decoder.seek_delta = 100*WHISPER_CHUNK_SIZE;
+                decoder.seek_delta = n_window;
+                decoder.beam_node  = -1;
 
                 decoder.failed    = false;
                 decoder.completed = false;
                 decoder.has_ts    = false;
 
-                if (params.grammar_rules != nullptr) {
-                    decoder.grammar = whisper_grammar_init(params.grammar_rules, params.n_grammar_rules, params.i_start_rule);
-                } else {
-                    decoder.grammar = {};
-                }
+                decoder.grammar = grammar_init;
             }
 
+            state->beam_nodes.clear();
+
             // init prompt and kv cache for the current iteration
             // TODO: do not recompute the prompt if it is the same as previous time
             {
@@ -7139,7 +10541,7 @@ int whisper_full_with_state(
 
                 whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
 
-                if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                if (!whisper_full_decode(*ctx, *state, state->batch, params)) {
                     WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
                     return -8;
                 }
@@ -7148,12 +10550,13 @@ int whisper_full_with_state(
                 // This has to be done before any logit filtering. Hence we cannot use the probs from the whisper_process_logits.
                 {
                     const int n_logits = ctx->vocab.id_to_token.size();
-                    std::vector<float> logprobs(n_logits);
-                    std::vector<float> probs(n_logits);
+                    std::vector<float> exps(n_logits);
 
-                    whisper_compute_logprobs(state->logits, n_logits, logprobs);
-                    whisper_compute_probs(state->logits, n_logits, logprobs, probs);
-                    state->no_speech_prob = probs[whisper_token_nosp(ctx)];
+                    const float * logits = whisper_state_logits(*ctx, *state, prompt.size() - 1);
+
+                    const whisper_logits_lse lse = whisper_logits_logsumexp(logits, n_logits, n_logits, exps.data());
+
+                    state->no_speech_prob = lse.max == -INFINITY ? 0.0f : expf(logits[whisper_token_nosp(ctx)] - lse.lse);
                 }
 
                 {
@@ -7187,66 +10590,41 @@ int whisper_full_with_state(
                 }
 
                 // sampling
-                // TODO: avoid memory allocations, optimize, avoid threads?
+                // TODO: avoid memory allocations, optimize
                 {
-                    std::atomic<int> j_cur(0);
-
-                    auto process = [&]() {
-                        while (true) {
-                            const int j = j_cur.fetch_add(1);
-
-                            if (j >= n_decoders_cur) {
-                                break;
-                            }
-
-                            auto & decoder = state->decoders[j];
-
-                            if (decoder.completed || decoder.failed) {
-                                continue;
-                            }
-
-                            switch (params.strategy) {
-                                case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
-                                    {
-                                        if (t_cur < 1e-6f) {
-                                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, true));
-                                        } else {
-                                            decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, false));
-                                        }
-
-                                        decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
-                                    } break;
-                                case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
-                                    {
-                                        const auto tokens_new = whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size);
-
-                                        for (const auto & token : tokens_new) {
-                                            bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence, decoder.grammar, });
-                                            bc_per_dec[j].back().sequence.tokens.push_back(token);
-                                            bc_per_dec[j].back().sequence.sum_logprobs_all += token.plog;
-                                        }
-                                    } break;
-                            };
-                        }
-                    };
-
-                    const int n_threads = std::min(params.n_threads, n_decoders_cur);
-
-                    if (n_threads == 1) {
-                        process();
-                    } else {
-                        std::vector<std::thread> threads(n_threads - 1);
+                    auto process = [&](int j) {
+                        auto & decoder = state->decoders[j];
 
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t] = std::thread(process);
+                        if (decoder.completed || decoder.failed) {
+                            return;
                         }
 
-                        process();
+                        switch (params.strategy) {
+                            case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
+                                {
+                                    if (t_cur < 1e-6f) {
+                                        decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, params.top_k, params.top_p, true));
+                                    } else {
+                                        decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, params.top_k, params.top_p, false));
+                                    }
+
+                                    decoder.sequence.sum_logprobs_all += decoder.sequence.tokens.back().plog;
+                                } break;
+                            case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
+                                {
+                                    const auto tokens_new = whisper_sample_token_topk(*ctx, decoder, params.top_k, params.top_p, params.beam_search.beam_size);
+
+                                    for (const auto & token : tokens_new) {
+                                        bc_per_dec[j].push_back({
+                                            j, decoder.seek_delta, decoder.has_ts, decoder.beam_node, token,
+                                            decoder.sequence.result_len, decoder.sequence.sum_logprobs_all + token.plog,
+                                        });
+                                    }
+                                } break;
+                        };
+                    };
 
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t].join();
-                        }
-                    }
+                    ctx->threadpool->parallel_for(n_decoders_cur, params.n_threads, process);
                 }
 
                 beam_candidates.clear();
@@ -7264,8 +10642,8 @@ int whisper_full_with_state(
                             beam_candidates.begin(),
                             beam_candidates.end(),
                             [](const beam_candidate & a, const beam_candidate & b) {
-                        if (a.sequence.sum_logprobs_all != b.sequence.sum_logprobs_all) {
-                            return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
+                        if (a.sum_logprobs_all != b.sum_logprobs_all) {
+                            return a.sum_logprobs_all > b.sum_logprobs_all;
                         }
                         return a.decoder_idx < b.decoder_idx;
                     });
@@ -7273,7 +10651,9 @@ int whisper_full_with_state(
                     uint32_t cur_c = 0;
 
                     for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+                        const auto & decoder = state->decoders[j];
+
+                        beam_selected[j] = -1;
 
                         if (decoder.completed || decoder.failed) {
                             continue;
@@ -7283,16 +10663,48 @@ int whisper_full_with_state(
                             cur_c = 0;
                         }
 
-                        auto & cur = beam_candidates[cur_c++];
+                        beam_selected[j] = cur_c;
+
+                        const auto & cur = beam_candidates[cur_c++];
 
-                        while (beam_candidates.size() > cur_c && whisper_sequence_tokens_equal(beam_candidates[cur_c].sequence, cur.sequence) && i > 0) {
+                        // equal sequences share the trie node of their parent
+                        while (beam_candidates.size() > cur_c && i > 0 &&
+                               beam_candidates[cur_c].parent   == cur.parent &&
+                               beam_candidates[cur_c].token.id == cur.token.id) {
                             ++cur_c;
                         }
 
+                        // the grammar is copied only when the decoder switches to another beam,
+                        // before any of the decoders it may come from is updated
+                        if (cur.decoder_idx != j) {
+                            beam_grammars[j] = state->decoders[cur.decoder_idx].grammar;
+                        }
+                    }
+
+                    const int32_t n_reuse = state->beam_nodes.size();
+
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        if (beam_selected[j] < 0) {
+                            continue;
+                        }
+
+                        const auto & cur = beam_candidates[beam_selected[j]];
+
+                        const int32_t node = whisper_beam_node_add(state->beam_nodes, n_reuse, cur.parent, cur.token);
+
+                        whisper_beam_decoder_set(state->beam_nodes, decoder, node);
+
                         decoder.seek_delta = cur.seek_delta;
                         decoder.has_ts     = cur.has_ts;
-                        decoder.sequence   = cur.sequence;
-                        decoder.grammar    = cur.grammar;
+
+                        decoder.sequence.result_len       = cur.result_len;
+                        decoder.sequence.sum_logprobs_all = cur.sum_logprobs_all;
+
+                        if (cur.decoder_idx != j) {
+                            std::swap(decoder.grammar, beam_grammars[j]);
+                        }
 
                         whisper_kv_cache_seq_cp(state->kv_self, cur.decoder_idx, WHISPER_MAX_DECODERS + j, -1, -1);
 
@@ -7376,7 +10788,7 @@ int whisper_full_with_state(
 
                             if (params.single_segment || params.no_timestamps) {
                                 result_len = i + 1;
-                                seek_delta = 100*WHISPER_CHUNK_SIZE;
+                                seek_delta = n_window;
                             }
 
                             WHISPER_LOG_DEBUG("%s: decoder %d completed\n", __func__, j);
@@ -7386,7 +10798,7 @@ int whisper_full_with_state(
 
                         // TESTS: if no tensors are loaded, it means we are running tests
                         if (ctx->model.n_loaded == 0) {
-                            seek_delta = 100*WHISPER_CHUNK_SIZE;
+                            seek_delta = n_window;
                             completed = true;
                             continue;
                         }
@@ -7394,7 +10806,7 @@ int whisper_full_with_state(
 
                     // sometimes, the decoding can get stuck in a repetition loop
                     // this is an attempt to mitigate such cases - we flag the decoding as failed and use a fallback strategy
-                    if (i == n_max - 1 && (result_len == 0 || seek_delta < 100*WHISPER_CHUNK_SIZE/2)) {
+                    if (i == n_max - 1 && (result_len == 0 || seek_delta < n_window/2)) {
                         WHISPER_LOG_DEBUG("%s: decoder %d: failed due to repetition loop\n", __func__, j);
                         failed = true;
                         continue;
@@ -7423,7 +10835,82 @@ int whisper_full_with_state(
                 state->t_sample_us += ggml_time_us() - t_start_sample_us;
 
                 // obtain logits for the next token
-                {
+                // with speculative decoding, they come from the decode that verified the draft tokens
+                if (spec) {
+                    auto & decoder = state->decoders[0];
+
+                    const int n_past = prompt.size() + i;
+
+                    const whisper_token id = decoder.sequence.tokens.back().id;
+
+                    if (spec_row > 0 && spec_row <= (int) spec_draft.size() && spec_draft[spec_row - 1] == id) {
+                        // the sampled token is the next draft token - its logits are already computed
+                        decoder.i_batch = spec_row++;
+                        state->n_accept++;
+                    } else {
+                        const int64_t t_start_draft_us = ggml_time_us();
+
+                        if (!draft_encoded) {
+                            draft_state->exp_n_audio_ctx = state->exp_n_audio_ctx;
+
+                            // lend the spectrogram to the draft state instead of copying it
+                            std::swap(draft_state->mel, state->mel);
+                            const bool ok = whisper_encode_internal(*params.speculative.ctx, *draft_state, seek, params.n_threads, nullptr, nullptr);
+                            std::swap(draft_state->mel, state->mel);
+
+                            if (!ok) {
+                                WHISPER_LOG_ERROR("%s: failed to encode with the draft model\n", __func__);
+                                return -6;
+                            }
+
+                            whisper_kv_cache_clear(draft_state->kv_self);
+                            draft_tokens.clear();
+
+                            draft_encoded = true;
+                        }
+
+                        spec_context = prompt;
+                        for (const auto & token : decoder.sequence.tokens) {
+                            spec_context.push_back(token.id);
+                        }
+
+                        const int n_draft = std::min(params.speculative.n_draft, whisper_n_text_ctx(ctx) - 1 - n_past);
+
+                        if (!whisper_speculative_draft(*params.speculative.ctx, *draft_state, draft_tokens, spec_context, n_draft, params.n_threads, spec_draft)) {
+                            WHISPER_LOG_WARN("%s: failed to decode with the draft model\n", __func__);
+                        }
+
+                        state->t_draft_us += ggml_time_us() - t_start_draft_us;
+                        state->n_draft    += spec_draft.size();
+
+                        // the cells of the rejected draft tokens
+                        whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
+
+                        auto & batch = state->batch;
+
+                        whisper_batch_prep_legacy(batch, nullptr, spec_draft.size() + 1, n_past, 0);
+
+                        batch.token[0] = id;
+                        for (int k = 0; k < (int) spec_draft.size(); ++k) {
+                            batch.token [k + 1] = spec_draft[k];
+                            batch.logits[k]     = 1;
+                        }
+
+                        if (!whisper_full_decode(*ctx, *state, batch, params)) {
+                            WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                            return -9;
+                        }
+
+                        decoder.i_batch = 0;
+                        spec_row = 1;
+                    }
+
+                    const int64_t t_start_sample_us = ggml_time_us();
+
+                    whisper_process_logits(*ctx, *state, decoder, params, t_cur);
+
+                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
+                } else {
                     auto & batch = state->batch;
 
                     batch.n_tokens = 0;
@@ -7451,53 +10938,23 @@ int whisper_full_with_state(
 
                     assert(batch.n_tokens > 0);
 
-                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                    if (!whisper_full_decode(*ctx, *state, state->batch, params)) {
                         WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
                         return -9;
                     }
 
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    // TODO: avoid memory allocations, optimize, avoid threads?
-                    {
-                        std::atomic<int> j_cur(0);
-
-                        auto process = [&]() {
-                            while (true) {
-                                const int j = j_cur.fetch_add(1);
-
-                                if (j >= n_decoders_cur) {
-                                    break;
-                                }
-
-                                auto & decoder = state->decoders[j];
-
-                                if (decoder.failed || decoder.completed) {
-                                    continue;
-                                }
-
-                                whisper_process_logits(*ctx, *state, decoder, params, t_cur);
-                            }
-                        };
-
-                        const int n_threads = std::min(params.n_threads, n_decoders_cur);
-
-                        if (n_threads == 1) {
-                            process();
-                        } else {
-                            std::vector<std::thread> threads(n_threads - 1);
-
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t] = std::thread(process);
-                            }
-
-                            process();
+                    // TODO: avoid memory allocations, optimize
+                    ctx->threadpool->parallel_for(n_decoders_cur, params.n_threads, [&](int j) {
+                        auto & decoder = state->decoders[j];
 
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t].join();
-                            }
+                        if (decoder.failed || decoder.completed) {
+                            return;
                         }
-                    }
+
+                        whisper_process_logits(*ctx, *state, decoder, params, t_cur);
+                    });
 
                     state->t_sample_us += ggml_time_us() - t_start_sample_us;
                 }
@@ -7566,6 +11023,8 @@ int whisper_full_with_state(
             WHISPER_LOG_DEBUG("\n%s: failed to decode with temperature = %.2f\n", __func__, t_cur);
         }
 
+        decode_group.end();
+
         // output results through a user-provided callback
         {
             const auto & best_decoder = state->decoders[best_decoder_id];
@@ -7706,7 +11165,7 @@ int whisper_full_with_state(
             {
                 const int n_segments = state->result_all.size() - n_segments_before;
                 if (ctx->params.dtw_token_timestamps && n_segments) {
-                    const int n_frames = std::min(std::min(WHISPER_CHUNK_SIZE * 100, seek_delta), seek_end - seek);
+                    const int n_frames = std::min(std::min(n_window, seek_delta), seek_end - seek);
                     whisper_exp_compute_token_level_timestamps_dtw(
                             ctx, state, params, result_all.size() - n_segments, n_segments, seek, n_frames, 7, params.n_threads);
                     if (params.new_segment_callback) {
@@ -7723,7 +11182,7 @@ int whisper_full_with_state(
                 tokens_cur[tokens_cur.size() - 1].id > whisper_token_beg(ctx);
             if (single_timestamp_ending) {
                 WHISPER_LOG_DEBUG("single timestamp ending - skip entire chunk\n");
-                seek_delta = std::min(seek_end - seek, WHISPER_CHUNK_SIZE * 100);
+                seek_delta = std::min(seek_end - seek, n_window);
             }
 
             // update audio window
@@ -7733,6 +11192,8 @@ int whisper_full_with_state(
         }
     }
 
+    group_member.leave();
+
     return 0;
 }
 
@@ -7759,6 +11220,54 @@ int whisper_full(
     return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
 }
 
+// the quietest point in [pos - n_search, pos + n_search), measured over 100 ms
+static int whisper_parallel_find_cut(const float * samples, int n_samples, int pos, int n_search) {
+    const int n_frame = WHISPER_SAMPLE_RATE/100;
+    const int n_avg   = 10;
+
+    const int i0 = std::max(0,         pos - n_search);
+    const int i1 = std::min(n_samples, pos + n_search);
+
+    const int n_frames = (i1 - i0)/n_frame;
+    if (n_frames <= n_avg) {
+        return pos;
+    }
+
+    std::vector<double> energy(n_frames, 0.0);
+    for (int f = 0; f < n_frames; ++f) {
+        const float * x = samples + i0 + f*n_frame;
+        for (int k = 0; k < n_frame; ++k) {
+            energy[f] += x[k]*x[k];
+        }
+    }
+
+    double sum = 0.0;
+    for (int f = 0; f < n_avg; ++f) {
+        sum += energy[f];
+    }
+
+    int    best     = pos;
+    double best_sum = std::numeric_limits<double>::max();
+
+    for (int f = n_avg; ; ++f) {
+        const int cut = i0 + (f - n_avg/2)*n_frame;
+
+        // prefer the candidate closest to the nominal position among equally quiet ones (e.g. digital silence)
+        if (sum < best_sum || (sum == best_sum && std::abs(cut - pos) < std::abs(best - pos))) {
+            best     = cut;
+            best_sum = sum;
+        }
+
+        if (f == n_frames) {
+            break;
+        }
+
+        sum += energy[f] - energy[f - n_avg];
+    }
+
+    return best;
+}
+
 int whisper_full_parallel(
         struct whisper_context * ctx,
         struct whisper_full_params params,
@@ -7778,83 +11287,165 @@ int whisper_full_parallel(
             return -1;
         }
         if (vad_samples.empty()) {
+            ctx->state->result_all.clear();
             return 0;
         }
         samples = vad_samples.data();
         n_samples = vad_samples.size();
     }
-    int ret = 0;
 
-    // prepare separate states for each thread
-    std::vector<whisper_state*> states;
+    const int offset_samples = std::min(n_samples, (WHISPER_SAMPLE_RATE*params.offset_ms)/1000);
 
-    const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
-    const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
+    int end_samples = n_samples;
+    if (params.duration_ms > 0) {
+        end_samples = std::min<int64_t>(n_samples, offset_samples + (int64_t) WHISPER_SAMPLE_RATE*params.duration_ms/1000);
+    }
 
-    // the calling thread will process the first chunk
-    // while the other threads will process the remaining chunks
+    // cut the audio into jobs of about the same length, each cut moved to the quietest point around it
+    struct whisper_parallel_job {
+        whisper_parallel_job(int start, int n) : start(start), n(n) {}
 
-    std::vector<std::thread> workers(n_processors - 1);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        // create a new state for each thread
-        states.push_back(whisper_init_state(ctx));
+        int start;
+        int n;
 
-        const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
-        const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
+        int ret     = 0;
+        int lang_id = 0;
 
-        auto params_cur = params;
+        std::vector<whisper_segment> result;
+    };
 
-        params_cur.offset_ms = 0;
-        params_cur.print_progress = false;
-        params_cur.print_realtime = false;
+    std::vector<whisper_parallel_job> jobs;
+    {
+        const int n_total = end_samples - offset_samples;
+        const int n_min   = WHISPER_PARALLEL_JOB_MIN_S*WHISPER_SAMPLE_RATE;
 
-        params_cur.new_segment_callback = nullptr;
-        params_cur.new_segment_callback_user_data = nullptr;
+        const int n_jobs_max = std::max(1, n_processors*WHISPER_PARALLEL_JOBS_PER_STATE);
+        const int n_jobs_cur = std::max(1, std::min(n_jobs_max, n_total/n_min));
 
-        params_cur.progress_callback = nullptr;
-        params_cur.progress_callback_user_data = nullptr;
+        const int n_job    = n_total/n_jobs_cur;
+        const int n_search = std::min(n_job/4, WHISPER_SAMPLE_RATE*WHISPER_PARALLEL_CUT_SEARCH_MS/1000);
 
-        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+        int start = offset_samples;
+        for (int i = 1; i < n_jobs_cur; ++i) {
+            const int cut = whisper_parallel_find_cut(samples, end_samples, offset_samples + i*n_job, n_search);
+            if (cut > start) {
+                jobs.emplace_back(start, cut - start);
+                start = cut;
+            }
+        }
+        jobs.emplace_back(start, end_samples - start);
     }
 
-    {
-        auto params_cur = params;
+    const int n_jobs    = jobs.size();
+    const int n_workers = std::min(n_processors, n_jobs);
 
-        // We need to disable the print real-time for this one as well, otherwise it will show only for the first chunk.
-        params_cur.print_realtime = false;
+    // worker 0 runs on the default state
+    std::vector<whisper_state *> states;
+    for (int i = 0; i < n_workers - 1; ++i) {
+        states.push_back(whisper_init_state(ctx));
+    }
 
-        // Run the first transformation using default state but only for the first chunk.
-        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
+    // the workers encode and decode in lockstep, so each graph reads the weights once for all of them
+    whisper_decode_group * decode_group = nullptr;
+    if (params.decode_group == nullptr && !ctx->params.dtw_token_timestamps && n_workers > 1) {
+        decode_group = whisper_decode_group_init(ctx, n_workers, true);
+        params.decode_group = decode_group;
     }
 
-    for (int i = 0; i < n_processors - 1; ++i) {
-        workers[i].join();
+    std::atomic<int> i_next(0);
+
+    // progress is reported only from the calling thread, between its own jobs, with the state it has
+    // just finished with - the other states, the default one included, may be in use by the workers
+    const std::thread::id tid_caller = std::this_thread::get_id();
+
+    std::atomic<int> n_done(0);
+    int progress_cur = 0;
+
+    // each worker takes the next job from the queue as soon as it finishes the previous one
+    ctx->threadpool->parallel_for(n_workers, n_workers, [&](int iw) {
+        whisper_state * state = iw == 0 ? ctx->state : states[iw - 1];
+
+        for (int i = i_next++; i < n_jobs; i = i_next++) {
+            auto & job = jobs[i];
+
+            auto params_cur = params;
+
+            params_cur.offset_ms   = 0;
+            params_cur.duration_ms = 0;
+
+            params_cur.print_progress = false;
+            params_cur.print_realtime = false;
+
+            params_cur.new_segment_callback = nullptr;
+            params_cur.new_segment_callback_user_data = nullptr;
+
+            params_cur.progress_callback = nullptr;
+            params_cur.progress_callback_user_data = nullptr;
+
+            job.ret     = whisper_full_with_state(ctx, state, std::move(params_cur), samples + job.start, job.n);
+            job.lang_id = state->lang_id;
+            job.result  = std::move(state->result_all);
+
+            state->result_all.clear();
+
+            const int progress = (100*++n_done)/n_jobs;
+            if (params.progress_callback && std::this_thread::get_id() == tid_caller && progress > progress_cur) {
+                progress_cur = progress;
+                params.progress_callback(ctx, state, progress, params.progress_callback_user_data);
+            }
+        }
+    });
+
+    whisper_decode_group_free(decode_group);
+
+    if (params.progress_callback && progress_cur < 100) {
+        params.progress_callback(ctx, ctx->state, 100, params.progress_callback_user_data);
     }
 
-    const int64_t offset_t = (int64_t) params.offset_ms/10.0;
+    int ret = 0;
+
+    // stitch the results in the order of the audio
+    auto & result_all = ctx->state->result_all;
+    result_all.clear();
+
+    for (auto & job : jobs) {
+        if (ret == 0) {
+            ret = job.ret;
+        }
+
+        const int64_t job_t0 = (100ll*job.start)/WHISPER_SAMPLE_RATE;
+        const int64_t job_t1 = (100ll*(job.start + job.n))/WHISPER_SAMPLE_RATE;
 
-    // combine results into result_state->result_all from all other states
-    for (int i = 0; i < n_processors - 1; ++i) {
-        auto& results_i = states[i]->result_all;
+        for (auto & result : job.result) {
+            // move the timestamps to the position of the job and keep them inside of it
+            result.t0 = std::min(job_t1, std::max(job_t0, result.t0 + job_t0));
+            result.t1 = std::min(job_t1, std::max(job_t0, result.t1 + job_t0));
 
-        for (auto& result : results_i) {
-            // correct the segment timestamp taking into account the offset
-            result.t0 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
-            result.t1 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
+            for (auto & token : result.tokens) {
+                if (token.t0    >= 0) token.t0    += job_t0;
+                if (token.t1    >= 0) token.t1    += job_t0;
+                if (token.t_dtw >= 0) token.t_dtw += job_t0;
+            }
 
             // make sure that segments are not overlapping
-            if (!ctx->state->result_all.empty()) {
-                result.t0 = std::max(result.t0, ctx->state->result_all.back().t1);
+            if (!result_all.empty()) {
+                result.t0 = std::max(result.t0, result_all.back().t1);
             }
+            result.t1 = std::max(result.t1, result.t0);
 
-            ctx->state->result_all.push_back(std::move(result));
+            result_all.push_back(std::move(result));
 
             // call the new_segment_callback for each segment
             if (params.new_segment_callback) {
                 params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
             }
         }
+    }
+
+    ctx->state->lang_id = jobs[0].lang_id;
 
+    // combine the timings of all states
+    for (int i = 0; i < n_workers - 1; ++i) {
         ctx->state->t_mel_us += states[i]->t_mel_us;
 
         ctx->state->t_sample_us += states[i]->t_sample_us;
@@ -7873,18 +11464,15 @@ int whisper_full_parallel(
     }
 
     // average the timings
-    ctx->state->t_mel_us    /= n_processors;
-    ctx->state->t_sample_us /= n_processors;
-    ctx->state->t_encode_us /= n_processors;
-    ctx->state->t_decode_us /= n_processors;
+    ctx->state->t_mel_us    /= n_workers;
+    ctx->state->t_sample_us /= n_workers;
+    ctx->state->t_encode_us /= n_workers;
+    ctx->state->t_decode_us /= n_workers;
 
-    // print information about the audio boundaries
-    WHISPER_LOG_WARN("\n");
-    WHISPER_LOG_WARN("%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
-    for (int i = 0; i < n_processors - 1; ++i) {
-        WHISPER_LOG_WARN("%s: split %d - %s\n", __func__, (i + 1), to_timestamp(100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t).c_str());
+    WHISPER_LOG_INFO("%s: the audio has been split into %d jobs for %d states at the following times:\n", __func__, n_jobs, n_workers);
+    for (int i = 1; i < n_jobs; ++i) {
+        WHISPER_LOG_INFO("%s: split %d - %s\n", __func__, i, to_timestamp((100ll*jobs[i].start)/WHISPER_SAMPLE_RATE).c_str());
     }
-    WHISPER_LOG_WARN("%s: the transcription quality may be degraded near these boundaries\n", __func__);
 
     return ret;
 }
@@ -8157,6 +11745,9 @@ WHISPER_API const char * whisper_bench_memcpy_str(int n_threads) {
 
     // multi-thread
 
+    // the workers are started by the first run and reused by the following ones
+    whisper_threadpool threadpool(n_threads - 1);
+
     for (int32_t k = 1; k <= n_threads; k++) {
         char * src = (char *) malloc(size);
         char * dst = (char *) malloc(size);
@@ -8180,16 +11771,7 @@ WHISPER_API const char * whisper_bench_memcpy_str(int n_threads) {
 
         const int64_t t0 = ggml_time_us();
 
-        std::vector<std::thread> threads(k - 1);
-        for (int32_t th = 0; th < k - 1; ++th) {
-            threads[th] = std::thread(helper, th);
-        }
-
-        helper(k - 1);
-
-        for (int32_t th = 0; th < k - 1; ++th) {
-            threads[th].join();
-        }
+        threadpool.parallel_for(k, k, helper);
 
         const int64_t t1 = ggml_time_us();
 
@@ -8335,6 +11917,252 @@ WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
     return s.c_str();
 }
 
+WHISPER_API int whisper_bench_fft(int n_iter) {
+    fputs(whisper_bench_fft_str(n_iter), stderr);
+    return 0;
+}
+
+WHISPER_API const char * whisper_bench_fft_str(int n_iter) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
+
+    ggml_time_init();
+
+    const int N = WHISPER_N_FFT;
+
+    n_iter = std::max(n_iter, 1);
+
+    const whisper_fft_plan & plan = global_cache.fft_plan;
+
+    std::vector<float> frames(n_iter*N);
+    for (auto & v : frames) {
+        v = 2.0f*rand()/RAND_MAX - 1.0f;
+    }
+
+    // the reference recursive FFT needs room for its intermediate results
+    std::vector<float> ref_in (N*2);
+    std::vector<float> ref_out(N*2*2*2);
+
+    std::vector<float> plan_out(N + 2);
+    std::vector<float> plan_scratch(N);
+
+    double sum     = 0.0;
+    double max_err = 0.0;
+
+    // correctness of the non-redundant bins against the reference
+    for (int i = 0; i < std::min(n_iter, 64); ++i) {
+        std::copy(frames.begin() + i*N, frames.begin() + (i + 1)*N, ref_in.begin());
+        fft(ref_in.data(), N, ref_out.data());
+        whisper_fft_real(plan, frames.data() + i*N, plan_out.data(), plan_scratch.data());
+
+        for (int k = 0; k < N + 2; ++k) {
+            max_err = std::max(max_err, (double) fabsf(ref_out[k] - plan_out[k]));
+        }
+    }
+
+    double t_ref  = 0.0;
+    double t_plan = 0.0;
+
+    {
+        const int64_t t0 = ggml_time_us();
+
+        for (int i = 0; i < n_iter; ++i) {
+            std::copy(frames.begin() + i*N, frames.begin() + (i + 1)*N, ref_in.begin());
+            fft(ref_in.data(), N, ref_out.data());
+            sum += ref_out[2];
+        }
+
+        t_ref = (ggml_time_us() - t0)*1e-6;
+    }
+
+    {
+        const int64_t t0 = ggml_time_us();
+
+        for (int i = 0; i < n_iter; ++i) {
+            whisper_fft_real(plan, frames.data() + i*N, plan_out.data(), plan_scratch.data());
+            sum += plan_out[2];
+        }
+
+        t_plan = (ggml_time_us() - t0)*1e-6;
+    }
+
+    snprintf(strbuf, sizeof(strbuf), "fft %d: reference %8.3f us/frame | plan %8.3f us/frame | speed-up %5.2fx (%d frames)\n",
+            N, 1e6*t_ref/n_iter, 1e6*t_plan/n_iter, t_ref/std::max(t_plan, 1e-9), n_iter);
+    s += strbuf;
+
+    snprintf(strbuf, sizeof(strbuf), "fft %d: max abs error vs reference %g\n", N, max_err);
+    s += strbuf;
+
+    // needed to prevent the compiler from optimizing the loops away
+    snprintf(strbuf, sizeof(strbuf), "sum:    %f\n", sum);
+    s += strbuf;
+
+    return s.c_str();
+}
+
+// transcribe the samples greedily without and with the draft model (twice, the second run reuses the draft state)
+// returns 0 if all the runs produce the same tokens, 1 if they differ and -1 on failure
+static int whisper_bench_speculative_impl(
+        struct whisper_context * ctx,
+        struct whisper_context * ctx_draft,
+                   const float * samples,
+                           int   n_samples,
+                           int   n_threads,
+                 std::string   & s) {
+    s = "";
+    char strbuf[256];
+
+    ggml_time_init();
+
+    whisper_state * state = whisper_init_state(ctx);
+    if (!state) {
+        s = "speculative: failed to init the state\n";
+        return -1;
+    }
+
+    const auto run = [&](struct whisper_context * draft, std::vector<whisper_token> & tokens, double & t) {
+        whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+        params.n_threads       = n_threads;
+        params.print_progress  = false;
+        params.print_realtime  = false;
+        params.temperature_inc = 0.0f; // the draft model is only used at temperature 0
+
+        params.speculative.ctx = draft;
+
+        const int64_t t0 = ggml_time_us();
+        const int ret = whisper_full_with_state(ctx, state, params, samples, n_samples);
+        t = (ggml_time_us() - t0)*1e-6;
+
+        tokens.clear();
+        for (const auto & segment : state->result_all) {
+            for (const auto & token : segment.tokens) {
+                tokens.push_back(token.id);
+            }
+        }
+
+        return ret == 0;
+    };
+
+    std::vector<whisper_token> tokens_greedy;
+    std::vector<whisper_token> tokens_spec;
+    std::vector<whisper_token> tokens_reuse;
+
+    double t_greedy = 0.0;
+    double t_spec   = 0.0;
+    double t_reuse  = 0.0;
+
+    const int32_t n_draft0  = state->n_draft;
+    const int32_t n_accept0 = state->n_accept;
+
+    const bool ok = run(nullptr, tokens_greedy, t_greedy) && run(ctx_draft, tokens_spec, t_spec) && run(ctx_draft, tokens_reuse, t_reuse);
+
+    const int32_t n_draft  = state->n_draft  - n_draft0;
+    const int32_t n_accept = state->n_accept - n_accept0;
+
+    whisper_free_state(state);
+
+    if (!ok) {
+        s = "speculative: whisper_full_with_state failed\n";
+        return -1;
+    }
+
+    const bool same = tokens_spec == tokens_greedy && tokens_reuse == tokens_greedy;
+
+    snprintf(strbuf, sizeof(strbuf), "speculative %d samples: greedy %9.3f ms | draft %9.3f ms | draft (reused state) %9.3f ms | speed-up %5.2fx\n",
+            n_samples, 1e3*t_greedy, 1e3*t_spec, 1e3*t_reuse, t_greedy/std::max(t_reuse, 1e-9));
+    s += strbuf;
+
+    snprintf(strbuf, sizeof(strbuf), "speculative %d samples: %zu tokens, %s the greedy output, %d of %d draft tokens accepted\n",
+            n_samples, tokens_greedy.size(), same ? "same as" : "DIFFERENT from", n_accept, n_draft);
+    s += strbuf;
+
+    return same ? 0 : 1;
+}
+
+WHISPER_API int whisper_bench_tokenize(struct whisper_context * ctx, const char * text, int n_iter) {
+    fputs(whisper_bench_tokenize_str(ctx, text, n_iter), stderr);
+    return 0;
+}
+
+WHISPER_API const char * whisper_bench_tokenize_str(struct whisper_context * ctx, const char * text, int n_iter) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
+
+    ggml_time_init();
+
+    n_iter = std::max(n_iter, 1);
+
+    // a long domain prompt with contractions, numbers, punctuation and non-ASCII text
+    std::string str;
+    if (text) {
+        str = text;
+    } else {
+        for (int i = 0; i < 16; ++i) {
+            str += " The patient's MRI from 12/03/2024 showed a 4.5 mm lesion; we'll re-check it in 6-8 weeks. "
+                   "Dr. Müller-Lüdenscheidt and the naïve café owner didn't agree (see §3.2, p. 17).\n"
+                   "Kubernetes, gRPC, PostgreSQL 16, x86_64, AVX-512 and ARMv8.2-A   are    supported — 東京, São Paulo.  ";
+        }
+    }
+
+    const auto tokens_ref = tokenize_ref(ctx->vocab, str);
+    const auto tokens     = tokenize    (ctx->vocab, str);
+
+    double t_ref  = 0.0;
+    double t_trie = 0.0;
+
+    size_t sum = 0;
+
+    {
+        const int64_t t0 = ggml_time_us();
+
+        for (int i = 0; i < n_iter; ++i) {
+            sum += tokenize_ref(ctx->vocab, str).size();
+        }
+
+        t_ref = (ggml_time_us() - t0)*1e-6;
+    }
+
+    {
+        const int64_t t0 = ggml_time_us();
+
+        for (int i = 0; i < n_iter; ++i) {
+            sum += tokenize(ctx->vocab, str).size();
+        }
+
+        t_trie = (ggml_time_us() - t0)*1e-6;
+    }
+
+    snprintf(strbuf, sizeof(strbuf), "tokenize %zu bytes: reference %9.3f us | trie %9.3f us | speed-up %6.2fx (%d runs)\n",
+            str.size(), 1e6*t_ref/n_iter, 1e6*t_trie/n_iter, t_ref/std::max(t_trie, 1e-9), n_iter);
+    s += strbuf;
+
+    snprintf(strbuf, sizeof(strbuf), "tokenize %zu bytes: %zu tokens, %s the reference\n",
+            str.size(), tokens.size(), tokens == tokens_ref ? "same as" : "DIFFERENT from");
+    s += strbuf;
+
+    // needed to prevent the compiler from optimizing the loops away
+    snprintf(strbuf, sizeof(strbuf), "sum:    %zu\n", sum);
+    s += strbuf;
+
+    return s.c_str();
+}
+
+WHISPER_API int whisper_bench_speculative(struct whisper_context * ctx, struct whisper_context * ctx_draft, const float * samples, int n_samples, int n_threads) {
+    std::string s;
+    const int ret = whisper_bench_speculative_impl(ctx, ctx_draft, samples, n_samples, n_threads, s);
+    fputs(s.c_str(), stderr);
+    return ret;
+}
+
+WHISPER_API const char * whisper_bench_speculative_str(struct whisper_context * ctx, struct whisper_context * ctx_draft, const float * samples, int n_samples, int n_threads) {
+    static std::string s;
+    whisper_bench_speculative_impl(ctx, ctx_draft, samples, n_samples, n_threads, s);
+    return s.c_str();
+}
+
 // =================================================================================================
 
 // =================================================================================================
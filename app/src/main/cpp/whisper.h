@@ -80,6 +80,8 @@ extern "C" {
     struct whisper_context;
     struct whisper_state;
     struct whisper_full_params;
+    struct whisper_threadpool;
+    struct whisper_decode_group;
 
     typedef int32_t whisper_pos;
     typedef int32_t whisper_token;
@@ -126,6 +128,20 @@ extern "C" {
         struct whisper_aheads dtw_aheads;
 
         size_t dtw_mem_size; // TODO: remove
+
+        // map the model file instead of reading it (file loading only)
+        // host tensors whose data is suitably aligned in the file are used in-place without a copy
+        bool use_mmap;
+        bool mmap_prefetch; // hint the kernel to read the whole file ahead of time
+
+        // persistent worker threads for the CPU-side stages (mel spectrogram, sampling, whisper_full_parallel)
+        // NULL - the context creates its own pool
+        // the pool can be shared between contexts and must outlive all of them
+        struct whisper_threadpool * threadpool;
+
+        // low-memory mode: the logits and sampling buffers of a state are allocated on demand
+        // and released at the end of each whisper_full call, so idle states hold no per-vocab memory
+        bool low_mem;
     };
 
     typedef struct whisper_token_data {
@@ -270,6 +286,23 @@ extern "C" {
     WHISPER_API void whisper_free_params(struct whisper_full_params * params);
     WHISPER_API void whisper_free_context_params(struct whisper_context_params * params);
 
+    // Pool of persistent worker threads, see whisper_context_params.threadpool
+    // n_threads is the number of workers in addition to the calling thread (< 0 - number of cores - 1)
+    WHISPER_API struct whisper_threadpool * whisper_threadpool_init(int n_threads);
+    WHISPER_API void                        whisper_threadpool_free(struct whisper_threadpool * pool);
+
+    // Evaluate the decoder steps of several states in one graph, see whisper_full_params.decode_group
+    // The states of a group that decode at the same time (e.g. whisper_full_with_state() on separate threads)
+    // wait for each other at every step, so the decoder weights are read once per step for all of them
+    // Each state keeps its own kv caches and results
+    // n_states_max is the maximum number of states evaluated in one graph
+    // With batch_encoder, whisper_full_with_state() also encodes the audio windows of the states in one graph:
+    // each window waits until every state running whisper_full_with_state() with the group has submitted one,
+    // so this is meant for offline transcription where the states progress at a similar pace
+    // Not supported with dtw_token_timestamps (returns NULL)
+    WHISPER_API struct whisper_decode_group * whisper_decode_group_init(struct whisper_context * ctx, int n_states_max, bool batch_encoder);
+    WHISPER_API void                          whisper_decode_group_free(struct whisper_decode_group * group);
+
     // Convert RAW PCM audio to log mel spectrogram.
     // The resulting spectrogram is stored inside the default state of the provided whisper context.
     // Returns 0 on success
@@ -303,6 +336,38 @@ extern "C" {
                                int   n_len,
                                int   n_mel);
 
+    // Incremental log mel spectrogram for streaming audio [EXPERIMENTAL]
+    // Frames are computed only for the newly pushed samples and the clamping uses a running max over the retained frames.
+    // The retained frames form a sliding window - drop the oldest ones with whisper_mel_stream_discard().
+    // The stream references the filters of the model, so it must be freed before the context.
+    struct whisper_mel_stream;
+
+    WHISPER_API struct whisper_mel_stream * whisper_mel_stream_init(struct whisper_context * ctx);
+    WHISPER_API void whisper_mel_stream_free (struct whisper_mel_stream * stream);
+    WHISPER_API void whisper_mel_stream_reset(struct whisper_mel_stream * stream);
+
+    // Append samples to the stream
+    // Returns the number of new complete frames
+    WHISPER_API int whisper_mel_stream_push(
+            struct whisper_mel_stream * stream,
+                          const float * samples,
+                                  int   n_samples,
+                                  int   n_threads);
+
+    // Drop the n_frames oldest frames of the window
+    WHISPER_API void whisper_mel_stream_discard(struct whisper_mel_stream * stream, int n_frames);
+
+    // Number of complete frames in the window
+    WHISPER_API int whisper_mel_stream_n_len(struct whisper_mel_stream * stream);
+
+    // Store the normalized window as the log mel spectrogram of the state
+    // Follow with whisper_full_with_state(ctx, state, params, NULL, 0) to transcribe it
+    // Returns 0 on success
+    WHISPER_API int whisper_mel_stream_to_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+         struct whisper_mel_stream * stream);
+
     // Run the Whisper encoder on the log mel spectrogram stored inside the default state in the provided whisper context.
     // Make sure to call whisper_pcm_to_mel() or whisper_set_mel() first.
     // offset can be used to specify the offset of the first frame in the spectrogram.
@@ -410,6 +475,7 @@ extern "C" {
 
     // Token logits obtained from the last call to whisper_decode()
     // The logits for the last token are stored in the last row
+    // Only the last row is computed, the rows of the other tokens are zero
     // Rows: n_tokens
     // Cols: n_vocab
     WHISPER_API float * whisper_get_logits           (struct whisper_context * ctx);
@@ -512,7 +578,7 @@ extern "C" {
         // [EXPERIMENTAL] speed-up techniques
         // note: these can significantly reduce the quality of the output
         bool debug_mode;        // enable debug_mode provides extra info (eg. Dump log_mel)
-        int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        int  audio_ctx;         // overwrite the audio context size (0 = use default, -1 = fit each window to the remaining audio)
 
         // [EXPERIMENTAL] [TDRZ] tinydiarize
         bool tdrz_enable;       // enable tinydiarize speaker turn detection
@@ -541,6 +607,10 @@ extern "C" {
         float max_initial_ts;   // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/decoding.py#L97
         float length_penalty;   // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L267
 
+        // truncation of the sampled distribution at t > 0
+        int   top_k;            // sample from the top_k most likely tokens only (0 - all tokens)
+        float top_p;            // sample from the smallest set of tokens whose probability mass reaches top_p (1.0 - all tokens)
+
         // fallback parameters
         // ref: https://github.com/openai/whisper/blob/f82bc59f5ea234d4b97fb2860842ed38519f7e65/whisper/transcribe.py#L274-L278
         float temperature_inc;
@@ -558,6 +628,20 @@ extern "C" {
             float patience; // TODO: not implemented, ref: https://arxiv.org/pdf/2204.05424.pdf
         } beam_search;
 
+        // decode together with the other states that use the same group, see whisper_decode_group_init()
+        // NULL - decode alone
+        struct whisper_decode_group * decode_group;
+
+        // speculative decoding, only used by the greedy decoder at temperature 0
+        // the draft model proposes up to n_draft tokens that are verified with a single decode of this model,
+        // keeping the longest prefix that the greedy decoder would have produced - the output does not change
+        // the state of the draft model is kept in the whisper_state and reused by the next calls with the same ctx,
+        // so the draft context must not be freed before the states it was used with (see whisper_bench_speculative)
+        struct {
+            struct whisper_context * ctx; // draft model with the same vocabulary and mel bins (e.g. tiny), NULL - disabled
+            int n_draft;
+        } speculative;
+
         // called for every newly generated text segment
         whisper_new_segment_callback new_segment_callback;
         void * new_segment_callback_user_data;
@@ -613,11 +697,11 @@ extern "C" {
                            const float * samples,
                                    int   n_samples);
 
-    // Split the input audio in chunks and process each chunk separately using whisper_full_with_state()
-    // Result is stored in the default state of the context
+    // Split the input audio in jobs and process them on n_processors states using whisper_full_with_state()
+    // The audio is cut at its quietest points into several jobs per state, so that the cuts fall between words
+    // and a state that finishes early takes the next job from the queue
+    // Result is stored in the default state of the context, in the order of the audio
     // Not thread safe if executed in parallel on the same context.
-    // It seems this approach can offer some speedup in some cases.
-    // However, the transcription accuracy can be worse at the beginning and end of each chunk.
     WHISPER_API int whisper_full_parallel(
                 struct whisper_context * ctx,
             struct whisper_full_params   params,
@@ -718,6 +802,44 @@ extern "C" {
     WHISPER_API void whisper_vad_free_segments(struct whisper_vad_segments * segments);
     WHISPER_API void whisper_vad_free         (struct whisper_vad_context  * ctx);
 
+    // Incremental VAD for live audio [EXPERIMENTAL]
+    // Samples are pushed in pieces of any size. The LSTM state and the samples of an incomplete window are kept
+    // between the pushes, so the probabilities are the same as with whisper_vad_detect_speech() over the whole audio.
+    // Speech starts once the probability stays at or above threshold for min_speech_duration_ms, and ends after
+    // min_silence_duration_ms below threshold - 0.15 (or after max_speech_duration_s, followed by a new start).
+    // The streams of a context can be used one at a time - each one keeps its own LSTM state.
+    struct whisper_vad_stream;
+
+    enum whisper_vad_event_type {
+        WHISPER_VAD_EVENT_SPEECH_START = 0,
+        WHISPER_VAD_EVENT_SPEECH_END   = 1,
+    };
+
+    typedef struct whisper_vad_event {
+        enum whisper_vad_event_type type;
+        int64_t sample; // position in the stream, including speech_pad_ms
+    } whisper_vad_event;
+
+    WHISPER_API struct whisper_vad_stream * whisper_vad_stream_init(struct whisper_vad_context * vctx, struct whisper_vad_params params);
+    WHISPER_API void whisper_vad_stream_free (struct whisper_vad_stream * stream);
+    WHISPER_API void whisper_vad_stream_reset(struct whisper_vad_stream * stream);
+
+    // Append samples to the stream
+    // Returns the number of events emitted by this push, or -1 on failure
+    WHISPER_API int whisper_vad_stream_push(
+            struct whisper_vad_stream * stream,
+                          const float * samples,
+                                  int   n_samples);
+
+    // The i-th event of the last push, the sample is -1 if i is out of range
+    WHISPER_API struct whisper_vad_event whisper_vad_stream_get_event(struct whisper_vad_stream * stream, int i);
+
+    // True while a speech segment is open
+    WHISPER_API bool whisper_vad_stream_is_speech(struct whisper_vad_stream * stream);
+
+    // Number of samples pushed since the stream was created or reset
+    WHISPER_API int64_t whisper_vad_stream_n_samples(struct whisper_vad_stream * stream);
+
     ////////////////////////////////////////////////////////////////////////////
 
     // Temporary helpers needed for exposing ggml interface
@@ -727,6 +849,19 @@ extern "C" {
     WHISPER_API int          whisper_bench_ggml_mul_mat    (int n_threads);
     WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads);
 
+    // Compare the planned real FFT used by the mel spectrogram against the reference implementation
+    WHISPER_API int          whisper_bench_fft             (int n_iter);
+    WHISPER_API const char * whisper_bench_fft_str         (int n_iter);
+
+    // Compare the trie tokenizer against the reference regex tokenizer on text (a built-in sample if NULL)
+    WHISPER_API int          whisper_bench_tokenize        (struct whisper_context * ctx, const char * text, int n_iter);
+    WHISPER_API const char * whisper_bench_tokenize_str    (struct whisper_context * ctx, const char * text, int n_iter);
+
+    // Check that greedy decoding with the draft model ctx_draft (speculative) gives the same tokens as without it
+    // Returns 0 if the outputs match, 1 if they differ and -1 on failure
+    WHISPER_API int          whisper_bench_speculative     (struct whisper_context * ctx, struct whisper_context * ctx_draft, const float * samples, int n_samples, int n_threads);
+    WHISPER_API const char * whisper_bench_speculative_str (struct whisper_context * ctx, struct whisper_context * ctx_draft, const float * samples, int n_samples, int n_threads);
+
     // Control logging output; default behavior is to print to stderr
 
     WHISPER_API void whisper_log_set(ggml_log_callback log_callback, void * user_data);
@@ -5,6 +5,10 @@
 #include <vector>
 #include <string>
 #include <cstring>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <algorithm>
 
 #define LOG_TAG "NativeWhisper"
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
@@ -16,9 +20,13 @@
 #include "ggml/ggml-backend.h"   // ✅ Needed for ggml_backend_register_cpu()
 #include "ggml-backend-impl.h"
 
-// Global context
+// Global context - model weights only, the per-transcription state lives in the session pool
+// g_ctx and g_language are guarded by g_model_mutex: every transcription holds it shared
+// for its whole duration, loading the model or changing the language holds it exclusively
+// lock order: g_model_mutex -> g_stream_mutex -> g_pool_mutex
 static whisper_context *g_ctx = nullptr;
 static std::string g_language = "en";
+static std::shared_mutex g_model_mutex;
 
 // ----------------------
 // Minimal stubs for missing symbols on Android (CPU-only build)
@@ -48,18 +56,132 @@ static void pcm16_to_float(const int16_t *in, size_t n, std::vector<float> &out)
 }
 
 // ----------------------
-// Simple native API (not JNI)
+// Session pool
 // ----------------------
-extern "C" {
+// The model is loaded once (without a default state) and every concurrent
+// transcription leases its own whisper_state from the pool. States are
+// created lazily up to n_max and reused after release, so the KV caches and
+// compute buffers are allocated only once per session.
+// A transcription claims its session (busy) for the whole call, so a second
+// transcription on the same handle is refused and a release waits for it.
+struct native_session {
+    whisper_state * state  = nullptr;
+    bool            in_use = false;
+    bool            busy   = false; // a transcription is running on the state
+};
+
+struct native_pool {
+    std::vector<native_session *> sessions; // index == handle
+    int n_max = 4;
+};
+
+static native_pool g_pool;
+static std::mutex  g_pool_mutex;
+static std::condition_variable g_pool_cv; // signalled when a session is no longer busy
+
+static void pool_free(native_pool & pool) {
+    for (auto * session : pool.sessions) {
+        if (session->state) {
+            whisper_free_state(session->state);
+        }
+        delete session;
+    }
+    pool.sessions.clear();
+}
 
-bool nativeInitModel(const char* modelPath, const char* language) {
-    if (!modelPath) return false;
+// returns a session handle, or -1 if all n_max sessions are in use
+static int pool_acquire(whisper_context * ctx, native_pool & pool) {
+    for (size_t i = 0; i < pool.sessions.size(); ++i) {
+        if (!pool.sessions[i]->in_use) {
+            pool.sessions[i]->in_use = true;
+            return (int) i;
+        }
+    }
 
-    if (!file_exists(modelPath)) {
-        LOGE("Model file NOT found: %s", modelPath);
+    if ((int) pool.sessions.size() >= pool.n_max) {
+        return -1;
+    }
+
+    whisper_state * state = whisper_init_state(ctx);
+    if (!state) {
+        LOGE("whisper_init_state FAILED");
+        return -1;
+    }
+
+    auto * session = new native_session;
+    session->state  = state;
+    session->in_use = true;
+
+    pool.sessions.push_back(session);
+
+    return (int) pool.sessions.size() - 1;
+}
+
+static native_session * pool_get(native_pool & pool, int handle) {
+    if (handle < 0 || handle >= (int) pool.sessions.size() || !pool.sessions[handle]->in_use) {
+        return nullptr;
+    }
+    return pool.sessions[handle];
+}
+
+// claim a leased session for one transcription, nullptr if the handle is not leased or already busy
+// must be called with g_pool_mutex held
+static native_session * pool_claim(native_pool & pool, int handle) {
+    native_session * session = pool_get(pool, handle);
+    if (!session || session->busy) {
+        return nullptr;
+    }
+    session->busy = true;
+    return session;
+}
+
+static void pool_unclaim(native_session * session) {
+    {
+        std::lock_guard<std::mutex> lock(g_pool_mutex);
+        session->busy = false;
+    }
+    g_pool_cv.notify_all();
+}
+
+static bool session_transcribe(whisper_context * ctx, native_session & session, const float * samples, int n_samples, const char * language, std::string & out) {
+    out.clear();
+
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    wparams.print_progress = false;
+    wparams.print_realtime = false;
+    wparams.translate = false;
+    wparams.language = language;
+    wparams.audio_ctx = -1; // chunks are a few seconds, do not encode the padding up to 30 s
+
+    int rv = whisper_full_with_state(ctx, session.state, wparams, samples, n_samples);
+    if (rv != 0) {
+        LOGE("whisper_full_with_state returned %d", rv);
         return false;
     }
 
+    const int n_segments = whisper_full_n_segments_from_state(session.state);
+    for (int i = 0; i < n_segments; ++i) {
+        const char* seg = whisper_full_get_segment_text_from_state(session.state, i);
+        if (seg) out += seg;
+    }
+
+    return true;
+}
+
+static void stream_reset_global();
+
+// waits for the in-flight transcriptions before the sessions and the context are freed
+static bool load_model(const char * modelPath, const char * language) {
+    std::unique_lock<std::shared_mutex> lock_model(g_model_mutex);
+
+    // the stream holds a session lease, drop it before the pool goes away
+    stream_reset_global();
+
+    {
+        std::lock_guard<std::mutex> lock(g_pool_mutex);
+        pool_free(g_pool);
+    }
+
     if (g_ctx) {
         whisper_free(g_ctx);
         g_ctx = nullptr;
@@ -82,49 +204,472 @@ bool nativeInitModel(const char* modelPath, const char* language) {
 #endif
 #endif
 
-
     whisper_context_params cparams = whisper_context_default_params();
     cparams.use_gpu = false;
+    cparams.low_mem = true; // states stay resident between chunks, keep them small
 
-    g_ctx = whisper_init_from_file_with_params(modelPath, cparams);
+    g_ctx = whisper_init_from_file_with_params_no_state(modelPath, cparams);
     if (!g_ctx) {
-        LOGE("whisper_init_from_file_with_params FAILED for %s", modelPath);
+        LOGE("whisper_init_from_file_with_params_no_state FAILED for %s", modelPath);
         return false;
     }
 
     if (language) g_language = language;
 
-    LOGI("Model initialized (CPU-only): %s", modelPath);
     return true;
 }
 
-const char* nativeTranscribeBuffer(const int16_t* pcm16, int n_samples) {
-    static std::string s_out;
-    s_out.clear();
+// ----------------------
+// Streaming engine
+// ----------------------
+// Audio arrives in small AudioRecord buffers. Each buffer is turned into
+// log mel frames as it arrives (whisper_mel_stream), the most recent
+// length_ms of frames form the window and the model only runs once every
+// step_ms of new audio. The text decoded from the current window is
+// "unstable" (it is re-decoded on every step as more audio arrives);
+// once the window is full the text is committed, its tokens become the
+// prompt for the next window and only keep_ms of audio is carried over.
+// With a VAD model (nativeStreamSetVad) the samples also go through an
+// incremental VAD: silence is dropped without running the model and the
+// window is committed as soon as the speech ends.
+struct stream_params {
+    int step_ms   = 2000;  // decode every step_ms of new audio
+    int length_ms = 8000;  // max audio decoded in a single window
+    int keep_ms   = 200;   // audio carried over into the next window on commit
+    int audio_ctx = -1;    // encoder context (0 = model default, -1 = fit to the audio of the window)
+    int n_threads = 4;
+    int n_prompt_max = 128; // committed tokens fed back as prompt
+};
+
+struct stream_state {
+    stream_params params;
+
+    int session = -1; // leased from g_pool on first push
+
+    whisper_mel_stream * mel = nullptr; // created on first push, holds the frames of the window
+    whisper_vad_stream * vad = nullptr; // created on first push when a VAD model is set
+
+    size_t n_lead = 0;    // samples kept during silence, enough to hold the onset once the VAD declares speech
+
+    size_t n_window = 0;  // samples covered by the window
+    size_t n_new    = 0;  // samples pushed since the last decode
+
+    std::vector<whisper_token> prompt;   // tokens of the committed text
+
+    std::string unstable;  // text of the current (uncommitted) window
+    std::string committed; // text committed by the last push
+};
+
+static stream_state g_stream;
+static std::mutex   g_stream_mutex;
+
+static void stream_reset(stream_state & s);
+
+static void stream_reset_global() {
+    std::lock_guard<std::mutex> lock(g_stream_mutex);
+    stream_reset(g_stream);
+}
+
+// optional VAD model gating the stream, guarded by g_stream_mutex
+static whisper_vad_context * g_vad = nullptr;
+
+static size_t stream_ms_to_samples(int ms) {
+    return (size_t) std::max(0, ms) * WHISPER_SAMPLE_RATE / 1000;
+}
+
+static void stream_reset(stream_state & s) {
+    if (s.session >= 0) {
+        std::lock_guard<std::mutex> lock(g_pool_mutex);
+        if (native_session * session = pool_get(g_pool, s.session)) {
+            session->in_use = false;
+        }
+        s.session = -1;
+    }
+
+    // the mel stream references the filters of the model, drop it with the model
+    if (s.mel) {
+        whisper_mel_stream_free(s.mel);
+        s.mel = nullptr;
+    }
+
+    if (s.vad) {
+        whisper_vad_stream_free(s.vad);
+        s.vad = nullptr;
+    }
+
+    s.n_window = 0;
+    s.n_new    = 0;
+
+    s.prompt.clear();
+    s.unstable.clear();
+    s.committed.clear();
+}
+
+static size_t stream_capacity(const stream_state & s) {
+    return std::max<size_t>(stream_ms_to_samples(s.params.length_ms), 1);
+}
 
-    if (!g_ctx || !pcm16 || n_samples <= 0) return s_out.c_str();
+// drop everything but the newest n_keep samples
+static void stream_keep(stream_state & s, size_t n_keep) {
+    n_keep = std::min(n_keep, s.n_window);
+
+    const int n_frames = whisper_mel_stream_n_len(s.mel) - (int) (n_keep / WHISPER_HOP_LENGTH);
+    whisper_mel_stream_discard(s.mel, n_frames);
+
+    s.n_window = n_keep;
+}
+
+// decode the current window; returns false on failure
+static bool stream_decode(whisper_context * ctx, whisper_state * state, stream_state & s, const char * language) {
+    if (whisper_mel_stream_to_state(ctx, state, s.mel) != 0) {
+        LOGE("stream: whisper_mel_stream_to_state failed");
+        return false;
+    }
+
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    wparams.print_progress   = false;
+    wparams.print_realtime   = false;
+    wparams.print_timestamps = false;
+    wparams.translate        = false;
+    wparams.single_segment   = true;
+    wparams.no_timestamps    = true;
+    wparams.no_context       = true;
+    wparams.max_tokens       = 0;
+    wparams.audio_ctx        = s.params.audio_ctx;
+    wparams.n_threads        = s.params.n_threads;
+    wparams.language         = language;
+    wparams.temperature_inc  = 0.0f; // no fallback, latency matters more than the last bit of accuracy
+
+    wparams.prompt_tokens   = s.prompt.empty() ? nullptr : s.prompt.data();
+    wparams.prompt_n_tokens = (int) s.prompt.size();
+
+    // the mel of the window is already in the state
+    const int rv = whisper_full_with_state(ctx, state, wparams, nullptr, 0);
+    if (rv != 0) {
+        LOGE("stream: whisper_full_with_state returned %d", rv);
+        return false;
+    }
+
+    s.unstable.clear();
+
+    const int n_segments = whisper_full_n_segments_from_state(state);
+    for (int i = 0; i < n_segments; ++i) {
+        const char * seg = whisper_full_get_segment_text_from_state(state, i);
+        if (seg) s.unstable += seg;
+    }
+
+    return true;
+}
+
+// the window is full - the current text becomes final
+static void stream_commit(whisper_context * ctx, whisper_state * state, stream_state & s) {
+    // a push can commit more than one utterance
+    s.committed += s.unstable;
+    s.unstable.clear();
+
+    s.prompt.clear();
+
+    const whisper_token eot = whisper_token_eot(ctx);
+
+    const int n_segments = whisper_full_n_segments_from_state(state);
+    for (int i = 0; i < n_segments; ++i) {
+        const int n_tokens = whisper_full_n_tokens_from_state(state, i);
+        for (int j = 0; j < n_tokens; ++j) {
+            const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
+            if (id < eot) {
+                s.prompt.push_back(id);
+            }
+        }
+    }
+
+    if ((int) s.prompt.size() > s.params.n_prompt_max) {
+        s.prompt.erase(s.prompt.begin(), s.prompt.end() - s.params.n_prompt_max);
+    }
+
+    stream_keep(s, stream_ms_to_samples(s.params.keep_ms));
+}
+
+// push new PCM into the stream
+// returns the text committed by this push (empty most of the time)
+static const std::string & stream_push(whisper_context * ctx, stream_state & s, const float * data, size_t n, const char * language) {
+    s.committed.clear();
+
+    whisper_state * state = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(g_pool_mutex);
+        if (s.session < 0) {
+            s.session = pool_acquire(ctx, g_pool);
+        }
+        if (native_session * session = pool_get(g_pool, s.session)) {
+            state = session->state;
+        }
+    }
+    if (!state) {
+        LOGE("stream: no free session");
+        return s.committed;
+    }
+
+    if (!s.mel) {
+        s.mel = whisper_mel_stream_init(ctx);
+        if (!s.mel) {
+            LOGE("stream: whisper_mel_stream_init failed");
+            return s.committed;
+        }
+    }
+
+    if (g_vad && !s.vad) {
+        const whisper_vad_params vparams = whisper_vad_default_params();
+
+        s.vad = whisper_vad_stream_init(g_vad, vparams);
+
+        // speech is declared min_speech_duration_ms after its onset, up to one VAD window (512 samples) later
+        s.n_lead = std::max(stream_ms_to_samples(s.params.keep_ms),
+                            stream_ms_to_samples(vparams.min_speech_duration_ms + vparams.speech_pad_ms) + 512);
+    }
+
+    // only the new samples are transformed, the frames of the window are kept
+    whisper_mel_stream_push(s.mel, data, (int) n, s.params.n_threads);
+    s.n_window += n;
+    s.n_new    += n;
+
+    if (s.n_window > stream_capacity(s)) {
+        stream_keep(s, stream_capacity(s));
+    }
+
+    if (s.vad) {
+        const int n_events = whisper_vad_stream_push(s.vad, data, (int) n);
+
+        // the events in order - a push can end an utterance and start the next one
+        for (int i = 0; i < n_events; ++i) {
+            const whisper_vad_event ev = whisper_vad_stream_get_event(s.vad, i);
+
+            if (ev.type == WHISPER_VAD_EVENT_SPEECH_END) {
+                // the utterance is over - finish it now instead of waiting for the window to fill up
+                if (stream_decode(ctx, state, s, language)) {
+                    stream_commit(ctx, state, s);
+                }
+            } else {
+                // a new utterance - start the window at its onset (speech_pad_ms included), dropping the silence before it
+                stream_keep(s, (size_t) std::max<int64_t>(0, whisper_vad_stream_n_samples(s.vad) - ev.sample));
+            }
+        }
+
+        if (n_events >= 0 && !whisper_vad_stream_is_speech(s.vad)) {
+            // silence - keep just enough for the onset of the next utterance
+            stream_keep(s, s.n_lead);
+            s.n_new = 0;
+
+            return s.committed;
+        }
+    }
+
+    const size_t n_step = stream_ms_to_samples(s.params.step_ms);
+    if (s.n_new < n_step) {
+        return s.committed;
+    }
+    s.n_new = 0;
+
+    if (!stream_decode(ctx, state, s, language)) {
+        return s.committed;
+    }
+
+    // commit when the next step would no longer fit in the window
+    if (s.n_window + n_step > stream_capacity(s)) {
+        stream_commit(ctx, state, s);
+    }
+
+    return s.committed;
+}
+
+// push PCM16 into the global stream; the committed text is returned by value so
+// callers can use it after g_stream_mutex is released
+static std::string stream_push_pcm16(const int16_t * pcm16, int n_samples) {
+    if (!pcm16 || n_samples <= 0) return std::string();
 
     std::vector<float> pcmf32;
     pcm16_to_float(pcm16, (size_t)n_samples, pcmf32);
 
-    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
-    wparams.print_progress = false;
-    wparams.print_realtime = false;
-    wparams.translate = false;
-    wparams.language = g_language.c_str();
+    std::shared_lock<std::shared_mutex> lock_model(g_model_mutex);
+    if (!g_ctx) return std::string();
 
-    int rv = whisper_full(g_ctx, wparams, pcmf32.data(), (int)pcmf32.size());
-    if (rv != 0) {
-        LOGE("whisper_full returned %d", rv);
+    std::lock_guard<std::mutex> lock(g_stream_mutex);
+    return stream_push(g_ctx, g_stream, pcmf32.data(), pcmf32.size(), g_language.c_str());
+}
+
+// transcribe on a leased session, the text is returned by value so callers can use it
+// after the model lock is released (a reload frees the session)
+static std::string session_transcribe_pcm16(int handle, const int16_t * pcm16, int n_samples, const char * language) {
+    std::shared_lock<std::shared_mutex> lock_model(g_model_mutex);
+
+    if (!g_ctx || !pcm16 || n_samples <= 0) return std::string();
+
+    native_session * session = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(g_pool_mutex);
+        session = pool_claim(g_pool, handle);
+    }
+
+    if (!session) {
+        LOGE("session %d is not leased or already transcribing", handle);
+        return std::string();
+    }
+
+    std::vector<float> pcmf32;
+    pcm16_to_float(pcm16, (size_t)n_samples, pcmf32);
+
+    std::string out;
+    session_transcribe(g_ctx, *session, pcmf32.data(), (int)pcmf32.size(), language ? language : g_language.c_str(), out);
+
+    pool_unclaim(session);
+
+    return out;
+}
+
+static std::string stream_partial() {
+    std::lock_guard<std::mutex> lock(g_stream_mutex);
+    return g_stream.unstable;
+}
+
+// ----------------------
+// Simple native API (not JNI)
+// ----------------------
+extern "C" {
+
+bool nativeInitModel(const char* modelPath, const char* language) {
+    if (!modelPath) return false;
+
+    if (!file_exists(modelPath)) {
+        LOGE("Model file NOT found: %s", modelPath);
+        return false;
+    }
+
+    if (!load_model(modelPath, language)) {
+        return false;
+    }
+
+    LOGI("Model initialized (CPU-only): %s", modelPath);
+    return true;
+}
+
+// max number of concurrently leased sessions (default 4)
+void nativeSetMaxSessions(int n_max) {
+    std::lock_guard<std::mutex> lock(g_pool_mutex);
+    g_pool.n_max = std::max(1, n_max);
+}
+
+// lease a session, returns a handle >= 0 or -1 if none is available
+int nativeSessionAcquire() {
+    std::shared_lock<std::shared_mutex> lock_model(g_model_mutex);
+    if (!g_ctx) return -1;
+
+    std::lock_guard<std::mutex> lock(g_pool_mutex);
+    return pool_acquire(g_ctx, g_pool);
+}
+
+// waits for a transcription running on the session before it is handed back
+void nativeSessionRelease(int handle) {
+    std::unique_lock<std::mutex> lock(g_pool_mutex);
+    g_pool_cv.wait(lock, [handle] {
+        const native_session * session = pool_get(g_pool, handle);
+        return !session || !session->busy;
+    });
+    if (native_session * session = pool_get(g_pool, handle)) {
+        session->in_use = false;
+    }
+}
+
+// transcribe on a leased session; the returned string is owned by the calling
+// thread and stays valid until its next call
+const char* nativeSessionTranscribe(int handle, const int16_t* pcm16, int n_samples, const char* language) {
+    thread_local std::string s_out;
+    s_out = session_transcribe_pcm16(handle, pcm16, n_samples, language);
+
+    return s_out.c_str();
+}
+
+const char* nativeTranscribeBuffer(const int16_t* pcm16, int n_samples) {
+    thread_local std::string s_out;
+    s_out.clear();
+
+    const int handle = nativeSessionAcquire();
+    if (handle < 0) {
+        LOGE("nativeTranscribeBuffer: no free session");
         return s_out.c_str();
     }
 
-    const int n_segments = whisper_full_n_segments(g_ctx);
-    for (int i = 0; i < n_segments; ++i) {
-        const char* seg = whisper_full_get_segment_text(g_ctx, i);
-        if (seg) s_out += seg;
+    s_out = session_transcribe_pcm16(handle, pcm16, n_samples, nullptr);
+    nativeSessionRelease(handle);
+
+    return s_out.c_str();
+}
+
+void nativeStreamConfigure(int step_ms, int length_ms, int keep_ms, int audio_ctx) {
+    std::lock_guard<std::mutex> lock(g_stream_mutex);
+
+    stream_params & p = g_stream.params;
+    p.step_ms   = std::max(100, step_ms);
+    p.length_ms = std::max(p.step_ms, length_ms);
+    p.keep_ms   = std::min(std::max(0, keep_ms), p.length_ms - p.step_ms);
+    p.audio_ctx = std::max(-1, audio_ctx);
+
+    stream_reset(g_stream);
+}
+
+// gate the stream with a Silero VAD model, nullptr/"" disables the gate
+bool nativeStreamSetVad(const char* vadModelPath) {
+    std::lock_guard<std::mutex> lock(g_stream_mutex);
+
+    // the VAD stream references the context, drop it first
+    stream_reset(g_stream);
+
+    if (g_vad) {
+        whisper_vad_free(g_vad);
+        g_vad = nullptr;
+    }
+
+    if (!vadModelPath || !*vadModelPath) {
+        return true;
+    }
+
+    if (!file_exists(vadModelPath)) {
+        LOGE("VAD model file NOT found: %s", vadModelPath);
+        return false;
+    }
+
+    whisper_vad_context_params vparams = whisper_vad_default_context_params();
+    vparams.n_threads = 1; // the network is tiny, more threads only add latency
+    vparams.use_gpu   = false;
+
+    g_vad = whisper_vad_init_from_file_with_params(vadModelPath, vparams);
+    if (!g_vad) {
+        LOGE("Failed to load VAD model: %s", vadModelPath);
+        return false;
     }
 
+    LOGI("Stream VAD initialized: %s", vadModelPath);
+    return true;
+}
+
+void nativeStreamReset() {
+    std::lock_guard<std::mutex> lock(g_stream_mutex);
+    stream_reset(g_stream);
+}
+
+// feed PCM16 mono @ 16 kHz, returns newly committed text (usually empty)
+// the string is owned by the calling thread and stays valid until its next call
+const char* nativeStreamPush(const int16_t* pcm16, int n_samples) {
+    thread_local std::string s_out;
+    s_out = stream_push_pcm16(pcm16, n_samples);
+
+    return s_out.c_str();
+}
+
+// text decoded from the current window that may still change
+// the string is owned by the calling thread and stays valid until its next call
+const char* nativeStreamPartial() {
+    thread_local std::string s_out;
+    s_out = stream_partial();
+
     return s_out.c_str();
 }
 
@@ -142,50 +687,90 @@ Java_com_axo_transcribidor_MainActivity_nativeInit(
 
     LOGI("Initializing whisper model from %s", model_path);
 
-    if (g_ctx) {
-        whisper_free(g_ctx);
-        g_ctx = nullptr;
-    }
-
-    // ✅ Must call before whisper_init_from_file_with_params
-#ifdef GGML_USE_CPU
-#if defined(ggml_backend_register_cpu)
-    ggml_backend_register_cpu();
-#elif defined(GGML_BACKEND_REG_CPU)
-    ggml_backend_register(GGML_BACKEND_REG_CPU());
-#else
-    if (ggml_backend_cpu_reg) {
-        // Register manually (older GGML API)
-        ggml_backend_reg_t reg = ggml_backend_cpu_reg();
-        if (reg) {
-            // nothing to do, registration happens automatically in whisper_init
-        }
-    }
-#endif
-#endif
-
-
-    whisper_context_params cparams = whisper_context_default_params();
-    cparams.use_gpu = false;
-
-    g_ctx = whisper_init_from_file_with_params(model_path, cparams);
-    if (!g_ctx) {
-        LOGE("whisper_init_from_file_with_params FAILED for %s", model_path);
+    if (!load_model(model_path, lang)) {
         env->ReleaseStringUTFChars(modelPath, model_path);
         env->ReleaseStringUTFChars(language, lang);
         return JNI_FALSE;
     }
 
     if (lang) {
-        g_language = lang;
-        LOGI("Language set to: %s", g_language.c_str());
+        LOGI("Language set to: %s", lang);
     }
 
     env->ReleaseStringUTFChars(modelPath, model_path);
     env->ReleaseStringUTFChars(language, lang);
+
     LOGI("Whisper initialized successfully!");
     return JNI_TRUE;
 }
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_axo_transcribidor_MainActivity_nativeSetLanguage(
+        JNIEnv* env, jobject /*thiz*/, jstring language) {
+
+    const char* lang = env->GetStringUTFChars(language, nullptr);
+
+    {
+        // waits for the in-flight transcriptions, which read the language
+        std::unique_lock<std::shared_mutex> lock_model(g_model_mutex);
+        if (lang) g_language = lang;
+
+        // the committed prompt belongs to the old language, start over
+        stream_reset_global();
+
+        LOGI("Language set to: %s", g_language.c_str());
+    }
+
+    env->ReleaseStringUTFChars(language, lang);
+}
+
+// PCM16 little-endian mono @ 16 kHz straight from AudioRecord
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_axo_transcribidor_MainActivity_nativeTranscribeChunk(
+        JNIEnv* env, jobject /*thiz*/, jbyteArray audioChunk) {
+
+    const jsize n_bytes = env->GetArrayLength(audioChunk);
+    if (n_bytes < 2) {
+        return env->NewStringUTF("");
+    }
+
+    std::vector<int16_t> pcm16(n_bytes/2);
+    env->GetByteArrayRegion(audioChunk, 0, (jsize) (pcm16.size()*sizeof(int16_t)), reinterpret_cast<jbyte*>(pcm16.data()));
+
+    const std::string text = stream_push_pcm16(pcm16.data(), (int) pcm16.size());
+
+    return env->NewStringUTF(text.c_str());
+}
+
+extern "C" JNIEXPORT jint JNICALL
+Java_com_axo_transcribidor_MainActivity_nativeSessionOpen(
+        JNIEnv* /*env*/, jobject /*thiz*/) {
+    return nativeSessionAcquire();
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_axo_transcribidor_MainActivity_nativeSessionClose(
+        JNIEnv* /*env*/, jobject /*thiz*/, jint handle) {
+    nativeSessionRelease(handle);
+}
+
+// full (non-streaming) transcription of PCM16 on a leased session
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_axo_transcribidor_MainActivity_nativeSessionTranscribe(
+        JNIEnv* env, jobject /*thiz*/, jint handle, jbyteArray audio) {
+
+    const jsize n_bytes = env->GetArrayLength(audio);
+    if (n_bytes < 2) {
+        return env->NewStringUTF("");
+    }
+
+    std::vector<int16_t> pcm16(n_bytes/2);
+    env->GetByteArrayRegion(audio, 0, (jsize) (pcm16.size()*sizeof(int16_t)), reinterpret_cast<jbyte*>(pcm16.data()));
+
+    const std::string text = session_transcribe_pcm16(handle, pcm16.data(), (int) pcm16.size(), nullptr);
+
+    return env->NewStringUTF(text.c_str());
+}
 extern "C" {
 #include "ggml/ggml.h"
 #include "ggml/ggml-backend.h"
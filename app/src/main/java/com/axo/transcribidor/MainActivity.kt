@@ -34,6 +34,11 @@ class MainActivity : ComponentActivity() {
     external fun nativeSetLanguage(language: String)
     external fun nativeTranscribeChunk(audioChunk: ByteArray): String
 
+    // independent sessions sharing the loaded model (returns -1 when none is free)
+    external fun nativeSessionOpen(): Int
+    external fun nativeSessionTranscribe(handle: Int, audio: ByteArray): String
+    external fun nativeSessionClose(handle: Int)
+
 private fun prepareModel(): String {
     val modelDir = File(filesDir, "models")
     if (!modelDir.exists()) modelDir.mkdirs()